@@ -0,0 +1,421 @@
+#include "cache.h"
+
+#include <unistd.h>
+#include <sys/time.h>
+
+/*
+ * 把指定 commit 可以到达的对象写入一个 bundle 文件(格式见 cache.h), 用 unbundle 导入到另一个对象库
+ *
+ * "^A" (或者 "A..B") 表示接收方已经有 commit A 和它可以到达的所有对象, 这些对象不需要写入:
+ * 1. 和 rev-list 一样遍历 commit, UNINTERESTING 标记沿 parent 传递, 得到要写入的 commit
+ * 2. 要写入的 commit 中, parent 是 UNINTERESTING 的就是边界, 记录在文件头中(接收方必须已经有),
+ *    边界 commit 的 tree 及其中所有的 tree/blob 都标记为 UNINTERESTING
+ * 3. 遍历要写入的 commit 的 tree, 跳过 UNINTERESTING 的 tree/blob, 其余的都写入
+ * 第 2 步只标记边界 commit 的 tree, 更早的 commit 中有但边界 commit 中没有的对象仍然会写入,
+ * 所以 bundle 中可能有接收方已经有的对象, 但不会缺少对象.
+ *
+ * 要写入的对象按 sha1 排序后直接复制对象文件, 接收方按目录顺序写入.
+ */
+/* commit 的 flags: 已经作为边界记录在文件头中 */
+#define PREREQUISITE	0x0008
+
+struct bundle_object {
+	unsigned char sha1[20];
+	unsigned int flags;	/* SEEN: 要写入; UNINTERESTING: 接收方已经有 */
+};
+
+/* 已经处理过的 tree/blob (开放寻址哈希表) */
+static struct bundle_object *objects;
+static unsigned long objects_nr, objects_size;
+
+/* 要写入的对象, 最后按 sha1 排序 */
+static unsigned char (*output)[20];
+static unsigned long output_nr, output_alloc;
+
+/* 待读取的 tree */
+static unsigned char (*pending)[20];
+static unsigned long pending_nr, pending_alloc;
+
+static struct dircache repo;
+static struct dircache_handle handle;
+static struct dircache_buffer buf;
+
+static unsigned long nr_commits, nr_trees, nr_blobs, nr_prerequisites;
+
+/* 输出缓冲区, 写出的数据同时计算校验和 */
+static char out_buf[1 << 20];
+static unsigned long out_len, out_total;
+static SHA_CTX out_ctx;
+static const char *out_path;
+static int out_fd = 1;
+
+static void die(const char *fmt, const char *arg)
+{
+	fprintf(stderr, "bundle: ");
+	fprintf(stderr, fmt, arg);
+	fprintf(stderr, "\n");
+	/* 不留下不完整的文件 */
+	if (out_path)
+		unlink(out_path);
+	exit(1);
+}
+
+static int is_null_sha1(const unsigned char *sha1)
+{
+	static const unsigned char null_sha1[20];
+
+	return !memcmp(sha1, null_sha1, 20);
+}
+
+static struct bundle_object *lookup_object(const unsigned char *sha1)
+{
+	unsigned long i;
+
+	if (objects_nr * 2 >= objects_size) {
+		struct bundle_object *old = objects;
+		unsigned long old_size = objects_size;
+
+		objects_size = objects_size ? objects_size * 2 : 65536;
+		objects = calloc(objects_size, sizeof(struct bundle_object));
+		objects_nr = 0;
+		for (i = 0; i < old_size; i++)
+			if (!is_null_sha1(old[i].sha1))
+				*lookup_object(old[i].sha1) = old[i];
+		free(old);
+	}
+	i = (sha1[0] << 24 | sha1[1] << 16 | sha1[2] << 8 | sha1[3]) & (objects_size - 1);
+	while (!is_null_sha1(objects[i].sha1)) {
+		if (!memcmp(objects[i].sha1, sha1, 20))
+			return objects + i;
+		i = (i + 1) & (objects_size - 1);
+	}
+	memcpy(objects[i].sha1, sha1, 20);
+	objects_nr++;
+	return objects + i;
+}
+
+static void add_output(const unsigned char *sha1)
+{
+	if (output_nr == output_alloc) {
+		output_alloc = alloc_nr(output_alloc);
+		output = realloc(output, output_alloc * 20);
+	}
+	memcpy(output[output_nr++], sha1, 20);
+}
+
+/* 标记一个 tree/blob (flags 为 SEEN 或 UNINTERESTING), 已经标记过的直接返回 */
+static void add_object(const unsigned char *sha1, int is_tree, int flags)
+{
+	struct bundle_object *obj = lookup_object(sha1);
+
+	if (obj->flags)
+		return;
+	obj->flags = flags;
+	if (flags == SEEN) {
+		add_output(sha1);
+		if (is_tree)
+			nr_trees++;
+		else
+			nr_blobs++;
+	}
+	if (!is_tree)
+		return;
+	if (pending_nr == pending_alloc) {
+		pending_alloc = alloc_nr(pending_alloc);
+		pending = realloc(pending, pending_alloc * 20);
+	}
+	memcpy(pending[pending_nr++], sha1, 20);
+}
+
+/* 标记 tree 以及其中所有的 tree/blob (不使用递归) */
+static void add_tree(const unsigned char *sha1, int flags)
+{
+	add_object(sha1, 1, flags);
+	while (pending_nr) {
+		unsigned char tree[20];
+		struct tree_desc desc;
+		struct name_entry entry;
+		char type[20];
+		int ret;
+
+		memcpy(tree, pending[--pending_nr], 20);
+		if (dircache_read_object(&handle, tree, type, &buf) < 0 || strcmp(type, "tree"))
+			die("bad tree %s", sha1_to_hex(tree));
+		init_tree_desc(&desc, buf.buf, buf.len);
+		while ((ret = tree_entry(&desc, &entry)) > 0)
+			add_object(entry.sha1, S_ISDIR(entry.mode), flags);
+		if (ret < 0)
+			die("bad tree %s", sha1_to_hex(tree));
+	}
+}
+
+/*
+ * 遍历 commit (和 rev-list 相同)
+ */
+static int nr_interesting;
+
+static void queue_commit(struct commit_queue *queue, struct commit *commit)
+{
+	if (commit->flags & SEEN)
+		return;
+	commit->flags |= SEEN | IN_QUEUE;
+	if (parse_commit(commit) < 0)
+		die("bad commit %s", sha1_to_hex(commit->sha1));
+	if (!(commit->flags & UNINTERESTING))
+		nr_interesting++;
+	commit_queue_put(queue, commit);
+}
+
+static void mark_uninteresting(struct commit *commit)
+{
+	struct commit_list *stack = NULL, *list;
+
+	for (;;) {
+		if (!(commit->flags & UNINTERESTING)) {
+			commit->flags |= UNINTERESTING;
+			if (commit->flags & IN_QUEUE)
+				nr_interesting--;
+			if (commit->parsed) {
+				for (list = commit->parents; list; list = list->next) {
+					struct commit_list *item = malloc(sizeof(*item));
+					item->item = list->item;
+					item->next = stack;
+					stack = item;
+				}
+			}
+		}
+		if (!stack)
+			break;
+		list = stack;
+		commit = list->item;
+		stack = list->next;
+		free(list);
+	}
+}
+
+/* 写入 bundle, 同时计算校验和 */
+static void flush_output(void)
+{
+	if (write_in_full(out_fd, out_buf, out_len) < 0)
+		die("unable to write %s", out_path ? out_path : "stdout");
+	out_len = 0;
+}
+
+static void write_output(const void *data, unsigned long len)
+{
+	SHA1_Update(&out_ctx, data, len);
+	out_total += len;
+	if (out_len + len > sizeof(out_buf))
+		flush_output();
+	if (len > sizeof(out_buf)) {
+		if (write_in_full(out_fd, data, len) < 0)
+			die("unable to write %s", out_path ? out_path : "stdout");
+		return;
+	}
+	memcpy(out_buf + out_len, data, len);
+	out_len += len;
+}
+
+static void write_line(const char *prefix, const unsigned char *sha1)
+{
+	char line[43];
+
+	sprintf(line, "%s%s\n", prefix, sha1_to_hex((unsigned char *)sha1));
+	write_output(line, strlen(line));
+}
+
+/* 原样复制对象文件, 复制之前检查 sha1, 不把损坏的对象传给接收方 */
+static void write_object(const unsigned char *sha1)
+{
+	unsigned char len[4], real[20];
+	struct stat st;
+	SHA_CTX c;
+	int fd;
+
+	fd = dircache_open_object(&repo, sha1);
+	if (fd < 0)
+		die("missing object %s", sha1_to_hex((unsigned char *)sha1));
+	if (fstat(fd, &st) < 0)
+		die("unable to read object %s", sha1_to_hex((unsigned char *)sha1));
+	/* 长度只有 4 字节, 4G 以上的对象放不进 bundle, 不能截断 */
+	if (st.st_size > 0xffffffff)
+		die("object %s is too large for a bundle", sha1_to_hex((unsigned char *)sha1));
+	if (dircache_buffer_grow(&buf, st.st_size) < 0 ||
+	    read_in_full(fd, buf.buf, st.st_size) < 0)
+		die("unable to read object %s", sha1_to_hex((unsigned char *)sha1));
+	close(fd);
+	SHA1_Init(&c);
+	SHA1_Update(&c, buf.buf, st.st_size);
+	SHA1_Final(real, &c);
+	if (memcmp(real, sha1, 20))
+		die("corrupt object %s", sha1_to_hex((unsigned char *)sha1));
+	len[0] = st.st_size >> 24;
+	len[1] = st.st_size >> 16;
+	len[2] = st.st_size >> 8;
+	len[3] = st.st_size;
+	write_output(sha1, 20);
+	write_output(len, 4);
+	write_output(buf.buf, st.st_size);
+}
+
+static int compare_sha1(const void *a, const void *b)
+{
+	return memcmp(a, b, 20);
+}
+
+static void add_argument(struct commit_queue *queue, struct commit_list **tips, char *arg, int flags)
+{
+	unsigned char sha1[20];
+	struct commit *commit;
+
+	if (strlen(arg) != 40 || get_sha1_hex(arg, sha1))
+		usage("bundle <file> <commit>... [^<commit>]... | <commit>..<commit>");
+	commit = lookup_commit(sha1);
+	if (flags)
+		mark_uninteresting(commit);
+	else {
+		struct commit_list *item = malloc(sizeof(*item));
+		item->item = commit;
+		item->next = *tips;
+		*tips = item;
+	}
+	queue_commit(queue, commit);
+}
+
+/*
+ * 命令: "bundle <file> <commit>... [^<commit>]... | <commit>..<commit>"
+ * 示例: $ ./bundle update.bundle fc4d6681a2878fa9eecadb7efe96d96d8580928c..c82df15b2137ec4a6b7927ce6a3141c5abc20015
+ *
+ * file 为 "-" 时写到 stdout
+ */
+int main(int argc, char **argv)
+{
+	struct commit_queue queue = { NULL, 0, 0, 0 };
+	struct commit_list *tips = NULL, *list, *commits = NULL, **tail = &commits;
+	struct commit *commit;
+	unsigned long i, usec;
+	struct timeval start, end;
+	unsigned char sha1[20];
+	char line[64];
+
+	if (argc < 3)
+		usage("bundle <file> <commit>... [^<commit>]... | <commit>..<commit>");
+	gettimeofday(&start, NULL);
+	if (dircache_init(&repo, NULL) < 0 || dircache_handle_init(&handle, &repo) < 0)
+		die("%s", "out of memory");
+
+	for (i = 2; i < argc; i++) {
+		char *arg = argv[i], *dots;
+
+		if (*arg == '^') {
+			add_argument(&queue, &tips, arg + 1, UNINTERESTING);
+			continue;
+		}
+		dots = strstr(arg, "..");
+		if (dots) {
+			*dots = 0;
+			add_argument(&queue, &tips, arg, UNINTERESTING);
+			add_argument(&queue, &tips, dots + 2, 0);
+			continue;
+		}
+		add_argument(&queue, &tips, arg, 0);
+	}
+	if (!tips)
+		usage("bundle: no commits to bundle");
+
+	/* 1. 要写入的 commit */
+	while (nr_interesting && (commit = commit_queue_get(&queue)) != NULL) {
+		struct commit_list *parents;
+
+		commit->flags &= ~IN_QUEUE;
+		if (!(commit->flags & UNINTERESTING))
+			nr_interesting--;
+		for (parents = commit->parents; parents; parents = parents->next) {
+			if (commit->flags & UNINTERESTING)
+				mark_uninteresting(parents->item);
+			queue_commit(&queue, parents->item);
+		}
+		if (commit->flags & UNINTERESTING)
+			continue;
+		*tail = malloc(sizeof(struct commit_list));
+		(*tail)->item = commit;
+		(*tail)->next = NULL;
+		tail = &(*tail)->next;
+	}
+
+	SHA1_Init(&out_ctx);
+	if (strcmp(argv[1], "-")) {
+		out_fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (out_fd < 0)
+			die("unable to create %s", argv[1]);
+		out_path = argv[1];
+	}
+	write_output(BUNDLE_SIGNATURE, strlen(BUNDLE_SIGNATURE));
+
+	/* 2. 边界 commit 和它们的 tree */
+	for (list = commits; list; list = list->next) {
+		struct commit_list *parents;
+
+		for (parents = list->item->parents; parents; parents = parents->next) {
+			struct commit *parent = parents->item;
+
+			if (!(parent->flags & UNINTERESTING) || (parent->flags & PREREQUISITE))
+				continue;
+			parent->flags |= PREREQUISITE;
+			if (parse_commit(parent) < 0)
+				die("bad commit %s", sha1_to_hex(parent->sha1));
+			write_line("-", parent->sha1);
+			add_tree(parent->tree, UNINTERESTING);
+			nr_prerequisites++;
+		}
+	}
+	for (list = tips; list; list = list->next)
+		write_line("", list->item->sha1);
+
+	/* 3. 要写入的 commit 和它们的 tree */
+	for (list = commits; list; list = list->next) {
+		add_output(list->item->sha1);
+		add_tree(list->item->tree, SEEN);
+		nr_commits++;
+	}
+	qsort(output, output_nr, 20, compare_sha1);
+	sprintf(line, "objects %lu\n", output_nr);
+	write_output(line, strlen(line));
+	for (i = 0; i < output_nr; i++)
+		write_object(output[i]);
+
+	SHA1_Final(sha1, &out_ctx);
+	flush_output();
+	if (write_in_full(out_fd, sha1, 20) < 0 || (out_path && close(out_fd) < 0))
+		die("unable to write %s", out_path ? out_path : "stdout");
+	out_total += 20;
+
+	gettimeofday(&end, NULL);
+	usec = (end.tv_sec - start.tv_sec) * 1000000 + end.tv_usec - start.tv_usec;
+	fprintf(stderr, "%lu commits, %lu trees, %lu blobs, %lu prerequisites, %lu KB in %lu.%03lu s\n",
+		nr_commits, nr_trees, nr_blobs, nr_prerequisites, out_total >> 10, usec / 1000000, usec / 1000 % 1000);
+	arena_release();
+	return 0;
+}
+
+/* #
+ * # bundle 使用示例
+ * #
+ *
+ * # 1. 第一次提交可以到达的所有对象
+ * git-e83c5163$ ./bundle /tmp/first.bundle fc4d6681a2878fa9eecadb7efe96d96d8580928c
+ * 1 commits, 2 trees, 3 blobs, 0 prerequisites, 108 KB in 0.001 s
+ *
+ * # 2. 第一次提交之后的提交, 接收方必须已经有第一次提交(文件头中 '-' 开头的行)
+ * git-e83c5163$ ./bundle /tmp/update.bundle fc4d6681a2878fa9eecadb7efe96d96d8580928c..c82df15b2137ec4a6b7927ce6a3141c5abc20015
+ * 2 commits, 5 trees, 3 blobs, 1 prerequisites, 171 KB in 0.001 s
+ * git-e83c5163$ head -4 /tmp/update.bundle
+ * # dircache bundle v1
+ * -fc4d6681a2878fa9eecadb7efe96d96d8580928c
+ * c82df15b2137ec4a6b7927ce6a3141c5abc20015
+ * objects 10
+ *
+ * # 3. fast-import 导入的 20001 个 commit, 前 10001 个 commit 已经给了接收方, 只写入后 10000 个 commit 新增的 50000 个对象
+ * git-e83c5163$ ./bundle /tmp/inc.bundle 8689d284c94030253ec6f179e88895aaedec016b..7125ecc424e03150ec32ac89fa3fc226bc74e862
+ * 10000 commits, 30000 trees, 10000 blobs, 1 prerequisites, 23459 KB in 1.024 s
+ */
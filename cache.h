@@ -67,15 +67,44 @@ struct cache_entry {
 	unsigned char name[0];
 };
 
+/*
+ * 以下变量定义在 read-cache.c 中, 头文件中只做声明
+ * (原来直接在头文件中定义, 每个包含 cache.h 的文件都有一份, 新版本的编译器链接时会报重复定义)
+ */
 /* 用于存储版本库目录路径, 默认为 ".dircache/objects", 实际没有使用, 每次都重新设置 */
-const char *sha1_file_directory;
+extern const char *sha1_file_directory;
 /* 内存中的 cache entry 缓存数组指针 */
-struct cache_entry **active_cache = NULL;
+extern struct cache_entry **active_cache;
 /*
  *    active_nr: 为暂存区文件 ".dircache/index" 包含的实际 cache entry 数目
  * active_alloc: 为内存中可存放的 cache entry 数目(前面 cative_nr 部分已使用)
  */
-unsigned int active_nr = 0, active_alloc = 0;
+extern unsigned int active_nr, active_alloc;
+
+/*
+ * 索引文件在所有 cache entry 之后可以跟着若干扩展数据, 每个扩展以 cache_extension 开头,
+ * size 为后面数据的长度. 扩展数据同样计入 header 中的 sha1 值.
+ */
+struct cache_extension {
+	unsigned int signature;
+	unsigned int size;
+};
+
+/*
+ * "TREE" 扩展: 记录上一次 write-tree 时每个目录的 tree 对象
+ * name 为目录名(不包含结尾的 '/', 顶层目录为空), entries 为该目录下(包括子目录)的条目数,
+ * entries 为 -1 表示该目录下的条目有变化, 缓存的 tree 对象已经失效(不会写入索引文件)
+ */
+#define CACHE_TREE_SIGNATURE 0x45455254	/* "TREE" */
+struct cache_tree {
+	unsigned char sha1[20];
+	int entries;
+	unsigned short namelen;
+	unsigned char name[0];
+};
+
+extern struct cache_tree **active_tree;
+extern unsigned int tree_nr, tree_alloc;
 
 /*
  * 版本库目录的环境变量和默认名称, 当前git版本库目录已经改为".git/objects"了
@@ -92,15 +121,199 @@ unsigned int active_nr = 0, active_alloc = 0;
  */
 #define ce_size(ce) cache_entry_size((ce)->namelen)
 
+/* tree 缓存记录的大小(8字节对齐) */
+#define cache_tree_size(len) ((offsetof(struct cache_tree,name) + (len) + 8) & ~7)
+#define ct_size(ct) cache_tree_size((ct)->namelen)
+
 #define alloc_nr(x) (((x)+16)*3/2)
 
+/* match_stat() 的返回值, 表示 cache entry 和工作区文件哪些信息不一致 */
+#define MTIME_CHANGED	0x0001
+#define CTIME_CHANGED	0x0002
+#define OWNER_CHANGED	0x0004
+#define MODE_CHANGED    0x0008
+#define INODE_CHANGED   0x0010
+#define DATA_CHANGED    0x0020
+
+/*
+ * sparse checkout (cone 模式): ".dircache/sparse" 每行一个目录
+ * 工作区只包含顶层文件, 列出目录下的所有文件, 以及这些目录的各级父目录下的直接文件
+ * 范围以外的条目仍然保留在暂存区中, 但各工具不会去访问工作区中对应的文件
+ */
+#define SPARSE_FILE ".dircache/sparse"
+extern char **sparse_dirs;
+extern int sparse_nr;
+
+/*
+ * 简单的 bump-pointer 分配器(arena), 所有工具共用
+ * cache entry 这类在整个运行期间都有效的小块内存, 以及临时的 scratch 缓冲区,
+ * 都从按块(chunk)分配的大内存中顺序切分, 不需要逐个 free, 运行结束时一次性释放.
+ * scratch 缓冲区使用 arena_mark()/arena_rewind() 成对使用, 回退后的内存可以重复使用.
+ * 设置环境变量 DIRCACHE_STATS 后, arena_release() 会在 stderr 输出分配统计.
+ */
+struct arena_chunk;
+struct arena_mark {
+	struct arena_chunk *chunk, *big;
+	unsigned long used;
+};
+
+extern void *arena_alloc(unsigned long size);
+extern void arena_mark(struct arena_mark *mark);
+extern void arena_rewind(struct arena_mark *mark);
+extern void arena_release(void);
+
 /* Initialize the cache information */
 /* 读取索引文件".dircache/index", 建立缓存, 返回条目数 */
 extern int read_cache(void);
 
+/* 比较两个路径, 规则和 memcmp 相同, 前面部分相同时短的路径在前 */
+extern int cache_name_compare(const char *name1, int len1, const char *name2, int len2);
+
+/* 将 cache entry (以及缓存的 tree 对象)写入到 newfd 指定的文件中 */
+extern int write_cache(int newfd, struct cache_entry **cache, int entries);
+
+/* 缓存的 tree 对象: 查找, 更新, 以及路径有变化时使各级目录的记录失效 */
+extern int cache_tree_pos(const char *name, int namelen);
+extern struct cache_tree *cache_tree_lookup(const char *name, int namelen);
+extern void cache_tree_update(const char *name, int namelen, int entries, unsigned char *sha1);
+extern void cache_tree_invalidate(const char *path, int len);
+
+/*
+ * tree 对象记录的迭代器, 直接在解压后的 tree 数据中解析, 不分配内存也不复制数据
+ * tree 中每条记录的格式为: <八进制 mode> + ' ' + <name> + '\0' + <20 字节 sha1>
+ */
+struct tree_desc {
+	const unsigned char *buf;
+	unsigned long size;
+};
+
+struct name_entry {
+	unsigned int mode;
+	const char *path;	/* 指向 tree 数据, 以 '\0' 结尾 */
+	int pathlen;
+	const unsigned char *sha1;	/* 指向 tree 数据 */
+};
+
+extern void init_tree_desc(struct tree_desc *desc, const void *buf, unsigned long size);
+/* 取出下一条记录: 成功返回 1, 已经结束返回 0, 数据损坏返回 -1 */
+extern int tree_entry(struct tree_desc *desc, struct name_entry *entry);
+/* 按照 tree 中的排序规则比较两条记录的名字(目录名后面相当于跟着一个 '/') */
+extern int tree_name_compare(const char *name1, int len1, unsigned int mode1,
+			     const char *name2, int len2, unsigned int mode2);
+
+/*
+ * commit 对象, 格式为:
+ *   tree <sha1>
+ *   parent <sha1>	(0 个或多个)
+ *   author <name> <<email>> <date>
+ *   committer <name> <<email>> <date>
+ *   <空行>
+ *   <提交信息>
+ * 同一个 sha1 只对应一个 struct commit (lookup_commit 使用以 sha1 为 key 的哈希表),
+ * parse_commit() 只解析到空行为止的头部(commit 在 commit-graph 中时直接从中读取), 提交信息只有 save_commit_buffer 时才保留.
+ */
+#define SEEN		0x0001
+#define UNINTERESTING	0x0002
+#define IN_QUEUE	0x0004
+
+struct commit_list;
+
+struct commit {
+	unsigned char sha1[20];
+	unsigned int flags;
+	int parsed;
+	unsigned long date;	/* committer 时间, 秒 */
+	unsigned int generation;	/* 0 表示还没有解析, 不在 commit-graph 中时为 GENERATION_INFINITY */
+	unsigned int graph_pos;
+	unsigned char tree[20];
+	struct commit_list *parents;
+	char *buffer;	/* 整个 commit 对象, 只有 save_commit_buffer 时才有 */
+	unsigned long size;
+};
+
+struct commit_list {
+	struct commit *item;
+	struct commit_list *next;
+};
+
+extern int save_commit_buffer;
+extern struct commit *lookup_commit(const unsigned char *sha1);
+/* 读取并解析 commit 头部, 成功返回 0 (已经解析过的直接返回) */
+extern int parse_commit(struct commit *commit);
+/* 解析 commit-tree 写入的日期: ctime() 格式或者秒数, 无法识别时返回 0 */
+extern unsigned long parse_commit_date(const char *date, const char *end);
+
+/*
+ * 按 committer 时间排序的优先队列(最新的先出队, 时间相同时先入队的先出队)
+ * by_generation 不为 0 时先按 generation 排序, generation 大的先出队, 这样出队时所有子孙都已经处理过了
+ */
+struct commit_queue_entry {
+	struct commit *item;
+	unsigned int seq;
+};
+struct commit_queue {
+	struct commit_queue_entry *array;
+	unsigned int nr, alloc, seq;
+	int by_generation;
+};
+
+extern void commit_queue_put(struct commit_queue *queue, struct commit *commit);
+extern struct commit *commit_queue_get(struct commit_queue *queue);
+
+/*
+ * commit-graph 文件(".dircache/commit-graph"): 缓存所有 commit 的 parent, tree, 时间和 generation,
+ * 查询祖先关系时不需要解压任何 commit 对象. 文件格式为:
+ *   commit_graph_header
+ *   fanout[256]: sha1 第一个字节 <= i 的 commit 数目
+ *   commit_graph_entry[nr]: 按 sha1 排序
+ *   extra[extra_nr]: 超过两个 parent 时, 第二个及以后的 parent 序号, 最后一个带 GRAPH_LAST_PARENT 标记
+ * generation: 没有 parent 的 commit 为 1, 其他为所有 parent 中最大的 generation + 1,
+ * 所以 generation 比 A 小的 commit 不可能是 A 的子孙.
+ */
+#define COMMIT_GRAPH_FILE ".dircache/commit-graph"
+#define COMMIT_GRAPH_SIGNATURE 0x48504743	/* "CGPH" */
+struct commit_graph_header {
+	unsigned int signature;
+	unsigned int version;
+	unsigned int nr;
+	unsigned int extra_nr;
+	unsigned char sha1[20];
+};
+
+struct commit_graph_entry {
+	unsigned char sha1[20];
+	unsigned char tree[20];
+	unsigned int parent[2];	/* parent 在文件中的序号 */
+	unsigned int generation;
+	unsigned int date;
+};
+
+#define GRAPH_NO_PARENT		0xffffffff
+#define GRAPH_EXTRA_PARENTS	0x80000000	/* parent[1] 是 extra 中的起始位置 */
+#define GRAPH_LAST_PARENT	0x80000000
+#define GENERATION_INFINITY	0xffffffff
+
+extern struct commit_graph_entry *commit_graph;
+extern unsigned int commit_graph_nr;
+/* 映射 commit-graph 文件(只做一次, parse_commit 会自动调用), 返回 commit 数目, 没有文件时返回 0 */
+extern int read_commit_graph(void);
+/* sha1 在 commit-graph 中的序号, 不存在时返回 -1 */
+extern int commit_graph_pos(const unsigned char *sha1);
+
+/* 读取 sparse 目录列表(read_cache 会自动调用), 返回目录数, 0 表示没有启用 */
+extern int read_sparse(void);
+
+/* 判断路径 name 是否在 sparse 范围内, 没有启用 sparse 时总是返回 1 */
+extern int path_in_sparse(const char *name, int namelen);
+
+/* 比较 cache entry 和 stat 结构体中存放的文件信息, 返回 *_CHANGED 标志, 0 表示没有变化 */
+extern int match_stat(struct cache_entry *ce, struct stat *st);
+
 /* Return a statically allocated filename matching the sha1 signature */
 /* 获取 sha1 值对应的文件名 */
 extern char *sha1_file_name(unsigned char *sha1);
+/* 对象存在(包括在备用对象目录中)时返回 1 */
+extern int has_sha1_file(unsigned char *sha1);
 
 /* Write a memory buffer out to the sha file */
 /* 将 buf 中大小为 size 的数据写入到 sha1 值对应的文件中 */
@@ -109,8 +322,22 @@ extern int write_sha1_buffer(unsigned char *sha1, void *buf, unsigned int size);
 /* Read and unpack a sha1 file into memory, write memory to a sha1 file */
 /* 提取 sha1 值对应文件的内容(解压缩后返回), 返回内容类型(blob/tree/commit)和 size */
 extern void * read_sha1_file(unsigned char *sha1, char *type, unsigned long *size);
-/* 压缩 buf 数据, 计算 sha1 值, 并写入对应的 sha1 文件中 */
-extern int write_sha1_file(char *buf, unsigned len);
+/* read_sha1_file() 分成两步: 映射对象文件到内存, 解压映射的数据 */
+extern void *map_sha1_file(unsigned char *sha1, unsigned long *size);
+extern void *unpack_sha1_file(void *map, unsigned long mapsize, char *type, unsigned long *size);
+/* 只解压对象的头部, 返回类型和大小(不读取内容), 对象不存在或者损坏时返回 -1 */
+extern int read_sha1_header(unsigned char *sha1, char *type, unsigned long *size);
+/*
+ * 批量读取 sha1s 中的 nr 个对象, 每读出一个就调用一次 fn (i 为对象在 sha1s 中的下标)
+ * 对象按磁盘上的位置(目录, inode)排序后读取, 不一定是 sha1s 中的顺序;
+ * buf 由 read_sha1_files() 管理, 只在 fn 调用期间有效; 对象不存在或者损坏时 buf 为 NULL
+ * fn 返回负数时停止读取, 并作为 read_sha1_files() 的返回值
+ * 设置环境变量 DIRCACHE_STATS 后, 在 stderr 输出读取的对象数目和速度(不包括 fn 花费的时间)
+ */
+typedef int (*sha1_file_fn)(int i, const char *type, void *buf, unsigned long size, void *data);
+extern int read_sha1_files(unsigned char **sha1s, int nr, sha1_file_fn fn, void *data);
+/* 压缩 buf 数据, 计算 sha1 值(存放到 returnsha1), 并写入对应的 sha1 文件中 */
+extern int write_sha1_file(char *buf, unsigned len, unsigned char *returnsha1);
 
 /* Convert to/from hex/sha1 representation */
 /* 将 sha1 字符串转换成相应的 sha1 值 */
@@ -118,7 +345,136 @@ extern int get_sha1_hex(char *hex, unsigned char *sha1);
 /* 将 sha1 值转换成相应的 sha1 字符串 */
 extern char *sha1_to_hex(unsigned char *sha1);	/* static buffer! */
 
+/*
+ * libdircache: 可重入的对象库接口 ("make libdircache.a")
+ *
+ * 上面的 read_sha1_file() 等函数使用全局变量和静态缓冲区, 出错时打印信息, 只适合单线程的命令行工具,
+ * 长期运行的服务可以用下面的接口在一个进程中并发读写对象:
+ * struct dircache 描述一个对象库(目录), 初始化以后只读, 可以被多个线程共享;
+ * struct dircache_handle 包含 zlib stream 和临时缓冲区, 每个线程使用自己的 handle;
+ * 读出的内容放在调用者提供的 struct dircache_buffer 中, 空间不够时自动扩大, 可以重复使用;
+ * 这些函数都不会退出进程, 出错时返回负数的错误码, dircache_strerror() 转换成字符串.
+ * 暂存区(active_cache)和 commit 等接口仍然使用全局变量, 不能在多个线程中使用.
+ */
+#define DIRCACHE_ERR_MISSING	(-1)	/* 对象不存在 */
+#define DIRCACHE_ERR_CORRUPT	(-2)	/* 对象损坏 */
+#define DIRCACHE_ERR_NOMEM	(-3)	/* 内存不足 */
+#define DIRCACHE_ERR_IO		(-4)	/* 读写文件出错, 原因在 errno 中 */
+
+/*
+ * 备用对象目录(alternates): 只读, 读取对象时主对象目录中没有的, 按顺序在备用对象目录中查找,
+ * 写入对象只写入主对象目录. 备用对象目录来自主对象目录下的 "info/alternates" 文件
+ * (每行一个目录, 相对路径相对于主对象目录), 以及环境变量 SHA1_FILE_DIRECTORIES (以 ':' 分隔).
+ * 备用对象目录自己的 alternates 不会再读取.
+ */
+#define ALTERNATE_DB_ENVIRONMENT "SHA1_FILE_DIRECTORIES"
+#define ALTERNATES_FILE "info/alternates"
+
+struct dircache {
+	char *object_dir;
+	int object_dir_len;
+	char **alternates;
+	int nr_alternates, alloc_alternates;
+};
+
+/* 对象文件路径需要的空间: "<object_dir>/xx/<38 个字符>\0" */
+#define DIRCACHE_PATH_SIZE(repo) ((repo)->object_dir_len + 43)
+
+struct dircache_buffer {
+	void *buf;
+	unsigned long len, alloc;
+};
+
+struct dircache_handle {
+	struct dircache *repo;
+	z_stream inflate, deflate;
+	int deflate_ready, level;	/* level: 写入对象时的压缩级别 */
+	struct dircache_buffer in, out;	/* 对象文件的内容(压缩的数据) */
+};
+
+/* object_dir 为 NULL 时使用环境变量 SHA1_FILE_DIRECTORY 或者默认的 ".dircache/objects", 同时读取备用对象目录 */
+extern int dircache_init(struct dircache *repo, const char *object_dir);
+extern void dircache_release(struct dircache *repo);
+extern int dircache_handle_init(struct dircache_handle *h, struct dircache *repo);
+extern void dircache_handle_release(struct dircache_handle *h);
+extern int dircache_buffer_grow(struct dircache_buffer *b, unsigned long size);
+extern void dircache_buffer_release(struct dircache_buffer *b);
+extern const char *dircache_strerror(int err);
+/* hex 至少 41 字节; path 至少 DIRCACHE_PATH_SIZE(repo) 字节 */
+extern char *dircache_sha1_to_hex(const unsigned char *sha1, char *hex);
+extern int dircache_object_path(struct dircache *repo, const unsigned char *sha1, char *path, unsigned long size);
+/* 在主对象目录和备用对象目录中查找并打开对象文件, 成功返回 fd */
+extern int dircache_open_object(struct dircache *repo, const unsigned char *sha1);
+/* 对象存在(包括在备用对象目录中)时返回 1 */
+extern int dircache_has_object(struct dircache *repo, const unsigned char *sha1);
+/* type 至少 20 字节 */
+extern int dircache_read_object(struct dircache_handle *h, const unsigned char *sha1, char *type, struct dircache_buffer *out);
+extern int dircache_read_header(struct dircache_handle *h, const unsigned char *sha1, char *type, unsigned long *size);
+/* 只压缩对象(结果在 h->out 中)并计算 sha1, 不写入对象库 */
+extern int dircache_deflate_object(struct dircache_handle *h, const char *type, const void *buf, unsigned long len, unsigned char *sha1);
+/* 写入对象, 对象已经存在时只更新它的修改时间 */
+extern int dircache_write_object(struct dircache_handle *h, const char *type, const void *buf, unsigned long len, unsigned char *sha1);
+extern int dircache_freshen_object(struct dircache *repo, const unsigned char *sha1);
+
+/*
+ * 对象服务器(object-server)的协议: 客户端和服务器通过本地 Unix socket 交换 struct object_message,
+ * 后面跟着 size 字节的数据; 一个连接上可以连续发送多个请求, 服务器按顺序回复.
+ * 数据都是本机字节序, 只用于本地通信.
+ *
+ *   请求                                  回复
+ *   OBJECT_READ   sha1                    type, size + 对象内容
+ *   OBJECT_EXISTS sha1                    code 为 1 (存在) 或者 0 (不存在)
+ *   OBJECT_WRITE  type, size + 对象内容   sha1
+ *   OBJECT_STATS                          size + 服务器的统计信息(文本)
+ *
+ * 回复的 code 小于 0 时为 DIRCACHE_ERR_* 错误码, 后面没有数据.
+ * size 不能超过 OBJECT_MESSAGE_MAX, 超过时对方直接断开连接.
+ */
+#define SERVER_ENVIRONMENT "OBJECT_SERVER_SOCKET"
+#define DEFAULT_SERVER_SOCKET ".dircache/object-server"
+
+#define OBJECT_READ	1
+#define OBJECT_EXISTS	2
+#define OBJECT_WRITE	3
+#define OBJECT_STATS	4
+
+#define OBJECT_MESSAGE_MAX	(1u << 30)
+
+struct object_message {
+	int code;		/* 请求中为 OBJECT_* 命令, 回复中为结果 */
+	unsigned int size;	/* 后面数据的长度 */
+	unsigned char sha1[20];
+	char type[16];
+};
+
+/*
+ * bundle 文件(bundle/unbundle): 把一组对象放在一个文件中, 在不能直接访问对象库的机器之间传递.
+ *
+ *   # dircache bundle v1\n
+ *   -<sha1>\n               接收方必须已经有的 commit (0 个或多个)
+ *   <sha1>\n                bundle 中包含的 commit (1 个或多个)
+ *   objects <n>\n
+ *   n 个对象: sha1 (20 字节) + 长度 (4 字节, 网络字节序) + 对象文件的内容(压缩的数据)
+ *   校验和: 前面所有内容的 sha1 (20 字节)
+ *
+ * 对象的 sha1 就是压缩数据的 sha1, 所以对象文件原样复制, 不需要解压和重新压缩.
+ * 长度只有 4 字节, 所以对象文件(压缩后)不能超过 0xffffffff 字节, bundle 遇到更大的对象时直接退出.
+ */
+#define BUNDLE_SIGNATURE "# dircache bundle v1\n"
+
+/* 读写 fd 直到完成 len 字节, 被信号中断时继续; 成功返回 0 */
+extern int read_in_full(int fd, void *buf, unsigned long len);
+extern int write_in_full(int fd, const void *buf, unsigned long len);
+
+/* 对象服务器的客户端(object-client.c), path 为 NULL 时使用环境变量 OBJECT_SERVER_SOCKET 或者默认路径 */
+extern int object_client_connect(const char *path);
+extern int object_client_read(int fd, const unsigned char *sha1, char *type, struct dircache_buffer *out);
+extern int object_client_exists(int fd, const unsigned char *sha1);
+extern int object_client_write(int fd, const char *type, const void *buf, unsigned long len, unsigned char *sha1);
+extern int object_client_stats(int fd, struct dircache_buffer *out);
+
 /* General helper functions */
+/* 打印出错信息并退出, 只用于命令行工具, libdircache 中的函数不会调用 */
 extern void usage(const char *err);
 
 #endif /* CACHE_H */
@@ -1,7 +1,127 @@
 #include "cache.h"
 
+#include <unistd.h>
+
+/*
+ * 批量模式: 从 stdin 逐行读取 sha1, 每个对象输出
+ *   --batch:       "<sha1> <type> <size>\n<content>\n"
+ *   --batch-check: "<sha1> <type> <size>\n"
+ * 对象不存在时输出 "<输入> missing\n".
+ * 所有输出先放到一个大缓冲区中, 只有在缓冲区满了, 或者需要阻塞等待 stdin 的输入时才写出,
+ * 这样通过管道一问一答的调用方也不会因为输出还在缓冲区中而卡住.
+ */
+#define BATCH_BUFSIZE (1ul << 20)
+
+static char *batch_out;
+static unsigned long batch_outlen;
+
+static void write_all(const char *p, unsigned long len)
+{
+	while (len) {
+		ssize_t ret = write(1, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			perror("cat-file: write");
+			exit(1);
+		}
+		p += ret;
+		len -= ret;
+	}
+}
+
+static void batch_flush(void)
+{
+	write_all(batch_out, batch_outlen);
+	batch_outlen = 0;
+}
+
+static void batch_write(const void *buf, unsigned long len)
+{
+	if (batch_outlen + len > BATCH_BUFSIZE) {
+		batch_flush();
+		/* 大对象不经过缓冲区, 直接写出 */
+		if (len > BATCH_BUFSIZE) {
+			write_all(buf, len);
+			return;
+		}
+	}
+	memcpy(batch_out + batch_outlen, buf, len);
+	batch_outlen += len;
+}
+
+/* stdin 的读缓冲区: 读完了才需要再调用 read(), 在那之前先把输出写出去 */
+static char inbuf[65536];
+static unsigned long inpos, inlen;
+
+static int batch_getline(char *line, int max)
+{
+	int len = 0;
+
+	for (;;) {
+		char c;
+
+		if (inpos == inlen) {
+			ssize_t ret;
+
+			batch_flush();
+			ret = read(0, inbuf, sizeof(inbuf));
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0) {
+				line[len] = 0;
+				return len ? len : -1;
+			}
+			inpos = 0;
+			inlen = ret;
+		}
+		c = inbuf[inpos++];
+		if (c == '\n')
+			break;
+		if (len < max - 1)
+			line[len++] = c;
+	}
+	line[len] = 0;
+	return len;
+}
+
+static void batch_one(char *line, int contents)
+{
+	unsigned char sha1[20];
+	char type[20], header[100];
+	unsigned long size;
+	void *buf = NULL;
+	int len;
+
+	/* --batch-check 只需要对象的头部 */
+	if (strlen(line) < 40 || get_sha1_hex(line, sha1) ||
+	    (contents ? !(buf = read_sha1_file(sha1, type, &size)) : read_sha1_header(sha1, type, &size) < 0)) {
+		len = sprintf(header, "%.80s missing\n", line);
+		batch_write(header, len);
+		return;
+	}
+	len = sprintf(header, "%s %s %lu\n", sha1_to_hex(sha1), type, size);
+	batch_write(header, len);
+	if (contents) {
+		batch_write(buf, size);
+		batch_write("\n", 1);
+	}
+	free(buf);
+}
+
+static int batch_objects(int contents)
+{
+	char line[1024];
+
+	batch_out = malloc(BATCH_BUFSIZE);
+	while (batch_getline(line, sizeof(line)) >= 0)
+		batch_one(line, contents);
+	batch_flush();
+	return 0;
+}
+
 /*
- * 命令: "cat-file <sha1>"
+ * 命令: "cat-file [-t | -s] <sha1>" 或者 "cat-file --batch | --batch-check < <sha1 列表>"
  * 示例: $ ./cat-file b04fb99b9a176ff05e03d5e6e739f0a82b83c56c
  */
 int main(int argc, char **argv)
@@ -13,9 +133,23 @@ int main(int argc, char **argv)
 	char template[] = "temp_git_file_XXXXXX";
 	int fd;
 
+	if (argc == 2 && !strcmp(argv[1], "--batch"))
+		return batch_objects(1);
+	if (argc == 2 && !strcmp(argv[1], "--batch-check"))
+		return batch_objects(0);
+	/* -t/-s 只显示类型/大小, 只需要读取对象的头部 */
+	if (argc == 3 && (!strcmp(argv[1], "-t") || !strcmp(argv[1], "-s"))) {
+		if (get_sha1_hex(argv[2], sha1) || read_sha1_header(sha1, type, &size) < 0)
+			usage("cat-file: unable to read object header");
+		if (argv[1][1] == 't')
+			printf("%s\n", type);
+		else
+			printf("%lu\n", size);
+		return 0;
+	}
 	/* 将 argv[1] 的16进制 sha1 字符串转换成 sha1 值 */
 	if (argc != 2 || get_sha1_hex(argv[1], sha1))
-		usage("cat-file: cat-file <sha1>");
+		usage("cat-file: cat-file [-t | -s] <sha1> | --batch | --batch-check");
 	/* 获取 sha1 值对应的文件内容(解压缩后返回) */
 	/* NOTE!!! 这里的 buf 是在 read_sha1_file 内部 malloc 的, 使用后没有释放会造成内存泄露 */
 	buf = read_sha1_file(sha1, type, &size);
@@ -37,6 +171,8 @@ int main(int argc, char **argv)
  *
  * # 0. 命令格式
  * # $ cat-file <sha1>
+ * # $ cat-file -t | -s <sha1>
+ * # $ cat-file --batch | --batch-check < <sha1 列表>
  *
  * # 1. 添加文件, 并查看已有的 sha1 文件对象
  * git-e83c5163$ ./update-cache Makefile
@@ -53,4 +189,26 @@ int main(int argc, char **argv)
  * CC= *
  * PROG=update-cache show-diff init-db write-tree read-tree commit-tree cat- *
  * git-e83c5163$
+ *
+ * # 4. 只查看对象的类型或者大小(只解压对象的头部)
+ * git-e83c5163$ ./cat-file -t c82df15b2137ec4a6b7927ce6a3141c5abc20015
+ * commit
+ * git-e83c5163$ ./cat-file -s 873158628542df06e0805a33f6436c9c4b65e52b
+ * 1099
+ *
+ * # 5. 批量查看对象的类型和大小, 每行一个 sha1
+ * git-e83c5163$ printf '873158628542df06e0805a33f6436c9c4b65e52b\n829c10d96d2f0356ccab7dd65ba38824ec3ab771\n' | ./cat-file --batch-check
+ * 873158628542df06e0805a33f6436c9c4b65e52b blob 1099
+ * 829c10d96d2f0356ccab7dd65ba38824ec3ab771 tree 103
+ *
+ * # 6. 批量输出对象内容, 不生成临时文件
+ * git-e83c5163$ echo c82df15b2137ec4a6b7927ce6a3141c5abc20015 | ./cat-file --batch
+ * c82df15b2137ec4a6b7927ce6a3141c5abc20015 commit 222
+ * tree 6e6a9efbf99bafd29c1855788a7ffc7a670972cb
+ * parent ea2bc8ba7c383a53df835946a8da7bcbcc0916a6
+ * author guyongqiang <ygu@guyongqiangx> Sun Jul 18 09:00:00 2021
+ * committer root <root@vm> Sun Oct 18 18:12:15 2026
+ *
+ * Third Commit!
+ *
  */
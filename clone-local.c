@@ -0,0 +1,171 @@
+#include "cache.h"
+
+#include <limits.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+/*
+ * 在本机上复制一个工作区: 新工作区的对象目录是空的, 通过 "info/alternates" 直接使用源工作区的对象,
+ * 不复制任何对象文件. 源工作区自己的备用对象目录也一起写入, 这样复制出来的工作区再复制一次也能找到所有对象.
+ *
+ * 只复制暂存区(.dircache/index)和 commit-graph, 工作区中的文件需要时用 "read-tree -u <tree>" 检出.
+ * 新工作区写入的对象只写入自己的对象目录, 源工作区的对象目录不会被修改;
+ * 但是源工作区删除对象(prune-cache)以后, 新工作区中引用这些对象的 tree/commit 就不完整了.
+ */
+static void die(const char *fmt, const char *arg)
+{
+	fprintf(stderr, "clone-local: ");
+	fprintf(stderr, fmt, arg);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+static void make_dir(const char *path)
+{
+	if (mkdir(path, 0700) < 0 && errno != EEXIST)
+		die("unable to create %s", path);
+}
+
+/* 复制 ".dircache" 下的文件 name, 源文件不存在时跳过, 返回复制的字节数 */
+static unsigned long copy_file(const char *src_dir, const char *dst_dir, const char *name)
+{
+	char src[PATH_MAX], dst[PATH_MAX], buf[65536];
+	unsigned long total = 0;
+	struct stat st;
+	int in, out;
+	ssize_t n;
+
+	snprintf(src, sizeof(src), "%s/.dircache/%s", src_dir, name);
+	snprintf(dst, sizeof(dst), "%s/.dircache/%s", dst_dir, name);
+	in = open(src, O_RDONLY);
+	if (in < 0) {
+		if (errno == ENOENT)
+			return 0;
+		die("unable to open %s", src);
+	}
+	fstat(in, &st);
+	out = open(dst, O_WRONLY | O_CREAT | O_EXCL, st.st_mode & 0777);
+	if (out < 0)
+		die("unable to create %s", dst);
+	while ((n = read(in, buf, sizeof(buf))) > 0) {
+		if (write_in_full(out, buf, n) < 0)
+			die("unable to write %s", dst);
+		total += n;
+	}
+	if (n < 0 || close(out) < 0)
+		die("unable to copy %s", src);
+	close(in);
+	return total;
+}
+
+/*
+ * 命令: "clone-local <source> <directory>"
+ * 示例: $ ./clone-local /work/main /work/ci-001
+ *
+ * source 是一个工作区(包含 .dircache 的目录), directory 不存在时自动创建
+ */
+int main(int argc, char **argv)
+{
+	char path[PATH_MAX], objects[PATH_MAX];
+	unsigned long index_size, graph_size, usec;
+	struct timeval start, end;
+	struct dircache src;
+	const char *dst;
+	FILE *f;
+	int i, len;
+
+	if (argc != 3)
+		usage("clone-local <source> <directory>");
+	gettimeofday(&start, NULL);
+	dst = argv[2];
+
+	/* 备用对象目录中保存绝对路径, 新工作区移动到其他位置也可以使用 */
+	snprintf(path, sizeof(path), "%s/%s", argv[1], DEFAULT_DB_ENVIRONMENT);
+	if (!realpath(path, objects))
+		die("%s is not a dircache workspace", argv[1]);
+	/* 环境变量中的备用对象目录只对当前进程有效, 不写入新工作区 */
+	unsetenv(ALTERNATE_DB_ENVIRONMENT);
+	if (dircache_init(&src, objects) < 0)
+		die("%s", "out of memory");
+
+	/* 和 init-db 一样创建 ".dircache/objects/{00..ff}" */
+	if (mkdir(dst, 0777) < 0 && errno != EEXIST)
+		die("unable to create %s", dst);
+	snprintf(path, sizeof(path), "%s/.dircache", dst);
+	if (mkdir(path, 0700) < 0)
+		die("unable to create %s (already a workspace?)", path);
+	len = snprintf(path, sizeof(path), "%s/%s", dst, DEFAULT_DB_ENVIRONMENT);
+	make_dir(path);
+	for (i = 0; i < 256; i++) {
+		sprintf(path + len, "/%02x", i);
+		make_dir(path);
+	}
+	strcpy(path + len, "/info");
+	make_dir(path);
+
+	/* 源工作区的对象目录在前, 然后是源工作区自己的备用对象目录 */
+	strcpy(path + len, "/" ALTERNATES_FILE);
+	f = fopen(path, "w");
+	if (!f)
+		die("unable to create %s", path);
+	fprintf(f, "%s\n", objects);
+	for (i = 0; i < src.nr_alternates; i++)
+		fprintf(f, "%s\n", src.alternates[i]);
+	if (fclose(f))
+		die("unable to write %s", path);
+
+	index_size = copy_file(argv[1], dst, "index");
+	graph_size = copy_file(argv[1], dst, "commit-graph");
+	gettimeofday(&end, NULL);
+	usec = (end.tv_sec - start.tv_sec) * 1000000 + end.tv_usec - start.tv_usec;
+	fprintf(stderr, "cloned %s into %s: %d alternate object directories, index %lu bytes, commit-graph %lu bytes in %lu.%03lu ms\n",
+		argv[1], dst, src.nr_alternates + 1, index_size, graph_size, usec / 1000, usec % 1000);
+	dircache_release(&src);
+	return 0;
+}
+
+/* #
+ * # clone-local 使用示例
+ * #
+ *
+ * # 1. 复制一个有 20000 个文件的工作区, 不复制对象, 只写入 alternates 和复制暂存区
+ * git-e83c5163$ ./clone-local /tmp/bench ci-001
+ * cloned /tmp/bench into ci-001: 1 alternate object directories, index 1442064 bytes, commit-graph 0 bytes in 9.340 ms
+ * git-e83c5163$ cat ci-001/.dircache/objects/info/alternates
+ * /tmp/bench/.dircache/objects
+ *
+ * # 2. 检出文件, 对象都从源工作区的对象目录中读取, write-tree 得到同样的 tree, 本地没有任何对象
+ * git-e83c5163$ cd ci-001
+ * git-e83c5163$ ./read-tree -u af5042a7e2c4c223fe255aa8abdef1f559f6b718 >/dev/null
+ * git-e83c5163$ ./write-tree
+ * af5042a7e2c4c223fe255aa8abdef1f559f6b718
+ * git-e83c5163$ ./fsck-cache
+ * 0 objects (0 blobs, 0 trees, 0 commits), 0 MB in 0.001 s, 0 objects/s, 0 MB/s, 1 threads, 0 problems
+ *
+ * # 3. 修改一个文件并提交, 只有新的 blob, tree 和 commit 写入本地对象目录
+ * git-e83c5163$ echo "local change" >> cat-file.c
+ * git-e83c5163$ ./update-cache cat-file.c
+ * git-e83c5163$ ./write-tree
+ * 57898955cfb048fb3ac7c123441bfb5159fdd7d2
+ * git-e83c5163$ echo "ci change" | ./commit-tree 57898955cfb048fb3ac7c123441bfb5159fdd7d2
+ * 143390f2c58f720658af9b74a404e06e92dcec5e
+ * git-e83c5163$ find .dircache/objects -type f | sort
+ * .dircache/objects/14/3390f2c58f720658af9b74a404e06e92dcec5e
+ * .dircache/objects/2d/b00cd037ab26eda5c597143e1bfa8374f63963
+ * .dircache/objects/57/898955cfb048fb3ac7c123441bfb5159fdd7d2
+ * .dircache/objects/info/alternates
+ *
+ * # 4. 再复制一次, 源工作区的备用对象目录也写入了新工作区
+ * git-e83c5163$ cd ..
+ * git-e83c5163$ ./clone-local ci-001 ci-002
+ * cloned ci-001 into ci-002: 2 alternate object directories, index 1442064 bytes, commit-graph 0 bytes in 6.777 ms
+ * git-e83c5163$ cat ci-002/.dircache/objects/info/alternates
+ * /tmp/cl/ci-001/.dircache/objects
+ * /tmp/bench/.dircache/objects
+ *
+ * # 5. 在一个用 init-db 新建的空工作区中, 不用 info/alternates 文件, 用环境变量临时指定备用对象目录
+ * git-e83c5163$ echo af5042a7e2c4c223fe255aa8abdef1f559f6b718 | ./cat-file --batch-check
+ * af5042a7e2c4c223fe255aa8abdef1f559f6b718 missing
+ * git-e83c5163$ echo af5042a7e2c4c223fe255aa8abdef1f559f6b718 | SHA1_FILE_DIRECTORIES=/nonexistent:/tmp/bench/.dircache/objects ./cat-file --batch-check
+ * af5042a7e2c4c223fe255aa8abdef1f559f6b718 tree 1547
+ */
@@ -0,0 +1,241 @@
+#include "cache.h"
+
+/*
+ * 写入 commit-graph 文件(".dircache/commit-graph")
+ *
+ * 已经在 commit-graph 中的 commit 直接从旧文件中取出, 不需要读取 commit 对象,
+ * 只有从参数指定的 commit 出发, 新增的(不在 commit-graph 中的) commit 才需要解析,
+ * 遇到 commit-graph 中已有的 commit 就停止, 因为它的所有祖先也一定都在 commit-graph 中.
+ * 新旧 commit 合并后按 sha1 排序, 重新写入整个文件.
+ */
+static struct commit **commits;
+static unsigned int nr_commits, alloc_commits, nr_new;
+
+static void add_commit(struct commit *commit)
+{
+	if (nr_commits == alloc_commits) {
+		alloc_commits = alloc_nr(alloc_commits);
+		commits = realloc(commits, alloc_commits * sizeof(struct commit *));
+	}
+	commits[nr_commits++] = commit;
+}
+
+static void parse_or_die(struct commit *commit)
+{
+	if (parse_commit(commit) < 0) {
+		fprintf(stderr, "bad commit %s\n", sha1_to_hex(commit->sha1));
+		exit(1);
+	}
+}
+
+/* 从 commit 出发找出所有不在 commit-graph 中的祖先(使用显式的栈, 历史可能很长) */
+static void add_new_commits(struct commit *commit)
+{
+	struct commit **stack = NULL;
+	unsigned int nr = 0, alloc = 0;
+
+	if (commit->flags & SEEN)
+		return;
+	commit->flags |= SEEN;
+	stack = malloc(sizeof(*stack));
+	alloc = 1;
+	stack[nr++] = commit;
+	while (nr) {
+		struct commit_list *parents;
+
+		commit = stack[--nr];
+		parse_or_die(commit);
+		if (commit->generation != GENERATION_INFINITY)
+			continue;
+		add_commit(commit);
+		nr_new++;
+		for (parents = commit->parents; parents; parents = parents->next) {
+			struct commit *parent = parents->item;
+			if (parent->flags & SEEN)
+				continue;
+			parent->flags |= SEEN;
+			if (nr == alloc) {
+				alloc = alloc_nr(alloc);
+				stack = realloc(stack, alloc * sizeof(*stack));
+			}
+			stack[nr++] = parent;
+		}
+	}
+	free(stack);
+}
+
+/*
+ * 计算新增 commit 的 generation: 所有 parent 的 generation 都已知后才能计算,
+ * 否则先把还没有计算的 parent 压栈
+ */
+static void compute_generation(struct commit *commit)
+{
+	struct commit **stack;
+	unsigned int nr = 0, alloc = 16;
+
+	if (commit->generation != GENERATION_INFINITY)
+		return;
+	stack = malloc(alloc * sizeof(*stack));
+	stack[nr++] = commit;
+	while (nr) {
+		struct commit_list *parents;
+		unsigned int max = 0;
+		int pending = 0;
+
+		commit = stack[nr - 1];
+		for (parents = commit->parents; parents; parents = parents->next) {
+			struct commit *parent = parents->item;
+			if (parent->generation == GENERATION_INFINITY) {
+				if (nr == alloc) {
+					alloc = alloc_nr(alloc);
+					stack = realloc(stack, alloc * sizeof(*stack));
+				}
+				stack[nr++] = parent;
+				pending = 1;
+			} else if (parent->generation > max)
+				max = parent->generation;
+		}
+		if (pending)
+			continue;
+		commit->generation = max + 1;
+		nr--;
+	}
+	free(stack);
+}
+
+static int compare_commits(const void *a, const void *b)
+{
+	const struct commit *c1 = *(const struct commit **)a;
+	const struct commit *c2 = *(const struct commit **)b;
+
+	return memcmp(c1->sha1, c2->sha1, 20);
+}
+
+/* 写入 commit-graph 文件: 先写到 lock 文件, 完成后再改名 */
+static int write_commit_graph(void)
+{
+	struct commit_graph_header hdr;
+	struct commit_graph_entry *entries;
+	unsigned int fanout[256], *extra = NULL;
+	unsigned int i, extra_nr = 0, extra_alloc = 0;
+	SHA_CTX c;
+	int fd;
+
+	for (i = 0; i < nr_commits; i++)
+		commits[i]->graph_pos = i;
+	memset(fanout, 0, sizeof(fanout));
+	entries = calloc(nr_commits ? nr_commits : 1, sizeof(*entries));
+	for (i = 0; i < nr_commits; i++) {
+		struct commit *commit = commits[i];
+		struct commit_graph_entry *entry = entries + i;
+		struct commit_list *parents = commit->parents;
+
+		fanout[commit->sha1[0]]++;
+		memcpy(entry->sha1, commit->sha1, 20);
+		memcpy(entry->tree, commit->tree, 20);
+		entry->generation = commit->generation;
+		entry->date = commit->date;
+		entry->parent[0] = entry->parent[1] = GRAPH_NO_PARENT;
+		if (!parents)
+			continue;
+		entry->parent[0] = parents->item->graph_pos;
+		parents = parents->next;
+		if (!parents)
+			continue;
+		if (!parents->next) {
+			entry->parent[1] = parents->item->graph_pos;
+			continue;
+		}
+		/* 两个以上的 parent 存放在 extra 中 */
+		entry->parent[1] = GRAPH_EXTRA_PARENTS | extra_nr;
+		for (; parents; parents = parents->next) {
+			if (extra_nr == extra_alloc) {
+				extra_alloc = alloc_nr(extra_alloc);
+				extra = realloc(extra, extra_alloc * sizeof(unsigned int));
+			}
+			extra[extra_nr++] = parents->item->graph_pos | (parents->next ? 0 : GRAPH_LAST_PARENT);
+		}
+	}
+	for (i = 1; i < 256; i++)
+		fanout[i] += fanout[i - 1];
+
+	hdr.signature = COMMIT_GRAPH_SIGNATURE;
+	hdr.version = 1;
+	hdr.nr = nr_commits;
+	hdr.extra_nr = extra_nr;
+	SHA1_Init(&c);
+	SHA1_Update(&c, &hdr, offsetof(struct commit_graph_header, sha1));
+	SHA1_Update(&c, fanout, sizeof(fanout));
+	SHA1_Update(&c, entries, nr_commits * sizeof(*entries));
+	SHA1_Update(&c, extra, extra_nr * sizeof(unsigned int));
+	SHA1_Final(hdr.sha1, &c);
+
+	fd = open(COMMIT_GRAPH_FILE ".lock", O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		perror("unable to create " COMMIT_GRAPH_FILE ".lock");
+		return -1;
+	}
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    write(fd, fanout, sizeof(fanout)) != sizeof(fanout) ||
+	    write(fd, entries, nr_commits * sizeof(*entries)) != nr_commits * sizeof(*entries) ||
+	    write(fd, extra, extra_nr * sizeof(unsigned int)) != extra_nr * sizeof(unsigned int) ||
+	    close(fd) < 0 ||
+	    rename(COMMIT_GRAPH_FILE ".lock", COMMIT_GRAPH_FILE) < 0) {
+		unlink(COMMIT_GRAPH_FILE ".lock");
+		return -1;
+	}
+	free(entries);
+	free(extra);
+	return 0;
+}
+
+/*
+ * 命令: "commit-graph <commit>..."
+ * 示例: $ ./commit-graph c82df15b2137ec4a6b7927ce6a3141c5abc20015
+ */
+int main(int argc, char **argv)
+{
+	unsigned int i, old_nr;
+
+	if (argc < 2)
+		usage("commit-graph <commit>...");
+	/* 旧文件中的 commit 全部保留 */
+	old_nr = read_commit_graph();
+	for (i = 0; i < old_nr; i++) {
+		struct commit *commit = lookup_commit(commit_graph[i].sha1);
+		parse_or_die(commit);
+		commit->flags |= SEEN;
+		add_commit(commit);
+	}
+	for (i = 1; i < argc; i++) {
+		unsigned char sha1[20];
+		if (get_sha1_hex(argv[i], sha1))
+			usage("commit-graph <commit>...");
+		add_new_commits(lookup_commit(sha1));
+	}
+	for (i = old_nr; i < nr_commits; i++)
+		compute_generation(commits[i]);
+	qsort(commits, nr_commits, sizeof(struct commit *), compare_commits);
+	if (write_commit_graph() < 0)
+		usage("unable to write commit-graph");
+	fprintf(stderr, "%u commits (%u new)\n", nr_commits, nr_new);
+	arena_release();
+	return 0;
+}
+
+/* #
+ * # commit-graph 使用示例
+ * #
+ *
+ * # 1. 为 rev-list 示例中的三次提交写入 commit-graph
+ * git-e83c5163$ ./commit-graph c82df15b2137ec4a6b7927ce6a3141c5abc20015
+ * 3 commits (3 new)
+ *
+ * # 2. 在第二次提交的基础上再提交一次, 增量更新 commit-graph, 只解析新增的 commit
+ * git-e83c5163$ echo "Fourth Commit!" | ./commit-tree 829c10d96d2f0356ccab7dd65ba38824ec3ab771 -p ea2bc8ba7c383a53df835946a8da7bcbcc0916a6
+ * aa7e7c564b6c9be7544f022cd0915ea3fc517050
+ * git-e83c5163$ ./commit-graph c82df15b2137ec4a6b7927ce6a3141c5abc20015 aa7e7c564b6c9be7544f022cd0915ea3fc517050
+ * 4 commits (1 new)
+ * git-e83c5163$ ls -l .dircache/commit-graph
+ * -rw-r--r-- 1 root root 1284 Oct 18 18:15 .dircache/commit-graph
+ */
\ No newline at end of file
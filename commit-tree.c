@@ -138,6 +138,7 @@ int main(int argc, char **argv)
 	int parents = 0;
 	unsigned char tree_sha1[20];
 	unsigned char parent_sha1[MAXPARENT][20];
+	unsigned char commit_sha1[20];
 	char *gecos, *realgecos;
 	char *email, realemail[1000];
 	char *date, *realdate;
@@ -219,7 +220,9 @@ int main(int argc, char **argv)
 	finish_buffer("commit ", &buffer, &size);
 
 	/* 将 commit 对象数据写入到文件中 */
-	write_sha1_file(buffer, size);
+	if (write_sha1_file(buffer, size, commit_sha1) < 0)
+		usage("unable to write commit object");
+	printf("%s\n", sha1_to_hex(commit_sha1));
 	return 0;
 }
 
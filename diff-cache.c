@@ -0,0 +1,140 @@
+#include "cache.h"
+
+/*
+ * 比较暂存区和 tree 对象 (也就是 "哪些修改已经暂存, 还没有提交")
+ *
+ * 同时顺序遍历 tree 和已经排好序的 active_cache 做一次归并:
+ *   只在暂存区中 -> 新增 ("+")
+ *   只在 tree 中 -> 删除 ("-")
+ *   两边都有但 sha1 或 mode 不同 -> 修改 ("*")
+ * 只比较 sha1 和 mode, 不读取任何 blob, 也不需要先执行 write-tree.
+ * 暂存区中缓存的目录 tree 对象和 tree 中的子目录相同时, 整个子目录直接跳过, 不需要读取子目录的 tree.
+ */
+static int pos;
+
+static void show_cache_entry(const char *prefix, struct cache_entry *ce)
+{
+	printf("%s%o %s %s\n", prefix, ce->st_mode, sha1_to_hex(ce->sha1), ce->name);
+}
+
+/* 输出暂存区中排在 path (长度为 len) 前面的条目, 这些条目在 tree 中都不存在 */
+static void show_added_before(const char *path, int len)
+{
+	while (pos < active_nr) {
+		struct cache_entry *ce = active_cache[pos];
+		if (cache_name_compare(ce->name, ce->namelen, path, len) >= 0)
+			break;
+		show_cache_entry("+", ce);
+		pos++;
+	}
+}
+
+/* 暂存区中当前条目是否位于 prefix (长度为 len, 包括结尾的 '/') 目录下 */
+static int cache_under(const char *prefix, int len)
+{
+	struct cache_entry *ce;
+
+	if (pos >= active_nr)
+		return 0;
+	ce = active_cache[pos];
+	return ce->namelen > len && !memcmp(ce->name, prefix, len);
+}
+
+static void diff_cache(unsigned char *tree_sha1, const char *base, int baselen)
+{
+	unsigned long size;
+	char type[20];
+	void *tree;
+	struct tree_desc desc;
+	struct name_entry entry;
+	int ret;
+
+	tree = read_sha1_file(tree_sha1, type, &size);
+	if (!tree)
+		usage("unable to read tree object");
+	if (strcmp(type, "tree"))
+		usage("expected a 'tree' node");
+	init_tree_desc(&desc, tree, size);
+	while ((ret = tree_entry(&desc, &entry)) > 0) {
+		unsigned char *sha1 = (unsigned char *)entry.sha1;
+		int fulllen = baselen + entry.pathlen;
+		char *fullpath;
+
+		fullpath = malloc(fulllen + 2);
+		memcpy(fullpath, base, baselen);
+		memcpy(fullpath + baselen, entry.path, entry.pathlen);
+		fullpath[fulllen] = 0;
+
+		if (S_ISDIR(entry.mode)) {
+			struct cache_tree *ct;
+
+			fullpath[fulllen] = '/';
+			fullpath[fulllen + 1] = 0;
+			show_added_before(fullpath, fulllen + 1);
+			/* 暂存区缓存的 tree 对象相同, 整个子目录没有变化 */
+			ct = cache_tree_lookup(fullpath, fulllen);
+			if (ct && !memcmp(ct->sha1, sha1, 20) && pos + ct->entries <= active_nr) {
+				pos += ct->entries;
+				free(fullpath);
+				continue;
+			}
+			diff_cache(sha1, fullpath, fulllen + 1);
+			/* 子目录中多出来的条目(tree 中已经没有了) */
+			while (cache_under(fullpath, fulllen + 1))
+				show_cache_entry("+", active_cache[pos++]);
+			free(fullpath);
+			continue;
+		}
+
+		show_added_before(fullpath, fulllen);
+		if (pos < active_nr && !cache_name_compare(active_cache[pos]->name, active_cache[pos]->namelen, fullpath, fulllen)) {
+			struct cache_entry *ce = active_cache[pos++];
+			if (ce->st_mode != entry.mode || memcmp(ce->sha1, sha1, 20)) {
+				printf("*%o->%o %s->", entry.mode, ce->st_mode, sha1_to_hex(sha1));
+				printf("%s %s\n", sha1_to_hex(ce->sha1), ce->name);
+			}
+		} else
+			printf("-%o %s %s\n", entry.mode, sha1_to_hex(sha1), fullpath);
+		free(fullpath);
+	}
+	if (ret < 0)
+		usage("corrupt 'tree' file");
+	free(tree);
+}
+
+/*
+ * 命令: "diff-cache <tree-sha1>"
+ * 示例: $ ./diff-cache e8b54b68b8afd3aaccc159b0336e0ec2ac2cd8c2
+ */
+int main(int argc, char **argv)
+{
+	unsigned char sha1[20];
+
+	if (argc != 2 || get_sha1_hex(argv[1], sha1))
+		usage("diff-cache <tree sha1>");
+	if (read_cache() < 0) {
+		perror("read_cache");
+		exit(1);
+	}
+	diff_cache(sha1, "", 0);
+	/* 剩下的都是 tree 中没有的条目 */
+	while (pos < active_nr)
+		show_cache_entry("+", active_cache[pos++]);
+	return 0;
+}
+
+/* #
+ * # diff-cache 使用示例
+ * #
+ *
+ * # 1. 提交后修改 Makefile, 新增 images/index.png, 并添加到暂存区
+ * git-e83c5163$ ./write-tree
+ * e8b54b68b8afd3aaccc159b0336e0ec2ac2cd8c2
+ * git-e83c5163$ vim Makefile
+ * git-e83c5163$ ./update-cache Makefile images/index.png
+ *
+ * # 2. 不执行 write-tree, 直接比较暂存区和上一次的 tree, "*" 为修改, "+" 为新增, "-" 为删除
+ * git-e83c5163$ ./diff-cache e8b54b68b8afd3aaccc159b0336e0ec2ac2cd8c2
+ * *100644->100644 618a7a62e63123c0378f8f042cd4941752d1875a->873158628542df06e0805a33f6436c9c4b65e52b Makefile
+ * +100644 b62626e8e394a5e1a843af316d3fba2275c959bb images/index.png
+ */
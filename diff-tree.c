@@ -0,0 +1,155 @@
+#include "cache.h"
+
+/*
+ * 比较两个 tree 对象
+ *
+ * tree 中的记录都是按名字排好序的, 所以只需要同时顺序遍历两个 tree 做一次归并:
+ *   只在 tree1 中 -> 删除 ("-")
+ *   只在 tree2 中 -> 新增 ("+")
+ *   两边都有但 sha1 或 mode 不同 -> 修改 ("*"), 子目录则递归比较
+ * sha1 相同的记录(包括整个子目录)直接跳过, 不需要读取任何 blob.
+ * 记录使用 tree_entry() 直接在解压后的 tree 数据中解析, 名字和 sha1 都只是指向缓冲区的指针, 不做复制.
+ */
+
+/* 读取 tree 对象, 返回解压后的缓冲区(调用者负责 free) */
+static void *read_tree(const unsigned char *sha1, struct tree_desc *desc)
+{
+	char type[20];
+	unsigned long size;
+	void *buf = read_sha1_file((unsigned char *)sha1, type, &size);
+
+	if (!buf)
+		usage("unable to read tree object");
+	if (strcmp(type, "tree"))
+		usage("expected a 'tree' node");
+	init_tree_desc(desc, buf, size);
+	return buf;
+}
+
+/* 取出下一条记录, 没有更多记录时返回 0 */
+static int next_entry(struct tree_desc *desc, struct name_entry *entry)
+{
+	int ret = tree_entry(desc, entry);
+
+	if (ret < 0)
+		usage("corrupt 'tree' file");
+	return ret;
+}
+
+static void show_entry(const char *prefix, unsigned int mode, const char *base, int baselen, const char *path, int pathlen, const unsigned char *sha1);
+
+/* 整个子目录都是新增或者删除的, 递归显示其中的每一条记录 */
+static void show_tree(const char *prefix, const char *base, int baselen, const unsigned char *sha1)
+{
+	struct tree_desc desc;
+	struct name_entry entry;
+	void *buf = read_tree(sha1, &desc);
+
+	while (next_entry(&desc, &entry))
+		show_entry(prefix, entry.mode, base, baselen, entry.path, entry.pathlen, entry.sha1);
+	free(buf);
+}
+
+static char *make_base(const char *base, int baselen, const char *path, int pathlen)
+{
+	char *newbase = malloc(baselen + pathlen + 2);
+
+	memcpy(newbase, base, baselen);
+	memcpy(newbase + baselen, path, pathlen);
+	newbase[baselen + pathlen] = '/';
+	newbase[baselen + pathlen + 1] = 0;
+	return newbase;
+}
+
+static void show_entry(const char *prefix, unsigned int mode, const char *base, int baselen, const char *path, int pathlen, const unsigned char *sha1)
+{
+	if (S_ISDIR(mode)) {
+		char *newbase = make_base(base, baselen, path, pathlen);
+		show_tree(prefix, newbase, baselen + pathlen + 1, sha1);
+		free(newbase);
+		return;
+	}
+	printf("%s%o %s %.*s%.*s\n", prefix, mode, sha1_to_hex((unsigned char *)sha1), baselen, base, pathlen, path);
+}
+
+static void diff_tree(const unsigned char *sha1_1, const unsigned char *sha1_2, const char *base, int baselen)
+{
+	struct tree_desc t1, t2;
+	struct name_entry e1, e2;
+	void *buf1 = read_tree(sha1_1, &t1);
+	void *buf2 = read_tree(sha1_2, &t2);
+	int has1 = next_entry(&t1, &e1), has2 = next_entry(&t2, &e2);
+
+	while (has1 || has2) {
+		int cmp;
+
+		if (!has2)
+			cmp = -1;
+		else if (!has1)
+			cmp = 1;
+		else
+			cmp = tree_name_compare(e1.path, e1.pathlen, e1.mode, e2.path, e2.pathlen, e2.mode);
+
+		if (cmp < 0) {
+			show_entry("-", e1.mode, base, baselen, e1.path, e1.pathlen, e1.sha1);
+			has1 = next_entry(&t1, &e1);
+			continue;
+		}
+		if (cmp > 0) {
+			show_entry("+", e2.mode, base, baselen, e2.path, e2.pathlen, e2.sha1);
+			has2 = next_entry(&t2, &e2);
+			continue;
+		}
+		/* 同名的记录, sha1 和 mode 都相同时(整个子目录)什么都不用做 */
+		if (e1.mode != e2.mode || memcmp(e1.sha1, e2.sha1, 20)) {
+			if (S_ISDIR(e1.mode) && S_ISDIR(e2.mode)) {
+				char *newbase = make_base(base, baselen, e1.path, e1.pathlen);
+				diff_tree(e1.sha1, e2.sha1, newbase, baselen + e1.pathlen + 1);
+				free(newbase);
+			} else if (S_ISDIR(e1.mode) != S_ISDIR(e2.mode)) {
+				/* 文件变成目录, 或者目录变成文件 */
+				show_entry("-", e1.mode, base, baselen, e1.path, e1.pathlen, e1.sha1);
+				show_entry("+", e2.mode, base, baselen, e2.path, e2.pathlen, e2.sha1);
+			} else {
+				printf("*%o->%o %s->", e1.mode, e2.mode, sha1_to_hex((unsigned char *)e1.sha1));
+				printf("%s %.*s%.*s\n", sha1_to_hex((unsigned char *)e2.sha1), baselen, base, e1.pathlen, e1.path);
+			}
+		}
+		has1 = next_entry(&t1, &e1);
+		has2 = next_entry(&t2, &e2);
+	}
+	free(buf1);
+	free(buf2);
+}
+
+/*
+ * 命令: "diff-tree <tree-sha1> <tree-sha1>"
+ * 示例: $ ./diff-tree e8b54b68b8afd3aaccc159b0336e0ec2ac2cd8c2 829c10d96d2f0356ccab7dd65ba38824ec3ab771
+ */
+int main(int argc, char **argv)
+{
+	unsigned char old[20], new[20];
+
+	if (argc != 3 || get_sha1_hex(argv[1], old) || get_sha1_hex(argv[2], new))
+		usage("diff-tree <tree sha1> <tree sha1>");
+	diff_tree(old, new, "", 0);
+	return 0;
+}
+
+/* #
+ * # diff-tree 使用示例
+ * #
+ *
+ * # 1. 修改 Makefile, 新增 images/index.png 后写入新的 tree 对象
+ * git-e83c5163$ ./write-tree
+ * e8b54b68b8afd3aaccc159b0336e0ec2ac2cd8c2
+ * git-e83c5163$ vim Makefile
+ * git-e83c5163$ ./update-cache Makefile images/index.png
+ * git-e83c5163$ ./write-tree
+ * 829c10d96d2f0356ccab7dd65ba38824ec3ab771
+ *
+ * # 2. 比较两个 tree 对象, "*" 为修改, "+" 为新增, "-" 为删除
+ * git-e83c5163$ ./diff-tree e8b54b68b8afd3aaccc159b0336e0ec2ac2cd8c2 829c10d96d2f0356ccab7dd65ba38824ec3ab771
+ * *100644->100644 618a7a62e63123c0378f8f042cd4941752d1875a->873158628542df06e0805a33f6436c9c4b65e52b Makefile
+ * +100644 b62626e8e394a5e1a843af316d3fba2275c959bb images/index.png
+ */
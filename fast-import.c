@@ -0,0 +1,987 @@
+#include "cache.h"
+
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+/*
+ * 从 stdin 读取命令流, 在一个进程中批量创建 blob, tree 和 commit 对象
+ *
+ * 命令流的格式(每条命令一行, 空行和 '#' 开头的行被忽略, data 后面是 <len> 字节的原始数据):
+ *
+ *   blob
+ *   mark :<n>                           (可选)
+ *   data <len>
+ *
+ *   commit
+ *   mark :<n>                           (可选)
+ *   author <name> <email> <date>        (这一行后面的内容原样写入 commit)
+ *   committer <name> <email> <date>     (可选, 默认和 author 相同)
+ *   data <len>                          (提交信息)
+ *   from <:n | sha1>                    (可选, 默认是命令流中的上一个 commit)
+ *   merge <:n | sha1>                   (可选, 可以有多个, 只增加 parent, 不改变 tree)
+ *   M <mode> <:n | sha1 | inline> <path>  (inline 时下一行是 data)
+ *   D <path>
+ *   deleteall
+ *
+ *   reset                               (下一个 commit 没有 parent, 从空的 tree 开始)
+ *
+ * 当前 commit 的 tree 一直保存在内存中, 只有修改过的目录需要重新生成 tree 对象,
+ * 没有修改过的子目录只记录 sha1, 需要修改时才读入.
+ * 对象压缩以后放入批量缓冲区, 缓冲区满了以后交给写线程, 按 sha1 排序(同一个目录的文件放在一起)后
+ * 用 openat() 依次写入临时文件再改名, 主线程同时继续解析和压缩.
+ *
+ * 注意: 对象的 sha1 是按压缩后的数据计算的, 压缩级别不同, 同样内容的对象 sha1 也不同,
+ * 默认使用和 update-cache/write-tree/commit-tree 相同的 Z_BEST_COMPRESSION,
+ * --compression=<n> 使用其他级别时, 导入的对象和这些工具写入的对象不能共用.
+ */
+#define BATCH_SIZE	(16ul << 20)
+#define MAXPARENT	(16)
+
+struct import_tree;
+
+struct import_entry {
+	unsigned int mode;
+	unsigned char sha1[20];
+	struct import_tree *tree;	/* 目录的内容, 没有读入时为 NULL */
+	int namelen;
+	char name[0];
+};
+
+/* entries 按 tree_name_compare() 排序, dirty 表示内容有修改, 需要重新写入 */
+struct import_tree {
+	int dirty;
+	int nr, alloc;
+	struct import_entry **entries;
+};
+
+/* mark 记录的对象, 对于 commit 同时记录它的 tree */
+struct mark {
+	unsigned char sha1[20];
+	unsigned char tree[20];
+	int is_commit;
+};
+
+static struct mark *marks;
+static unsigned int marks_alloc;
+
+static struct dircache repo;
+static struct dircache_handle handle;
+static struct dircache_buffer data_buf, message_buf, tree_buf, commit_buf;
+
+/* 当前 commit 的 tree, last_commit 为最后写入的 commit, 它的 tree 就是 root */
+static struct import_entry root;
+static unsigned char last_commit[20];
+static int have_last_commit;
+
+static unsigned long nr_blobs, nr_trees, nr_commits, nr_duplicates, bytes_written;
+
+static void die(const char *err)
+{
+	fprintf(stderr, "fast-import: %s\n", err);
+	exit(1);
+}
+
+static int is_null_sha1(const unsigned char *sha1)
+{
+	static const unsigned char null_sha1[20];
+
+	return !memcmp(sha1, null_sha1, 20);
+}
+
+/*
+ * 读取命令流: stdin 的数据先读到 input 中, 行和 data 都从这里取
+ */
+static char input[1 << 20];
+static unsigned long input_pos, input_len;
+static int input_eof;
+
+static int fill_input(void)
+{
+	ssize_t ret;
+
+	if (input_pos) {
+		memmove(input, input + input_pos, input_len - input_pos);
+		input_len -= input_pos;
+		input_pos = 0;
+	}
+	if (input_eof || input_len == sizeof(input))
+		return 0;
+	do {
+		ret = read(0, input + input_len, sizeof(input) - input_len);
+	} while (ret < 0 && errno == EINTR);
+	if (ret <= 0) {
+		input_eof = 1;
+		return 0;
+	}
+	input_len += ret;
+	return 1;
+}
+
+/* 读取下一行(去掉结尾的 '\n'), 返回的字符串在下一次读取之前有效, 结束时返回 NULL */
+static char *pending_line;
+
+static char *read_line(void)
+{
+	char *line, *eol;
+
+	if (pending_line) {
+		line = pending_line;
+		pending_line = NULL;
+		return line;
+	}
+	for (;;) {
+		eol = memchr(input + input_pos, '\n', input_len - input_pos);
+		if (eol)
+			break;
+		if (!fill_input()) {
+			if (input_pos == input_len)
+				return NULL;
+			if (input_len == sizeof(input))
+				die("line too long");
+			/* 最后一行没有 '\n' */
+			eol = input + input_len;
+			break;
+		}
+	}
+	line = input + input_pos;
+	*eol = 0;
+	input_pos = eol - input + (eol < input + input_len);
+	return line;
+}
+
+/* 下一行不是当前命令的一部分, 退回去留给下一次 read_line() */
+static void unread_line(char *line)
+{
+	pending_line = line;
+}
+
+/* 读取 len 字节的数据到 buf (后面加上 '\0') */
+static void read_data(struct dircache_buffer *buf, unsigned long len)
+{
+	unsigned long n;
+
+	if (dircache_buffer_grow(buf, len + 1) < 0)
+		die("out of memory");
+	n = input_len - input_pos;
+	if (n > len)
+		n = len;
+	memcpy(buf->buf, input + input_pos, n);
+	input_pos += n;
+	if (n < len && read_in_full(0, (char *)buf->buf + n, len - n) < 0)
+		die("unexpected end of data");
+	((char *)buf->buf)[len] = 0;
+	buf->len = len;
+}
+
+static void parse_data(struct dircache_buffer *buf)
+{
+	char *line = read_line(), *end;
+	unsigned long len;
+
+	if (!line || strncmp(line, "data ", 5))
+		die("expected 'data <len>'");
+	len = strtoul(line + 5, &end, 10);
+	if (*end)
+		die("bad data length");
+	read_data(buf, len);
+}
+
+/*
+ * 批量写入: 压缩后的对象依次追加到 batch 中, 满了以后交给写线程
+ */
+struct batch_object {
+	unsigned char sha1[20];
+	unsigned long offset, size;
+};
+
+struct batch {
+	char *buf;
+	unsigned long len, alloc;
+	struct batch_object *objs;
+	int nr, objs_alloc;
+};
+
+static struct batch batches[2], *current = &batches[0], *writing;
+static pthread_t writer;
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+static int writer_exit, write_errors;
+
+/* 本次导入已经写过的对象(开放寻址哈希表), 重复的对象不再写入 */
+static unsigned char (*written)[20];
+static unsigned long written_nr, written_size;
+
+static int add_written(const unsigned char *sha1)
+{
+	unsigned long i;
+
+	if (written_nr * 2 >= written_size) {
+		unsigned char (*old)[20] = written;
+		unsigned long old_size = written_size;
+
+		written_size = written_size ? written_size * 2 : 65536;
+		written = calloc(written_size, 20);
+		written_nr = 0;
+		for (i = 0; i < old_size; i++)
+			if (!is_null_sha1(old[i]))
+				add_written(old[i]);
+		free(old);
+	}
+	i = (sha1[0] << 24 | sha1[1] << 16 | sha1[2] << 8 | sha1[3]) & (written_size - 1);
+	while (!is_null_sha1(written[i])) {
+		if (!memcmp(written[i], sha1, 20))
+			return 0;
+		i = (i + 1) & (written_size - 1);
+	}
+	memcpy(written[i], sha1, 20);
+	written_nr++;
+	return 1;
+}
+
+static int compare_batch_objects(const void *a, const void *b)
+{
+	return memcmp(((struct batch_object *)a)->sha1, ((struct batch_object *)b)->sha1, 20);
+}
+
+/*
+ * 对象目录 xx 的文件描述符, 第一次用到时打开
+ * 用 openat() 创建文件, 不用每次都从 ".dircache/objects/xx/" 开始查找路径
+ */
+static int fanout_fd[256];
+
+static int open_fanout(int n)
+{
+	char path[PATH_MAX];
+
+	if (!fanout_fd[n]) {
+		snprintf(path, sizeof(path), "%s/%02x", repo.object_dir, n);
+		fanout_fd[n] = open(path, O_RDONLY | O_DIRECTORY);
+		if (fanout_fd[n] < 0)
+			perror(path);
+	}
+	return fanout_fd[n];
+}
+
+/* 临时文件名 "tmp_<pid>_<38 个字符>", 写完以后改名, 读取对象的进程不会看到不完整的对象 */
+static char tmp_prefix[32];
+
+static void write_batch(struct batch *b)
+{
+	char path[PATH_MAX], tmp[80];
+	int i, errors = 0;
+
+	qsort(b->objs, b->nr, sizeof(struct batch_object), compare_batch_objects);
+	for (i = 0; i < b->nr; i++) {
+		struct batch_object *obj = b->objs + i;
+		int fd, ret, dir = open_fanout(obj->sha1[0]);
+		const char *name;
+
+		/* 备用对象目录中已经有的对象不需要写入 */
+		if (repo.nr_alternates && dircache_has_object(&repo, obj->sha1))
+			continue;
+
+		/* path 的最后 38 个字符就是文件名 */
+		dircache_object_path(&repo, obj->sha1, path, sizeof(path));
+		name = path + repo.object_dir_len + 4;
+		if (dir < 0) {
+			errors++;
+			continue;
+		}
+		/* 已经存在的对象只更新修改时间, 避免被 prune-cache 删除 */
+		if (!utimensat(dir, name, NULL, 0))
+			continue;
+		sprintf(tmp, "%s%s", tmp_prefix, name);
+		fd = openat(dir, tmp, O_WRONLY | O_CREAT | O_EXCL, 0444);
+		if (fd < 0) {
+			perror(path);
+			errors++;
+			continue;
+		}
+		ret = write_in_full(fd, b->buf + obj->offset, obj->size);
+		if (close(fd) < 0 || ret < 0 || renameat(dir, tmp, dir, name) < 0) {
+			perror(path);
+			unlinkat(dir, tmp, 0);
+			errors++;
+		}
+	}
+	b->len = 0;
+	b->nr = 0;
+	if (errors) {
+		pthread_mutex_lock(&writer_mutex);
+		write_errors += errors;
+		pthread_mutex_unlock(&writer_mutex);
+	}
+}
+
+static void *writer_thread(void *data)
+{
+	pthread_mutex_lock(&writer_mutex);
+	for (;;) {
+		struct batch *b;
+
+		while (!writing && !writer_exit)
+			pthread_cond_wait(&writer_cond, &writer_mutex);
+		if (!writing)
+			break;
+		b = writing;
+		pthread_mutex_unlock(&writer_mutex);
+		write_batch(b);
+		pthread_mutex_lock(&writer_mutex);
+		writing = NULL;
+		pthread_cond_broadcast(&writer_cond);
+	}
+	pthread_mutex_unlock(&writer_mutex);
+	return NULL;
+}
+
+/* 把当前 batch 交给写线程(等待上一个 batch 写完), 换另一个 batch 继续使用 */
+static void flush_batch(void)
+{
+	pthread_mutex_lock(&writer_mutex);
+	while (writing)
+		pthread_cond_wait(&writer_cond, &writer_mutex);
+	writing = current;
+	current = current == &batches[0] ? &batches[1] : &batches[0];
+	pthread_cond_broadcast(&writer_cond);
+	pthread_mutex_unlock(&writer_mutex);
+}
+
+/* 写出所有还在缓冲区中的对象, 等待写线程完成 */
+static void sync_objects(void)
+{
+	flush_batch();
+	pthread_mutex_lock(&writer_mutex);
+	while (writing)
+		pthread_cond_wait(&writer_cond, &writer_mutex);
+	pthread_mutex_unlock(&writer_mutex);
+}
+
+static void store_object(const char *type, const void *buf, unsigned long len, unsigned char *sha1)
+{
+	struct batch_object *obj;
+
+	if (dircache_deflate_object(&handle, type, buf, len, sha1) < 0)
+		die("unable to compress object");
+	if (!add_written(sha1)) {
+		nr_duplicates++;
+		return;
+	}
+	if (current->len + handle.out.len > current->alloc) {
+		current->alloc = current->len + handle.out.len > BATCH_SIZE ? current->len + handle.out.len : BATCH_SIZE;
+		current->buf = realloc(current->buf, current->alloc);
+	}
+	if (current->nr == current->objs_alloc) {
+		current->objs_alloc = alloc_nr(current->objs_alloc);
+		current->objs = realloc(current->objs, current->objs_alloc * sizeof(struct batch_object));
+	}
+	obj = current->objs + current->nr++;
+	memcpy(obj->sha1, sha1, 20);
+	obj->offset = current->len;
+	obj->size = handle.out.len;
+	memcpy(current->buf + current->len, handle.out.buf, handle.out.len);
+	current->len += handle.out.len;
+	bytes_written += handle.out.len;
+	if (current->len >= BATCH_SIZE)
+		flush_batch();
+}
+
+/*
+ * mark 和对象引用
+ */
+static struct mark *get_mark(unsigned long n)
+{
+	if (n >= marks_alloc) {
+		unsigned long alloc = n + 1 > alloc_nr(marks_alloc) ? n + 1 : alloc_nr(marks_alloc);
+		marks = realloc(marks, alloc * sizeof(struct mark));
+		memset(marks + marks_alloc, 0, (alloc - marks_alloc) * sizeof(struct mark));
+		marks_alloc = alloc;
+	}
+	return marks + n;
+}
+
+static unsigned long parse_mark_number(const char *p, const char **end)
+{
+	char *e;
+	unsigned long n;
+
+	if (*p != ':')
+		die("expected ':<mark>'");
+	n = strtoul(p + 1, &e, 10);
+	if (e == p + 1 || !n)
+		die("bad mark");
+	*end = e;
+	return n;
+}
+
+/* 解析 ":<n>" 或者 40 个字符的 sha1, 返回下一个字符的位置 */
+static const char *parse_ref(const char *p, unsigned char *sha1, struct mark **mark)
+{
+	*mark = NULL;
+	if (*p == ':') {
+		const char *end;
+		unsigned long n = parse_mark_number(p, &end);
+		if (n >= marks_alloc || is_null_sha1(marks[n].sha1))
+			die("unknown mark");
+		*mark = marks + n;
+		memcpy(sha1, marks[n].sha1, 20);
+		return end;
+	}
+	if (get_sha1_hex((char *)p, sha1))
+		die("expected ':<mark>' or sha1");
+	return p + 40;
+}
+
+static void parse_optional_mark(unsigned long *n)
+{
+	char *line = read_line();
+	const char *end;
+
+	*n = 0;
+	if (line && !strncmp(line, "mark ", 5)) {
+		*n = parse_mark_number(line + 5, &end);
+		return;
+	}
+	if (line)
+		unread_line(line);
+}
+
+/*
+ * 内存中的 tree
+ */
+static void free_tree(struct import_tree *tree)
+{
+	int i;
+
+	if (!tree)
+		return;
+	for (i = 0; i < tree->nr; i++) {
+		free_tree(tree->entries[i]->tree);
+		free(tree->entries[i]);
+	}
+	free(tree->entries);
+	free(tree);
+}
+
+static struct import_entry *new_entry(const char *name, int namelen, unsigned int mode, const unsigned char *sha1)
+{
+	struct import_entry *e = malloc(sizeof(*e) + namelen + 1);
+
+	e->mode = mode;
+	if (sha1)
+		memcpy(e->sha1, sha1, 20);
+	else
+		memset(e->sha1, 0, 20);
+	e->tree = NULL;
+	e->namelen = namelen;
+	memcpy(e->name, name, namelen);
+	e->name[namelen] = 0;
+	return e;
+}
+
+static void insert_entry(struct import_tree *tree, int pos, struct import_entry *e)
+{
+	if (tree->nr == tree->alloc) {
+		tree->alloc = alloc_nr(tree->alloc);
+		tree->entries = realloc(tree->entries, tree->alloc * sizeof(struct import_entry *));
+	}
+	memmove(tree->entries + pos + 1, tree->entries + pos, (tree->nr - pos) * sizeof(struct import_entry *));
+	tree->entries[pos] = e;
+	tree->nr++;
+}
+
+static void remove_entry(struct import_tree *tree, int pos)
+{
+	free_tree(tree->entries[pos]->tree);
+	free(tree->entries[pos]);
+	tree->nr--;
+	memmove(tree->entries + pos, tree->entries + pos + 1, (tree->nr - pos) * sizeof(struct import_entry *));
+}
+
+/* 读入目录 e 的内容(如果还没有读入) */
+static struct import_tree *load_tree(struct import_entry *e)
+{
+	struct tree_desc desc;
+	struct name_entry entry;
+	char type[20];
+	int ret;
+
+	if (e->tree)
+		return e->tree;
+	e->tree = calloc(1, sizeof(struct import_tree));
+	if (is_null_sha1(e->sha1))
+		return e->tree;
+	ret = dircache_read_object(&handle, e->sha1, type, &tree_buf);
+	if (ret == DIRCACHE_ERR_MISSING) {
+		/* 可能是本次导入的 tree, 还没有写入 */
+		sync_objects();
+		ret = dircache_read_object(&handle, e->sha1, type, &tree_buf);
+	}
+	if (ret < 0 || strcmp(type, "tree"))
+		die("unable to read tree");
+	init_tree_desc(&desc, tree_buf.buf, tree_buf.len);
+	while ((ret = tree_entry(&desc, &entry)) > 0)
+		insert_entry(e->tree, e->tree->nr, new_entry(entry.path, entry.pathlen, entry.mode, entry.sha1));
+	if (ret < 0)
+		die("corrupt tree");
+	return e->tree;
+}
+
+/* 二分查找, 找到返回位置, 否则返回 -(插入位置)-1 */
+static int find_entry(struct import_tree *tree, const char *name, int namelen, unsigned int mode)
+{
+	int first = 0, last = tree->nr;
+
+	while (first < last) {
+		int next = (first + last) >> 1;
+		struct import_entry *e = tree->entries[next];
+		int cmp = tree_name_compare(name, namelen, mode, e->name, e->namelen, e->mode);
+		if (!cmp)
+			return next;
+		if (cmp < 0)
+			last = next;
+		else
+			first = next + 1;
+	}
+	return -first - 1;
+}
+
+/* 删除 tree 中名字为 name 的条目(文件或者目录) */
+static int remove_name(struct import_tree *tree, const char *name, int namelen)
+{
+	int pos = find_entry(tree, name, namelen, S_IFREG);
+
+	if (pos < 0)
+		pos = find_entry(tree, name, namelen, S_IFDIR);
+	if (pos < 0)
+		return 0;
+	remove_entry(tree, pos);
+	return 1;
+}
+
+/* 路径中不能有空的部分(开头的 '/', "a//b", 结尾的 '/'), 也不能有 "." 和 ".." */
+static void check_path(const char *path)
+{
+	for (;;) {
+		const char *slash = strchr(path, '/');
+		int len = slash ? slash - path : strlen(path);
+
+		if (!len || (len == 1 && path[0] == '.') || (len == 2 && !memcmp(path, "..", 2)))
+			die("bad path");
+		if (!slash)
+			return;
+		path = slash + 1;
+	}
+}
+
+static void set_path(const char *path, unsigned int mode, const unsigned char *sha1)
+{
+	struct import_tree *tree;
+	const char *slash;
+	int pos;
+
+	check_path(path);
+	tree = load_tree(&root);
+
+	tree->dirty = 1;
+	while ((slash = strchr(path, '/')) != NULL) {
+		struct import_entry *dir;
+
+		pos = find_entry(tree, path, slash - path, S_IFDIR);
+		if (pos < 0) {
+			/* 同名的文件变成了目录 */
+			remove_name(tree, path, slash - path);
+			pos = -find_entry(tree, path, slash - path, S_IFDIR) - 1;
+			insert_entry(tree, pos, new_entry(path, slash - path, S_IFDIR, NULL));
+		}
+		dir = tree->entries[pos];
+		tree = load_tree(dir);
+		tree->dirty = 1;
+		path = slash + 1;
+	}
+	pos = find_entry(tree, path, strlen(path), mode);
+	if (pos >= 0) {
+		tree->entries[pos]->mode = mode;
+		memcpy(tree->entries[pos]->sha1, sha1, 20);
+		return;
+	}
+	/* 同名的目录变成了文件 */
+	remove_name(tree, path, strlen(path));
+	pos = -find_entry(tree, path, strlen(path), mode) - 1;
+	insert_entry(tree, pos, new_entry(path, strlen(path), mode, sha1));
+}
+
+static void delete_path(const char *path)
+{
+	struct import_tree *tree;
+	struct import_tree **trees = NULL;
+	const char *slash;
+	int depth = 0, pos, i;
+
+	check_path(path);
+	tree = load_tree(&root);
+
+	while ((slash = strchr(path, '/')) != NULL) {
+		pos = find_entry(tree, path, slash - path, S_IFDIR);
+		if (pos < 0)
+			goto out;
+		trees = realloc(trees, (depth + 1) * sizeof(*trees));
+		trees[depth++] = tree;
+		tree = load_tree(tree->entries[pos]);
+		path = slash + 1;
+	}
+	if (remove_name(tree, path, strlen(path))) {
+		/* 只有真的删除了文件, 路径上的各级目录才需要重新写入 */
+		tree->dirty = 1;
+		for (i = 0; i < depth; i++)
+			trees[i]->dirty = 1;
+		root.tree->dirty = 1;
+	}
+out:
+	free(trees);
+}
+
+/* 写入目录 e 中修改过的 tree 对象(先写子目录), 空目录从父目录中删除 */
+static void write_tree(struct import_entry *e)
+{
+	struct import_tree *tree = e->tree;
+	int i, offset = 0;
+
+	if (!tree || !tree->dirty)
+		return;
+	for (i = 0; i < tree->nr; ) {
+		struct import_entry *child = tree->entries[i];
+		if (S_ISDIR(child->mode)) {
+			write_tree(child);
+			if (child->tree && !child->tree->nr) {
+				remove_entry(tree, i);
+				continue;
+			}
+		}
+		i++;
+	}
+	for (i = 0; i < tree->nr; i++) {
+		struct import_entry *child = tree->entries[i];
+		if (dircache_buffer_grow(&tree_buf, offset + child->namelen + 64) < 0)
+			die("out of memory");
+		offset += sprintf((char *)tree_buf.buf + offset, "%o %s", child->mode, child->name) + 1;
+		memcpy((char *)tree_buf.buf + offset, child->sha1, 20);
+		offset += 20;
+	}
+	store_object("tree", tree_buf.buf, offset, e->sha1);
+	tree->dirty = 0;
+	nr_trees++;
+}
+
+/* 把当前的 tree 切换到 sha1 对应的 commit 的 tree */
+static void switch_to_commit(const unsigned char *sha1, struct mark *mark)
+{
+	const unsigned char *tree_sha1;
+
+	if (have_last_commit && !memcmp(sha1, last_commit, 20))
+		return;
+	if (mark && mark->is_commit)
+		tree_sha1 = mark->tree;
+	else {
+		struct commit *commit = lookup_commit((unsigned char *)sha1);
+		sync_objects();
+		if (parse_commit(commit) < 0)
+			die("bad 'from' commit");
+		tree_sha1 = commit->tree;
+	}
+	free_tree(root.tree);
+	root.tree = NULL;
+	memcpy(root.sha1, tree_sha1, 20);
+}
+
+static void parse_blob(void)
+{
+	unsigned long n;
+	unsigned char sha1[20];
+
+	parse_optional_mark(&n);
+	parse_data(&data_buf);
+	store_object("blob", data_buf.buf, data_buf.len, sha1);
+	nr_blobs++;
+	if (n)
+		memcpy(get_mark(n)->sha1, sha1, 20);
+}
+
+static unsigned int parse_mode(const char *p, const char **end)
+{
+	unsigned int mode = strtoul(p, (char **)end, 8);
+
+	if (*end == p || **end != ' ')
+		die("bad mode");
+	if (!(mode & S_IFMT))
+		mode |= S_IFREG;
+	if (!S_ISREG(mode))
+		die("only regular files can be imported");
+	(*end)++;
+	return mode;
+}
+
+static void parse_filemodify(const char *p)
+{
+	unsigned char sha1[20];
+	struct mark *mark;
+	unsigned int mode;
+
+	mode = parse_mode(p, &p);
+	if (!strncmp(p, "inline ", 7)) {
+		char *path = strdup(p + 7);
+		parse_data(&data_buf);
+		store_object("blob", data_buf.buf, data_buf.len, sha1);
+		nr_blobs++;
+		set_path(path, mode, sha1);
+		free(path);
+		return;
+	}
+	p = parse_ref(p, sha1, &mark);
+	if (*p != ' ')
+		die("expected path");
+	set_path(p + 1, mode, sha1);
+}
+
+static void parse_commit_command(void)
+{
+	unsigned char parents[MAXPARENT][20], sha1[20];
+	char *line, *author = NULL, *committer = NULL;
+	int nr_parents = 0, have_from = 0, changed = 0, i;
+	unsigned long n, size;
+	struct mark *mark;
+
+	parse_optional_mark(&n);
+	line = read_line();
+	if (!line || strncmp(line, "author ", 7))
+		die("expected 'author'");
+	author = strdup(line + 7);
+	line = read_line();
+	if (line && !strncmp(line, "committer ", 10))
+		committer = strdup(line + 10);
+	else if (line)
+		unread_line(line);
+	parse_data(&message_buf);
+
+	while ((line = read_line()) != NULL) {
+		if (!strncmp(line, "M ", 2))
+			parse_filemodify(line + 2);
+		else if (!strncmp(line, "D ", 2))
+			delete_path(line + 2);
+		else if (!strcmp(line, "deleteall")) {
+			free_tree(root.tree);
+			root.tree = calloc(1, sizeof(struct import_tree));
+			root.tree->dirty = 1;
+		} else if (!strncmp(line, "from ", 5)) {
+			if (have_from || nr_parents > 1 || changed)
+				die("'from' must come before 'merge' and file changes");
+			parse_ref(line + 5, parents[0], &mark);
+			switch_to_commit(parents[0], mark);
+			have_from = 1;
+			nr_parents = 1;
+			continue;
+		} else if (!strncmp(line, "merge ", 6)) {
+			if (nr_parents == MAXPARENT)
+				die("too many parents");
+			/* parents[0] 留给 from 或者上一个 commit */
+			parse_ref(line + 6, parents[nr_parents ? nr_parents : 1], &mark);
+			nr_parents = nr_parents ? nr_parents + 1 : 2;
+			continue;
+		} else if (!*line || *line == '#')
+			continue;
+		else {
+			unread_line(line);
+			break;
+		}
+		changed = 1;
+	}
+	/* 没有 from 时, 第一个 parent 为上一个 commit (reset 之后没有) */
+	if (!have_from) {
+		if (have_last_commit)
+			memcpy(parents[0], last_commit, 20);
+		else if (nr_parents) {
+			memmove(parents[0], parents[1], (nr_parents - 1) * 20);
+			nr_parents--;
+		}
+		if (have_last_commit && !nr_parents)
+			nr_parents = 1;
+	}
+
+	write_tree(&root);
+	if (!root.tree && is_null_sha1(root.sha1)) {
+		/* 空的 tree 也需要写入 */
+		load_tree(&root)->dirty = 1;
+		write_tree(&root);
+	}
+	size = 0;
+	if (dircache_buffer_grow(&commit_buf, message_buf.len + strlen(author) + (committer ? strlen(committer) : strlen(author)) + 60 * (nr_parents + 1) + 32) < 0)
+		die("out of memory");
+	size += sprintf((char *)commit_buf.buf + size, "tree %s\n", sha1_to_hex(root.sha1));
+	for (i = 0; i < nr_parents; i++)
+		size += sprintf((char *)commit_buf.buf + size, "parent %s\n", sha1_to_hex(parents[i]));
+	size += sprintf((char *)commit_buf.buf + size, "author %s\ncommitter %s\n\n", author, committer ? committer : author);
+	memcpy((char *)commit_buf.buf + size, message_buf.buf, message_buf.len);
+	size += message_buf.len;
+	store_object("commit", commit_buf.buf, size, sha1);
+	nr_commits++;
+
+	memcpy(last_commit, sha1, 20);
+	have_last_commit = 1;
+	if (n) {
+		mark = get_mark(n);
+		memcpy(mark->sha1, sha1, 20);
+		memcpy(mark->tree, root.sha1, 20);
+		mark->is_commit = 1;
+	}
+	free(author);
+	free(committer);
+}
+
+static void parse_reset(void)
+{
+	have_last_commit = 0;
+	free_tree(root.tree);
+	root.tree = NULL;
+	memset(root.sha1, 0, 20);
+}
+
+static void export_marks(const char *file)
+{
+	FILE *f = fopen(file, "w");
+	unsigned long i;
+
+	if (!f) {
+		perror(file);
+		exit(1);
+	}
+	for (i = 1; i < marks_alloc; i++)
+		if (!is_null_sha1(marks[i].sha1))
+			fprintf(f, ":%lu %s\n", i, sha1_to_hex(marks[i].sha1));
+	fclose(f);
+}
+
+/*
+ * 命令: "fast-import [--compression=<level>] [--export-marks=<file>] < <stream>"
+ * 示例: $ ./fast-import < history.stream
+ *
+ * 完成后输出最后一个 commit 的 sha1, 统计信息输出到 stderr
+ */
+int main(int argc, char **argv)
+{
+	const char *marks_file = NULL;
+	struct timeval start, end;
+	unsigned long usec;
+	char *line;
+	int i;
+
+	dircache_init(&repo, NULL);
+	dircache_handle_init(&handle, &repo);
+	root.mode = S_IFDIR;
+	for (i = 1; i < argc; i++) {
+		if (!strncmp(argv[i], "--compression=", 14)) {
+			handle.level = atoi(argv[i] + 14);
+			if (handle.level < 0 || handle.level > 9)
+				usage("fast-import: compression level must be 0..9");
+			continue;
+		}
+		if (!strncmp(argv[i], "--export-marks=", 15)) {
+			marks_file = argv[i] + 15;
+			continue;
+		}
+		usage("fast-import [--compression=<level>] [--export-marks=<file>] < <stream>");
+	}
+
+	gettimeofday(&start, NULL);
+	sprintf(tmp_prefix, "tmp_%d_", (int)getpid());
+	pthread_create(&writer, NULL, writer_thread, NULL);
+	while ((line = read_line()) != NULL) {
+		if (!*line || *line == '#')
+			continue;
+		if (!strcmp(line, "blob"))
+			parse_blob();
+		else if (!strcmp(line, "commit"))
+			parse_commit_command();
+		else if (!strcmp(line, "reset"))
+			parse_reset();
+		else {
+			fprintf(stderr, "fast-import: unknown command '%s'\n", line);
+			exit(1);
+		}
+	}
+	flush_batch();
+	pthread_mutex_lock(&writer_mutex);
+	writer_exit = 1;
+	pthread_cond_broadcast(&writer_cond);
+	pthread_mutex_unlock(&writer_mutex);
+	pthread_join(writer, NULL);
+	gettimeofday(&end, NULL);
+
+	if (write_errors)
+		die("unable to write objects");
+	if (marks_file)
+		export_marks(marks_file);
+	if (have_last_commit)
+		printf("%s\n", sha1_to_hex(last_commit));
+	usec = (end.tv_sec - start.tv_sec) * 1000000 + end.tv_usec - start.tv_usec;
+	fprintf(stderr, "%lu blobs, %lu trees, %lu commits (%lu duplicates, %lu bytes) in %lu.%03lu s, %lu commits/s\n",
+		nr_blobs, nr_trees, nr_commits, nr_duplicates, bytes_written,
+		usec / 1000000, usec / 1000 % 1000, usec ? nr_commits * 1000000ul / usec : 0);
+	arena_release();
+	return 0;
+}
+
+/* #
+ * # fast-import 使用示例
+ * #
+ *
+ * # 1. 导入一个包含 1 个单独的 blob 和 2 个 commit 的命令流, 输出最后一个 commit 的 sha1
+ * git-e83c5163$ cat history.stream
+ * blob
+ * mark :1
+ * data 6
+ * hello
+ *
+ * commit
+ * mark :2
+ * author guyongqiang <ygu@guyongqiangx> 1626570000 +0800
+ * data 13
+ * first import
+ *
+ * M 100644 :1 README
+ * M 100644 inline src/main.c
+ * data 13
+ * int main(){}
+ *
+ * commit
+ * mark :3
+ * author guyongqiang <ygu@guyongqiangx> 1626573600 +0800
+ * data 14
+ * remove README
+ * D README
+ * git-e83c5163$ ./fast-import --export-marks=marks < history.stream
+ * 2 blobs, 3 trees, 2 commits (0 duplicates, 507 bytes) in 0.001 s, 1372 commits/s
+ * 6135acf70c7a74f3034b0b7a7f7173ea412421b0
+ *
+ * # 2. marks 文件记录了每个 mark 对应的 sha1
+ * git-e83c5163$ cat marks
+ * :1 d1411423ff8cd2481a52ee2a96a999bf676d6242
+ * :2 d93212670094228c6f7f839cef5380be410bc2a2
+ * :3 6135acf70c7a74f3034b0b7a7f7173ea412421b0
+ *
+ * # 3. 第二个 commit 没有 from, parent 默认是命令流中的上一个 commit
+ * git-e83c5163$ echo 6135acf70c7a74f3034b0b7a7f7173ea412421b0 | ./cat-file --batch
+ * 6135acf70c7a74f3034b0b7a7f7173ea412421b0 commit 222
+ * tree e92f94e72cfb26c0e25a01db236b9283746d3eda
+ * parent d93212670094228c6f7f839cef5380be410bc2a2
+ * author guyongqiang <ygu@guyongqiangx> 1626573600 +0800
+ * committer guyongqiang <ygu@guyongqiangx> 1626573600 +0800
+ *
+ * remove README
+ *
+ * # 4. 导入 10 万个 commit(每个 commit 修改一个 3 层目录下的文件),
+ * #    tree 对象中大部分是无法压缩的 sha1, 压缩级别大于 0 时主要时间花在 zlib 上
+ * git-e83c5163$ ./fast-import < big.stream
+ * 118000 blobs, 300931 trees, 100001 commits (0 duplicates, 229243826 bytes) in 33.124 s, 3018 commits/s
+ * git-e83c5163$ ./fast-import --compression=0 < big.stream
+ * 118000 blobs, 300931 trees, 100001 commits (0 duplicates, 277601619 bytes) in 9.225 s, 10839 commits/s
+ */
@@ -0,0 +1,457 @@
+#include "cache.h"
+
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+/*
+ * 检查对象库的完整性, 分两步进行, 每一步都由多个线程按目录(.dircache/objects/xx)分工:
+ *
+ * 1. 读取 256 个目录, 得到所有对象的 sha1 和 inode, 每个目录的对象按 sha1 排序
+ * 2. 每个目录内按 inode 顺序(接近磁盘上的顺序)逐个读取对象:
+ *    - 重新计算文件内容(压缩后的数据)的 sha1, 和文件名比较
+ *    - 检查 zlib 数据是否完整, 头部 "<type> <size>" 是否和解压后的内容一致
+ *    - 检查 tree/commit 的格式, tree 中的记录必须按顺序排列
+ *    - 在第 1 步的结果中查找 tree/commit 引用的对象, 不存在时报告 missing
+ *
+ * 引用的对象存在时, 只在该对象上记录它被当作哪种类型引用(原子操作), 全部检查完以后
+ * 再比较对象的实际类型. 这样不需要保存所有的引用关系, 内存只和对象个数有关.
+ *
+ * 只检查主对象目录中的对象, 引用的对象在备用对象目录(alternates)中时只确认它存在.
+ * 检查过程中其他进程新写入的对象不在第 1 步的结果中, 引用它们的对象会被报告为 missing.
+ * 发现的问题输出到 stdout, 每个问题一行; 进度和统计信息输出到 stderr.
+ */
+#define MAX_FSCK_THREADS 64
+
+#define TYPE_BLOB	1
+#define TYPE_TREE	2
+#define TYPE_COMMIT	4
+
+struct fsck_object {
+	unsigned char sha1[20];
+	unsigned char type;		/* 检查后得到的类型, 对象损坏时为 0 */
+	unsigned char referenced;	/* 被引用时期望的类型(TYPE_* 的组合) */
+	ino_t ino;
+};
+
+/* 每个目录的对象, 按 sha1 排序 */
+struct fsck_dir {
+	struct fsck_object *objs;
+	int nr, alloc;
+};
+
+static struct dircache repo;
+static struct fsck_dir dirs[256];
+static int next_dir, dirs_done;
+static int nr_threads, problems;
+
+/* 统计信息, 各个线程用原子操作更新 */
+static unsigned long nr_objects, nr_bytes, nr_types[5];
+
+static const char *type_name(int type)
+{
+	switch (type) {
+	case TYPE_BLOB:
+		return "blob";
+	case TYPE_TREE:
+		return "tree";
+	case TYPE_COMMIT:
+		return "commit";
+	}
+	return "unknown";
+}
+
+static void report(const char *fmt, ...)
+{
+	char buf[256];
+	va_list args;
+
+	va_start(args, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+	/* 一次 printf 输出一整行, 多个线程的输出不会混在同一行 */
+	printf("%s\n", buf);
+	__sync_fetch_and_add(&problems, 1);
+}
+
+static int compare_sha1(const void *a, const void *b)
+{
+	return memcmp(((struct fsck_object *)a)->sha1, ((struct fsck_object *)b)->sha1, 20);
+}
+
+static struct fsck_object *lookup_object(const unsigned char *sha1)
+{
+	struct fsck_dir *dir = dirs + sha1[0];
+	int first = 0, last = dir->nr;
+
+	while (first < last) {
+		int next = (first + last) / 2;
+		int cmp = memcmp(sha1, dir->objs[next].sha1, 20);
+
+		if (!cmp)
+			return dir->objs + next;
+		if (cmp < 0)
+			last = next;
+		else
+			first = next + 1;
+	}
+	return NULL;
+}
+
+/* 第 1 步: 读取目录 xx 中所有文件名为 38 个十六进制字符的文件 */
+static void scan_dir(int n)
+{
+	struct fsck_dir *dir = dirs + n;
+	char path[PATH_MAX], hex[41];
+	struct dirent *de;
+	DIR *d;
+
+	snprintf(path, sizeof(path), "%s/%02x", repo.object_dir, n);
+	d = opendir(path);
+	if (!d) {
+		if (errno != ENOENT)
+			report("unreadable directory %s: %s", path, strerror(errno));
+		return;
+	}
+	sprintf(hex, "%02x", n);
+	while ((de = readdir(d)) != NULL) {
+		struct fsck_object *obj;
+
+		/* "." "..", 以及写入对象时的临时文件 tmp_XXXXXX */
+		if (strlen(de->d_name) != 38)
+			continue;
+		memcpy(hex + 2, de->d_name, 39);
+		if (dir->nr == dir->alloc) {
+			dir->alloc = alloc_nr(dir->alloc);
+			dir->objs = realloc(dir->objs, dir->alloc * sizeof(struct fsck_object));
+		}
+		obj = dir->objs + dir->nr;
+		if (get_sha1_hex(hex, obj->sha1) < 0)
+			continue;
+		obj->type = 0;
+		obj->referenced = 0;
+		obj->ino = de->d_ino;
+		dir->nr++;
+	}
+	closedir(d);
+	qsort(dir->objs, dir->nr, sizeof(struct fsck_object), compare_sha1);
+}
+
+/* 记录 from 对 sha1 的引用, 期望的类型为 type */
+static void add_reference(const unsigned char *from, const unsigned char *sha1, int type)
+{
+	struct fsck_object *obj = lookup_object(sha1);
+	char hex[41], from_hex[41];
+
+	/* 备用对象目录中的对象不检查, 只确认它存在 */
+	if (!obj && dircache_has_object(&repo, sha1))
+		return;
+	if (!obj) {
+		report("missing %s %s (referenced by %s)", type_name(type),
+		       dircache_sha1_to_hex(sha1, hex), dircache_sha1_to_hex(from, from_hex));
+		return;
+	}
+	if (!(obj->referenced & type))
+		__sync_fetch_and_or(&obj->referenced, type);
+}
+
+static int fsck_tree(struct fsck_object *obj, const void *buf, unsigned long size)
+{
+	struct tree_desc desc;
+	struct name_entry entry, last;
+	int ret, first = 1;
+
+	init_tree_desc(&desc, buf, size);
+	while ((ret = tree_entry(&desc, &entry)) > 0) {
+		if (!S_ISDIR(entry.mode) && !S_ISREG(entry.mode))
+			return -1;
+		if (!first && tree_name_compare(last.path, last.pathlen, last.mode,
+						entry.path, entry.pathlen, entry.mode) >= 0)
+			return -1;
+		add_reference(obj->sha1, entry.sha1, S_ISDIR(entry.mode) ? TYPE_TREE : TYPE_BLOB);
+		last = entry;
+		first = 0;
+	}
+	return ret;
+}
+
+/* 检查 "<name> <sha1>\n" 这样的一行, 成功时返回下一行的开始 */
+static const char *parse_sha1_line(const char *buf, const char *end, const char *name, unsigned char *sha1)
+{
+	int len = strlen(name);
+
+	if (end - buf < len + 42 || memcmp(buf, name, len) || buf[len] != ' ' || buf[len + 41] != '\n')
+		return NULL;
+	if (get_sha1_hex((char *)buf + len + 1, sha1) < 0)
+		return NULL;
+	return buf + len + 42;
+}
+
+/* 检查 "<name> <内容>\n" 这样的一行, 成功时返回下一行的开始 */
+static const char *parse_text_line(const char *buf, const char *end, const char *name)
+{
+	int len = strlen(name);
+	const char *eol;
+
+	if (end - buf <= len || memcmp(buf, name, len) || buf[len] != ' ')
+		return NULL;
+	eol = memchr(buf, '\n', end - buf);
+	return eol ? eol + 1 : NULL;
+}
+
+static int fsck_commit(struct fsck_object *obj, const char *buf, unsigned long size)
+{
+	const char *end = buf + size, *next;
+	unsigned char sha1[20];
+
+	buf = parse_sha1_line(buf, end, "tree", sha1);
+	if (!buf)
+		return -1;
+	add_reference(obj->sha1, sha1, TYPE_TREE);
+	while ((next = parse_sha1_line(buf, end, "parent", sha1)) != NULL) {
+		add_reference(obj->sha1, sha1, TYPE_COMMIT);
+		buf = next;
+	}
+	buf = parse_text_line(buf, end, "author");
+	if (buf)
+		buf = parse_text_line(buf, end, "committer");
+	/* 头部和提交信息之间的空行 */
+	if (!buf || buf == end || *buf != '\n')
+		return -1;
+	return 0;
+}
+
+static void fsck_object(struct dircache_handle *h, struct dircache_buffer *buf, struct fsck_object *obj)
+{
+	unsigned char sha1[20];
+	char type[20], hex[41], real_hex[41];
+	SHA_CTX c;
+	int ret;
+
+	dircache_sha1_to_hex(obj->sha1, hex);
+	ret = dircache_read_object(h, obj->sha1, type, buf);
+	if (ret != 0 && ret != DIRCACHE_ERR_CORRUPT) {
+		report("unreadable %s: %s", hex, ret == DIRCACHE_ERR_IO ? strerror(errno) : dircache_strerror(ret));
+		return;
+	}
+	__sync_fetch_and_add(&nr_objects, 1);
+	__sync_fetch_and_add(&nr_bytes, h->in.len);
+
+	/* 对象文件已经完整读入 h->in, 先检查它的 sha1 */
+	SHA1_Init(&c);
+	SHA1_Update(&c, h->in.buf, h->in.len);
+	SHA1_Final(sha1, &c);
+	if (memcmp(sha1, obj->sha1, 20)) {
+		report("corrupt %s: sha1 mismatch (content is %s)", hex, dircache_sha1_to_hex(sha1, real_hex));
+		return;
+	}
+	if (ret < 0) {
+		report("corrupt %s: %s", hex, dircache_strerror(ret));
+		return;
+	}
+
+	if (!strcmp(type, "blob"))
+		obj->type = TYPE_BLOB;
+	else if (!strcmp(type, "tree")) {
+		if (fsck_tree(obj, buf->buf, buf->len) < 0) {
+			report("corrupt %s: bad tree", hex);
+			return;
+		}
+		obj->type = TYPE_TREE;
+	} else if (!strcmp(type, "commit")) {
+		if (fsck_commit(obj, buf->buf, buf->len) < 0) {
+			report("corrupt %s: bad commit", hex);
+			return;
+		}
+		obj->type = TYPE_COMMIT;
+	} else {
+		report("corrupt %s: unknown type '%s'", hex, type);
+		return;
+	}
+	__sync_fetch_and_add(&nr_types[obj->type], 1);
+}
+
+static int compare_inode(const void *a, const void *b)
+{
+	ino_t x = (*(struct fsck_object **)a)->ino, y = (*(struct fsck_object **)b)->ino;
+
+	return x < y ? -1 : x > y;
+}
+
+/* 第 2 步: 按 inode 顺序检查目录中的每一个对象 */
+static void check_dir(struct dircache_handle *h, struct dircache_buffer *buf, int n)
+{
+	struct fsck_dir *dir = dirs + n;
+	struct fsck_object **order;
+	int i;
+
+	order = malloc(dir->nr * sizeof(struct fsck_object *) + 1);
+	for (i = 0; i < dir->nr; i++)
+		order[i] = dir->objs + i;
+	qsort(order, dir->nr, sizeof(struct fsck_object *), compare_inode);
+	for (i = 0; i < dir->nr; i++)
+		fsck_object(h, buf, order[i]);
+	free(order);
+}
+
+static void *fsck_thread(void *data)
+{
+	int scan = data != NULL;
+	struct dircache_handle h;
+	struct dircache_buffer buf = { NULL, 0, 0 };
+	int n;
+
+	if (!scan && dircache_handle_init(&h, &repo) < 0)
+		return NULL;
+	while ((n = __sync_fetch_and_add(&next_dir, 1)) < 256) {
+		if (scan)
+			scan_dir(n);
+		else
+			check_dir(&h, &buf, n);
+		__sync_fetch_and_add(&dirs_done, 1);
+	}
+	if (!scan) {
+		dircache_handle_release(&h);
+		dircache_buffer_release(&buf);
+	}
+	return NULL;
+}
+
+static unsigned long now_usec(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000ul + tv.tv_usec;
+}
+
+static void show_progress(unsigned long start, int done)
+{
+	unsigned long usec = now_usec() - start;
+
+	fprintf(stderr, "\rchecking objects: %d/256 directories, %lu objects, %lu MB, %lu objects/s%s",
+		__sync_fetch_and_add(&dirs_done, 0), nr_objects, nr_bytes >> 20,
+		usec ? nr_objects * 1000000ul / usec : 0, done ? "\n" : "");
+}
+
+/* 用 nr_threads 个线程处理所有目录, 主线程每秒输出一次进度 */
+static void run_threads(int scan, int progress, unsigned long start)
+{
+	pthread_t threads[MAX_FSCK_THREADS];
+	int i;
+
+	next_dir = 0;
+	dirs_done = 0;
+	for (i = 0; i < nr_threads; i++)
+		pthread_create(&threads[i], NULL, fsck_thread, scan ? (void *)1 : NULL);
+	while (progress) {
+		unsigned long next = now_usec() + 1000000;
+		int done;
+
+		while (!(done = __sync_fetch_and_add(&dirs_done, 0) == 256) && now_usec() < next)
+			usleep(20000);
+		show_progress(start, done);
+		if (done)
+			break;
+	}
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+}
+
+/*
+ * 命令: "fsck-cache [-j <threads>] [--progress]"
+ * 示例: $ ./fsck-cache
+ *
+ * 没有发现问题时返回 0; stderr 是终端或者指定 --progress 时每秒输出一次进度
+ */
+int main(int argc, char **argv)
+{
+	unsigned long start, usec, total = 0;
+	int i, n, progress = isatty(2);
+
+	nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+			nr_threads = atoi(argv[++i]);
+			continue;
+		}
+		if (!strcmp(argv[i], "--progress")) {
+			progress = 1;
+			continue;
+		}
+		usage("fsck-cache [-j <threads>] [--progress]");
+	}
+	if (nr_threads < 1)
+		nr_threads = 1;
+	if (nr_threads > MAX_FSCK_THREADS)
+		nr_threads = MAX_FSCK_THREADS;
+	if (dircache_init(&repo, NULL) < 0)
+		usage("fsck-cache: out of memory");
+
+	start = now_usec();
+	run_threads(1, 0, start);
+	for (n = 0; n < 256; n++)
+		total += dirs[n].nr;
+	if (progress)
+		fprintf(stderr, "found %lu objects\n", total);
+	run_threads(0, progress, start);
+
+	/* 所有对象都检查完以后, 比较对象的类型和引用它时期望的类型 */
+	for (n = 0; n < 256; n++) {
+		for (i = 0; i < dirs[n].nr; i++) {
+			struct fsck_object *obj = dirs[n].objs + i;
+			int type;
+
+			if (!obj->type)
+				continue;
+			for (type = TYPE_BLOB; type <= TYPE_COMMIT; type <<= 1)
+				if ((obj->referenced & type) && type != obj->type)
+					report("wrong type %s: %s, referenced as %s",
+					       sha1_to_hex(obj->sha1), type_name(obj->type), type_name(type));
+		}
+	}
+
+	fflush(stdout);
+	usec = now_usec() - start;
+	fprintf(stderr, "%lu objects (%lu blobs, %lu trees, %lu commits), %lu MB in %lu.%03lu s, "
+		"%lu objects/s, %lu MB/s, %d threads, %d problems\n",
+		nr_objects, nr_types[TYPE_BLOB], nr_types[TYPE_TREE], nr_types[TYPE_COMMIT],
+		nr_bytes >> 20, usec / 1000000, usec / 1000 % 1000,
+		usec ? nr_objects * 1000000ul / usec : 0, usec ? nr_bytes / usec : 0,
+		nr_threads, problems);
+	return problems ? 1 : 0;
+}
+
+/* #
+ * # fsck-cache 使用示例
+ * #
+ *
+ * # 1. 检查没有问题的对象库, 返回 0
+ * git-e83c5163$ ./fsck-cache
+ * 17 objects (6 blobs, 7 trees, 4 commits), 0 MB in 0.018 s, 923 objects/s, 15 MB/s, 1 threads, 0 problems
+ *
+ * # 2. 人为制造一些问题: 删除一个 tree 对象, 修改一个对象文件中的一个字节,
+ * #    另外用脚本写入几个格式错误的对象(文件名是正确的 sha1), 每个问题输出一行, 返回 1
+ * git-e83c5163$ rm .dircache/objects/82/9c10d96d2f0356ccab7dd65ba38824ec3ab771
+ * git-e83c5163$ printf 'Z' | dd of=.dircache/objects/87/3158628542df06e0805a33f6436c9c4b65e52b bs=1 seek=5 conv=notrunc
+ * git-e83c5163$ ./fsck-cache
+ * missing commit 1111111111111111111111111111111111111111 (referenced by 37855b7c8fd73ea9e2f46845c12a7797a92420c7)
+ * corrupt 7d5c9182ec6712bdf6b597f108e42240007d049f: unknown type 'tag'
+ * corrupt 873158628542df06e0805a33f6436c9c4b65e52b: sha1 mismatch (content is afa27afed68b34e43776fb26629e5d91ef1b2414)
+ * corrupt a3f38adab119cc2afbf8b450fd408d21ab731d96: bad tree
+ * missing tree 829c10d96d2f0356ccab7dd65ba38824ec3ab771 (referenced by aa7e7c564b6c9be7544f022cd0915ea3fc517050)
+ * missing tree 829c10d96d2f0356ccab7dd65ba38824ec3ab771 (referenced by ea2bc8ba7c383a53df835946a8da7bcbcc0916a6)
+ * corrupt fed0d1adfb1682952933e283080beb23ffd32a51: bad commit
+ * corrupt ff9fbfc19e5d420aee6ef8ae2fac4a9aee976b3d: corrupt object
+ * wrong type d1411423ff8cd2481a52ee2a96a999bf676d6242: blob, referenced as tree
+ * 23 objects (6 blobs, 6 trees, 6 commits), 0 MB in 0.020 s, 1124 objects/s, 14 MB/s, 1 threads, 9 problems
+ *
+ * # 3. 检查 fast-import 导入的 10 万个 commit, 4 个线程, 每秒输出一次进度(终端中在同一行刷新)
+ * git-e83c5163$ ./fsck-cache -j 4 --progress
+ * found 518932 objects
+ * checking objects: 23/256 directories, 48957 objects, 20 MB, 29323 objects/s
+ * ...
+ * checking objects: 256/256 directories, 518932 objects, 218 MB, 42860 objects/s
+ * 518932 objects (118000 blobs, 300931 trees, 100001 commits), 218 MB in 12.118 s, 42822 objects/s, 18 MB/s, 4 threads, 0 problems
+ */
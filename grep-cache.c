@@ -0,0 +1,426 @@
+#define _GNU_SOURCE
+#include "cache.h"
+
+#include <pthread.h>
+#include <regex.h>
+#include <unistd.h>
+
+/*
+ * 在暂存区跟踪的文件中搜索, 未跟踪的文件(比如编译输出)不会被搜索
+ *
+ * 对每一个 cache entry:
+ *   工作区文件的 stat 信息没有变化(match_stat() 返回 0)时, 直接搜索工作区中的文件;
+ *   否则搜索暂存区中保存的对象(解压后的 blob 数据).
+ * 指定 tree 对象时, 搜索 tree 中的所有 blob 对象.
+ *
+ * 多个线程并行搜索, 每个文件的搜索结果先保存在各自的缓冲区, 再按照暂存区顺序输出.
+ * 搜索前先用模式中最长的固定字符串做一次 memmem() 过滤(glibc 的实现使用了 SIMD 指令),
+ * 不包含该字符串的文件不需要再逐行执行正则匹配.
+ */
+#define MAX_GREP_THREADS 32
+
+struct grep_item {
+	const char *name;
+	unsigned char *sha1;
+	int from_worktree;
+	/* 搜索结果, done 为 1 表示已经搜索完成 */
+	char *out;
+	unsigned long outlen, outalloc;
+	int done;
+};
+
+static struct grep_item *items;
+static int nr_items, next_item;
+
+static pthread_mutex_t grep_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t grep_cond = PTHREAD_COND_INITIALIZER;
+
+static regex_t regex;
+static char *literal;
+static int literal_len;
+static int fixed, ignore_case, extended, name_only, line_number;
+
+/*
+ * 从正则表达式中找出最长的一段必须出现的固定字符串, 用于预先过滤
+ * 只考虑分组 (...) 以外的字符串, 后面跟着量词的最后一个字符不是必须出现的,
+ * 包含 '|' 分支的模式没有必须出现的字符串, 不做过滤
+ */
+static void find_literal(const char *pattern)
+{
+	const char *special = extended ? ".[]\\*^$+?(){}|" : ".[]\\*^$";
+	const char *p = pattern, *start = NULL;
+	int len = 0, depth = 0;
+
+	if (fixed) {
+		literal = strdup(pattern);
+		literal_len = strlen(pattern);
+		return;
+	}
+	if (strchr(pattern, '|'))
+		return;
+	while (*p) {
+		const char *q = p;
+		char c;
+
+		while (*q && !strchr(special, *q))
+			q++;
+		c = *q;
+		if (q > p && (c == '*' ||
+		    (extended && (c == '+' || c == '?' || c == '{')) ||
+		    (!extended && c == '\\' && q[1] && strchr("{?+", q[1]))))
+			q--;
+		if (!depth && q - p > len) {
+			start = p;
+			len = q - p;
+		}
+		p = q;
+		if (!*p)
+			break;
+		c = *p++;
+		if (c == '[') {
+			/* 跳过 [...] 字符集合 */
+			if (*p == '^')
+				p++;
+			if (*p == ']')
+				p++;
+			while (*p && *p != ']')
+				p++;
+			if (*p)
+				p++;
+		} else if (c == '\\' && *p) {
+			if (!extended && *p == '(')
+				depth++;
+			if (!extended && *p == ')' && depth)
+				depth--;
+			p++;
+		} else if (extended && c == '(')
+			depth++;
+		else if (extended && c == ')' && depth)
+			depth--;
+		else if (!strchr(special, c))
+			/* 量词前面被去掉的最后一个字符 */
+			continue;
+	}
+	if (len) {
+		literal = strndup(start, len);
+		literal_len = len;
+	}
+}
+
+static void add_output(struct grep_item *item, const char *fmt, ...)
+{
+	va_list args;
+	int len;
+
+	for (;;) {
+		unsigned long avail = item->outalloc - item->outlen;
+		va_start(args, fmt);
+		len = vsnprintf(item->out + item->outlen, avail, fmt, args);
+		va_end(args);
+		if (len < avail)
+			break;
+		item->outalloc = alloc_nr(item->outlen + len + 1);
+		item->out = realloc(item->out, item->outalloc);
+	}
+	item->outlen += len;
+}
+
+/* 判断 buf[start, end) 这一行是否匹配 */
+static int match_line(char *buf, unsigned long start, unsigned long end)
+{
+	regmatch_t m;
+
+	if (fixed && !ignore_case)
+		return 1;
+	m.rm_so = start;
+	m.rm_eo = end;
+	return !regexec(&regex, buf, 1, &m, REG_STARTEND);
+}
+
+/*
+ * 搜索 buf 中匹配的行, 结果保存到 item->out
+ * 有固定字符串时只检查包含该字符串的行
+ */
+static void grep_buffer(struct grep_item *item, char *buf, unsigned long size)
+{
+	unsigned long pos = 0, lineno = 1, counted = 0;
+	int binary = memchr(buf, 0, size < 8000 ? size : 8000) != NULL;
+
+	while (pos < size) {
+		unsigned long start = pos, end;
+		char *eol;
+
+		if (literal && !ignore_case) {
+			char *hit = memmem(buf + pos, size - pos, literal, literal_len);
+			if (!hit)
+				break;
+			/* 回退到命中位置所在行的开始 */
+			start = hit - buf;
+			while (start > pos && buf[start-1] != '\n')
+				start--;
+		}
+		eol = memchr(buf + start, '\n', size - start);
+		end = eol ? eol - buf : size;
+		if (match_line(buf, start, end)) {
+			if (name_only || binary) {
+				if (binary && !name_only)
+					add_output(item, "Binary file %s matches\n", item->name);
+				else
+					add_output(item, "%s\n", item->name);
+				return;
+			}
+			if (line_number) {
+				/* 只在需要行号时统计换行符 */
+				char *p = buf + counted;
+				while ((p = memchr(p, '\n', start - (p - buf))) != NULL) {
+					lineno++;
+					p++;
+				}
+				counted = start;
+				add_output(item, "%s:%lu:%.*s\n", item->name, lineno, (int)(end - start), buf + start);
+			} else
+				add_output(item, "%s:%.*s\n", item->name, (int)(end - start), buf + start);
+		}
+		pos = end + 1;
+	}
+}
+
+static void grep_item(struct grep_item *item)
+{
+	unsigned long size;
+	char type[20];
+	void *buf;
+
+	if (item->from_worktree) {
+		struct stat st;
+		int fd = open(item->name, O_RDONLY);
+
+		if (fd < 0)
+			return;
+		if (fstat(fd, &st) < 0 || !st.st_size) {
+			close(fd);
+			return;
+		}
+		buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (buf == MAP_FAILED)
+			return;
+		grep_buffer(item, buf, st.st_size);
+		munmap(buf, st.st_size);
+		return;
+	}
+
+	/* sha1_file_name() 使用静态缓冲区, 映射对象文件时需要加锁, 解压不需要 */
+	pthread_mutex_lock(&grep_mutex);
+	buf = map_sha1_file(item->sha1, &size);
+	pthread_mutex_unlock(&grep_mutex);
+	if (!buf)
+		return;
+	{
+		unsigned long mapsize = size;
+		void *data = unpack_sha1_file(buf, mapsize, type, &size);
+		munmap(buf, mapsize);
+		if (!data)
+			return;
+		if (!strcmp(type, "blob"))
+			grep_buffer(item, data, size);
+		free(data);
+	}
+}
+
+static void *grep_thread(void *data)
+{
+	for (;;) {
+		struct grep_item *item;
+
+		pthread_mutex_lock(&grep_mutex);
+		if (next_item >= nr_items) {
+			pthread_mutex_unlock(&grep_mutex);
+			return NULL;
+		}
+		item = items + next_item++;
+		pthread_mutex_unlock(&grep_mutex);
+
+		grep_item(item);
+
+		pthread_mutex_lock(&grep_mutex);
+		item->done = 1;
+		pthread_cond_broadcast(&grep_cond);
+		pthread_mutex_unlock(&grep_mutex);
+	}
+}
+
+static void add_item(const char *name, unsigned char *sha1, int from_worktree)
+{
+	static int alloc;
+
+	if (nr_items == alloc) {
+		alloc = alloc_nr(alloc);
+		items = realloc(items, alloc * sizeof(struct grep_item));
+	}
+	memset(items + nr_items, 0, sizeof(struct grep_item));
+	items[nr_items].name = name;
+	items[nr_items].sha1 = sha1;
+	items[nr_items].from_worktree = from_worktree;
+	nr_items++;
+}
+
+/* 将暂存区中的每一个条目添加到搜索列表 */
+static void add_cache_items(void)
+{
+	int i;
+
+	if (read_cache() < 0) {
+		perror("read_cache");
+		exit(1);
+	}
+	for (i = 0; i < active_nr; i++) {
+		struct cache_entry *ce = active_cache[i];
+		struct stat st;
+		int clean = 0;
+
+		if (path_in_sparse(ce->name, ce->namelen) && !stat(ce->name, &st))
+			clean = !match_stat(ce, &st);
+		add_item(ce->name, ce->sha1, clean);
+	}
+}
+
+/* 将 tree 对象中的每一个 blob 添加到搜索列表, 子目录递归展开, base 为路径前缀 */
+static void add_tree_items(unsigned char *sha1, const char *base, int baselen)
+{
+	unsigned long size;
+	char type[20];
+	char *buffer = read_sha1_file(sha1, type, &size);
+	struct tree_desc desc;
+	struct name_entry entry;
+	int ret;
+
+	if (!buffer)
+		usage("unable to read sha1 file");
+	if (strcmp(type, "tree"))
+		usage("expected a 'tree' node");
+	/* 名字和 sha1 直接指向 buffer, 所以 buffer 在搜索结束前不能释放 */
+	init_tree_desc(&desc, buffer, size);
+	while ((ret = tree_entry(&desc, &entry)) > 0) {
+		char *fullpath = malloc(baselen + entry.pathlen + 2);
+
+		memcpy(fullpath, base, baselen);
+		memcpy(fullpath + baselen, entry.path, entry.pathlen + 1);
+		if (S_ISDIR(entry.mode)) {
+			fullpath[baselen + entry.pathlen] = '/';
+			fullpath[baselen + entry.pathlen + 1] = 0;
+			add_tree_items((unsigned char *)entry.sha1, fullpath, baselen + entry.pathlen + 1);
+			free(fullpath);
+		} else
+			add_item(fullpath, (unsigned char *)entry.sha1, 0);
+	}
+	if (ret < 0)
+		usage("corrupt 'tree' file");
+}
+
+/*
+ * 命令: "grep-cache [-F|-E] [-i] [-l] [-n] <pattern> [<tree-sha1>]"
+ * 示例: $ ./grep-cache -n read_cache
+ */
+int main(int argc, char **argv)
+{
+	pthread_t threads[MAX_GREP_THREADS];
+	unsigned char sha1[20];
+	int i, nr_threads, flags, found = 0;
+	char *pattern;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		char *arg = argv[i];
+		if (!strcmp(arg, "-F"))
+			fixed = 1;
+		else if (!strcmp(arg, "-E"))
+			extended = 1;
+		else if (!strcmp(arg, "-i"))
+			ignore_case = 1;
+		else if (!strcmp(arg, "-l"))
+			name_only = 1;
+		else if (!strcmp(arg, "-n"))
+			line_number = 1;
+		else
+			usage("grep-cache [-F|-E] [-i] [-l] [-n] <pattern> [<tree-sha1>]");
+	}
+	if (i >= argc || argc - i > 2)
+		usage("grep-cache [-F|-E] [-i] [-l] [-n] <pattern> [<tree-sha1>]");
+	pattern = argv[i];
+
+	flags = REG_NEWLINE;
+	if (extended)
+		flags |= REG_EXTENDED;
+	if (ignore_case)
+		flags |= REG_ICASE;
+	if (fixed) {
+		/* 忽略大小写的固定字符串也通过正则表达式匹配, 需要转义特殊字符 */
+		char *re = malloc(2 * strlen(pattern) + 1), *p = re, *q;
+		for (q = pattern; *q; q++) {
+			if (strchr(".[]\\*^$", *q))
+				*p++ = '\\';
+			*p++ = *q;
+		}
+		*p = 0;
+		flags &= ~REG_EXTENDED;
+		if (regcomp(&regex, re, flags))
+			usage("invalid pattern");
+		free(re);
+	} else if (regcomp(&regex, pattern, flags))
+		usage("invalid pattern");
+	find_literal(pattern);
+
+	if (i + 1 < argc) {
+		if (get_sha1_hex(argv[i+1], sha1) < 0)
+			usage("grep-cache [-F|-E] [-i] [-l] [-n] <pattern> [<tree-sha1>]");
+		add_tree_items(sha1, "", 0);
+	} else
+		add_cache_items();
+
+	nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_threads < 1)
+		nr_threads = 1;
+	if (nr_threads > MAX_GREP_THREADS)
+		nr_threads = MAX_GREP_THREADS;
+	if (nr_threads > nr_items)
+		nr_threads = nr_items;
+	for (i = 0; i < nr_threads; i++)
+		pthread_create(&threads[i], NULL, grep_thread, NULL);
+
+	/* 按照暂存区(或 tree)中的顺序输出结果 */
+	for (i = 0; i < nr_items; i++) {
+		struct grep_item *item = items + i;
+
+		pthread_mutex_lock(&grep_mutex);
+		while (!item->done)
+			pthread_cond_wait(&grep_cond, &grep_mutex);
+		pthread_mutex_unlock(&grep_mutex);
+		if (item->outlen) {
+			fwrite(item->out, item->outlen, 1, stdout);
+			found = 1;
+		}
+		free(item->out);
+	}
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+	return !found;
+}
+
+/* #
+ * # grep-cache 使用示例
+ * #
+ *
+ * # 1. 在暂存区跟踪的文件中搜索, 显示行号
+ * git-e83c5163$ ./grep-cache -n sha1_file_directory
+ * cache.h:84:const char *sha1_file_directory;
+ * read-cache.c:8:const char *sha1_file_directory = NULL;
+ * ...
+ *
+ * # 2. 只列出包含匹配内容的文件
+ * git-e83c5163$ ./grep-cache -l -E 'inflate(Init|End)'
+ * read-cache.c
+ *
+ * # 3. 在 tree 对象中搜索
+ * git-e83c5163$ ./grep-cache -F BLOCKING cb8b8e042b2abdf1070f9f60d83f3fb9cbe204ce
+ * commit-tree.c:#define BLOCKING (1ul << 14)
+ */
@@ -0,0 +1,217 @@
+#include "cache.h"
+
+/*
+ * 查找两个 commit 的共同祖先
+ *
+ * 从两个 commit 同时往回遍历, 分别标记 PARENT1 和 PARENT2, 两个标记都有的 commit 就是共同祖先,
+ * 共同祖先的各级 parent 都标记为 STALE (不可能是"最近"的共同祖先), 队列中只剩下 STALE 的 commit 时停止.
+ * 队列按 generation 排序(有 commit-graph 时), 出队时它的所有子孙都已经处理过, 标记不会遗漏,
+ * 所以不会像按时间排序那样受时钟偏差影响, 也不需要多走.
+ *
+ * "--is-ancestor A B" 判断 A 是否为 B 的祖先: 从 B 往回遍历,
+ * generation 比 A 小的 commit 不可能是 A 的子孙, 不需要再往下走.
+ */
+#define PARENT1		0x0100
+#define PARENT2		0x0200
+#define STALE		0x0400
+#define RESULT		0x0800
+#define REACHED		0x1000
+
+static struct commit *get_commit(char *hex)
+{
+	unsigned char sha1[20];
+	struct commit *commit;
+
+	if (get_sha1_hex(hex, sha1))
+		usage("merge-base [--all] <commit> <commit> | --is-ancestor <commit> <commit>");
+	commit = lookup_commit(sha1);
+	if (parse_commit(commit) < 0)
+		usage("bad commit object");
+	return commit;
+}
+
+static int queue_has_nonstale(struct commit_queue *queue)
+{
+	unsigned int i;
+
+	for (i = 0; i < queue->nr; i++)
+		if (!(queue->array[i].item->flags & STALE))
+			return 1;
+	return 0;
+}
+
+static struct commit **reached;
+static unsigned int reached_nr, reached_alloc;
+
+static void add_reached(struct commit *commit)
+{
+	if (reached_nr == reached_alloc) {
+		reached_alloc = alloc_nr(reached_alloc);
+		reached = realloc(reached, reached_alloc * sizeof(*reached));
+	}
+	reached[reached_nr++] = commit;
+}
+
+/* one 是否为 two 的祖先 */
+static int is_ancestor(struct commit *one, struct commit *two)
+{
+	struct commit **stack;
+	unsigned int nr = 0, alloc = 16, min_generation = 0;
+	int found = 0;
+
+	if (one == two)
+		return 1;
+	if (one->generation != GENERATION_INFINITY)
+		min_generation = one->generation;
+	else if (two->generation != GENERATION_INFINITY)
+		return 0;	/* commit-graph 中的 commit 的祖先都在 commit-graph 中 */
+	stack = malloc(alloc * sizeof(*stack));
+	stack[nr++] = two;
+	two->flags |= REACHED;
+	reached_nr = 0;
+	while (nr && !found) {
+		struct commit *commit = stack[--nr];
+		struct commit_list *parents;
+
+		if (parse_commit(commit) < 0)
+			usage("bad commit object");
+		for (parents = commit->parents; parents; parents = parents->next) {
+			struct commit *parent = parents->item;
+
+			if (parent == one) {
+				found = 1;
+				break;
+			}
+			if (parent->flags & REACHED)
+				continue;
+			parent->flags |= REACHED;
+			add_reached(parent);
+			if (parse_commit(parent) < 0)
+				usage("bad commit object");
+			if (parent->generation < min_generation)
+				continue;
+			if (nr == alloc) {
+				alloc = alloc_nr(alloc);
+				stack = realloc(stack, alloc * sizeof(*stack));
+			}
+			stack[nr++] = parent;
+		}
+	}
+	free(stack);
+	/* 清除 REACHED 标记, 下一次调用时重新遍历 */
+	two->flags &= ~REACHED;
+	while (reached_nr)
+		reached[--reached_nr]->flags &= ~REACHED;
+	return found;
+}
+
+static struct commit_list *merge_bases(struct commit *one, struct commit *two)
+{
+	struct commit_queue queue = { NULL, 0, 0, 0, 1 };
+	struct commit_list *result = NULL, **tail = &result;
+	struct commit *commit;
+
+	if (one == two) {
+		result = malloc(sizeof(*result));
+		result->item = one;
+		result->next = NULL;
+		return result;
+	}
+	one->flags |= PARENT1;
+	two->flags |= PARENT2;
+	commit_queue_put(&queue, one);
+	commit_queue_put(&queue, two);
+	while (queue_has_nonstale(&queue)) {
+		struct commit_list *parents;
+		int flags;
+
+		commit = commit_queue_get(&queue);
+		flags = commit->flags & (PARENT1 | PARENT2 | STALE);
+		if (flags == (PARENT1 | PARENT2)) {
+			if (!(commit->flags & RESULT)) {
+				struct commit_list *list = malloc(sizeof(*list));
+				commit->flags |= RESULT;
+				list->item = commit;
+				list->next = NULL;
+				*tail = list;
+				tail = &list->next;
+			}
+			flags |= STALE;
+		}
+		for (parents = commit->parents; parents; parents = parents->next) {
+			struct commit *parent = parents->item;
+
+			if ((parent->flags & flags) == flags)
+				continue;
+			if (parse_commit(parent) < 0)
+				usage("bad commit object");
+			parent->flags |= flags;
+			commit_queue_put(&queue, parent);
+		}
+	}
+	free(queue.array);
+	return result;
+}
+
+/*
+ * 命令: "merge-base [--all] <commit> <commit>" 或者 "merge-base --is-ancestor <commit> <commit>"
+ * 示例: $ ./merge-base c82df15b2137ec4a6b7927ce6a3141c5abc20015 aa7e7c564b6c9be7544f022cd0915ea3fc517050
+ */
+int main(int argc, char **argv)
+{
+	struct commit_list *result, *list;
+	struct commit *one, *two;
+	int all = 0;
+
+	if (argc == 4 && !strcmp(argv[1], "--is-ancestor")) {
+		one = get_commit(argv[2]);
+		two = get_commit(argv[3]);
+		return is_ancestor(one, two) ? 0 : 1;
+	}
+	if (argc == 4 && !strcmp(argv[1], "--all")) {
+		all = 1;
+		argv++;
+		argc--;
+	}
+	if (argc != 3)
+		usage("merge-base [--all] <commit> <commit> | --is-ancestor <commit> <commit>");
+	one = get_commit(argv[1]);
+	two = get_commit(argv[2]);
+	result = merge_bases(one, two);
+	if (!result)
+		return 1;
+	/* 去掉是其他结果祖先的 commit (criss-cross 合并时会有多个共同祖先) */
+	for (list = result; list; list = list->next) {
+		struct commit_list *other;
+		for (other = result; other; other = other->next)
+			if (other != list && !(other->item->flags & STALE) &&
+			    is_ancestor(list->item, other->item))
+				break;
+		if (other)
+			list->item->flags |= STALE;
+	}
+	for (list = result; list; list = list->next) {
+		if (list->item->flags & STALE)
+			continue;
+		printf("%s\n", sha1_to_hex(list->item->sha1));
+		if (!all)
+			break;
+	}
+	arena_release();
+	return 0;
+}
+
+/* #
+ * # merge-base 使用示例
+ * #
+ *
+ * # 1. 第三次和第四次提交都是在第二次提交的基础上提交的(参考 commit-graph 示例)
+ * git-e83c5163$ ./merge-base c82df15b2137ec4a6b7927ce6a3141c5abc20015 aa7e7c564b6c9be7544f022cd0915ea3fc517050
+ * ea2bc8ba7c383a53df835946a8da7bcbcc0916a6
+ *
+ * # 2. 第一次提交是第四次提交的祖先, 第三次提交则不是(通过返回值判断)
+ * git-e83c5163$ ./merge-base --is-ancestor fc4d6681a2878fa9eecadb7efe96d96d8580928c aa7e7c564b6c9be7544f022cd0915ea3fc517050; echo $?
+ * 0
+ * git-e83c5163$ ./merge-base --is-ancestor c82df15b2137ec4a6b7927ce6a3141c5abc20015 aa7e7c564b6c9be7544f022cd0915ea3fc517050; echo $?
+ * 1
+ */
\ No newline at end of file
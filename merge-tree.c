@@ -0,0 +1,672 @@
+#include "cache.h"
+
+/*
+ * 三路合并 tree 对象, 结果写入暂存区和新的 tree 对象, 不访问工作区
+ *
+ * 同时顺序遍历 base, ours, theirs 三个 tree, 对每一个名字:
+ *   ours 和 theirs 相同 -> 取 ours
+ *   ours 没有修改(和 base 相同) -> 取 theirs
+ *   theirs 没有修改 -> 取 ours
+ * 只比较 mode 和 sha1, 子目录满足上面的条件时整个子目录直接使用, 不需要再往下比较.
+ * 两边都修改过的子目录递归合并, 两边都修改过的文件才需要读取 blob, 按行做三路合并(diff3),
+ * 所以合并的开销只和两边都修改过的路径数目有关.
+ * 无法自动合并的文件写入带有冲突标记的内容(或者保留 ours 的版本), 最后返回 1.
+ * 合并后同名的文件和目录同时存在时也是冲突, 只保留 ours 的一边.
+ */
+#define ORIG_OFFSET (40)	/* Enough space to add the header of "tree <size>\0" */
+
+static struct cache_entry **new_cache;
+static int new_nr, new_alloc;
+static int conflicts;
+
+static void add_new_entry(unsigned int mode, const char *base, int baselen, const char *path, int pathlen, const unsigned char *sha1)
+{
+	int namelen = baselen + pathlen;
+	int size = cache_entry_size(namelen);
+	struct cache_entry *ce = arena_alloc(size);
+
+	memset(ce, 0, size);
+	ce->st_mode = mode;
+	memcpy(ce->sha1, sha1, 20);
+	ce->namelen = namelen;
+	memcpy(ce->name, base, baselen);
+	memcpy(ce->name + baselen, path, pathlen);
+	if (new_nr == new_alloc) {
+		new_alloc = alloc_nr(new_alloc);
+		new_cache = realloc(new_cache, new_alloc * sizeof(struct cache_entry *));
+	}
+	new_cache[new_nr++] = ce;
+}
+
+static void *read_object(const unsigned char *sha1, const char *expected, unsigned long *size)
+{
+	char type[20];
+	void *buf = read_sha1_file((unsigned char *)sha1, type, size);
+
+	if (!buf || strcmp(type, expected)) {
+		fprintf(stderr, "unable to read %s %s\n", expected, sha1_to_hex((unsigned char *)sha1));
+		exit(1);
+	}
+	return buf;
+}
+
+/* 在 base (长度为 baselen, 包括结尾的 '/') 下拼出子目录的路径前缀 */
+static char *make_base(const char *base, int baselen, const char *path, int pathlen)
+{
+	char *newbase = malloc(baselen + pathlen + 2);
+
+	memcpy(newbase, base, baselen);
+	memcpy(newbase + baselen, path, pathlen);
+	newbase[baselen + pathlen] = '/';
+	newbase[baselen + pathlen + 1] = 0;
+	return newbase;
+}
+
+/* 整个子目录直接使用: 展开其中的所有文件加入暂存区, 返回文件数 */
+static int expand_tree(const unsigned char *sha1, const char *base, int baselen)
+{
+	struct tree_desc desc;
+	struct name_entry entry;
+	unsigned long size;
+	void *buf = read_object(sha1, "tree", &size);
+	int ret, entries = 0;
+
+	init_tree_desc(&desc, buf, size);
+	while ((ret = tree_entry(&desc, &entry)) > 0) {
+		if (S_ISDIR(entry.mode)) {
+			char *newbase = make_base(base, baselen, entry.path, entry.pathlen);
+			entries += expand_tree(entry.sha1, newbase, baselen + entry.pathlen + 1);
+			free(newbase);
+			continue;
+		}
+		add_new_entry(entry.mode, base, baselen, entry.path, entry.pathlen, entry.sha1);
+		entries++;
+	}
+	if (ret < 0)
+		usage("corrupt 'tree' file");
+	cache_tree_update(base, baselen ? baselen - 1 : 0, entries, (unsigned char *)sha1);
+	free(buf);
+	return entries;
+}
+
+/*
+ * 按行三路合并
+ *
+ * 分别用 Myers 算法求出 base->ours 和 base->theirs 的最长公共子序列,
+ * 记录 base 中每一行在 ours/theirs 中对应的行号(没有对应为 -1).
+ * 三边都对应上的行是稳定的, 两个稳定区之间的部分只有一边修改过时取修改的一边,
+ * 两边改得一样时取任意一边, 否则就是冲突.
+ */
+struct line {
+	const char *p;
+	int len;
+	unsigned int hash;
+};
+
+/* 编辑距离超过 MAX_D 时不再继续计算, 中间部分全部当作修改过 */
+#define MAX_D 2048
+
+static int split_lines(const char *buf, unsigned long size, struct line **linesp)
+{
+	const char *end = buf + size;
+	struct line *lines;
+	int nr = 0, alloc = 0;
+
+	lines = NULL;
+	while (buf < end) {
+		const char *eol = memchr(buf, '\n', end - buf);
+		const char *p;
+		unsigned int hash = 5381;
+
+		eol = eol ? eol + 1 : end;
+		for (p = buf; p < eol; p++)
+			hash = hash * 33 + (unsigned char)*p;
+		if (nr == alloc) {
+			alloc = alloc_nr(alloc);
+			lines = realloc(lines, alloc * sizeof(struct line));
+		}
+		lines[nr].p = buf;
+		lines[nr].len = eol - buf;
+		lines[nr].hash = hash;
+		nr++;
+		buf = eol;
+	}
+	*linesp = lines;
+	return nr;
+}
+
+static int line_equal(struct line *a, struct line *b)
+{
+	return a->hash == b->hash && a->len == b->len && !memcmp(a->p, b->p, a->len);
+}
+
+/* 求 a 到 b 的最长公共子序列, match[i] 为 a[i] 在 b 中对应的行号 */
+static void myers_match(struct line *a, int na, struct line *b, int nb, int *match)
+{
+	int i, prefix = 0, suffix = 0, n, m, d, k, max, found = -1;
+	int *v, *trace;
+
+	for (i = 0; i < na; i++)
+		match[i] = -1;
+	/* 先去掉相同的开头和结尾 */
+	while (prefix < na && prefix < nb && line_equal(a + prefix, b + prefix)) {
+		match[prefix] = prefix;
+		prefix++;
+	}
+	while (suffix < na - prefix && suffix < nb - prefix &&
+	       line_equal(a + na - 1 - suffix, b + nb - 1 - suffix)) {
+		match[na - 1 - suffix] = nb - 1 - suffix;
+		suffix++;
+	}
+	a += prefix;
+	b += prefix;
+	n = na - prefix - suffix;
+	m = nb - prefix - suffix;
+	if (!n || !m)
+		return;
+
+	max = n + m < MAX_D ? n + m : MAX_D;
+	/* v[k] 为第 k 条对角线上走得最远的 x, trace 中依次保存每一步 d 的 v[-d..d], 共 (d+1)^2 个 */
+	v = calloc(2 * max + 3, sizeof(int));
+	v += max + 1;
+	trace = malloc((unsigned long)(max + 1) * (max + 1) * sizeof(int));
+	for (d = 0; d <= max && found < 0; d++) {
+		for (k = -d; k <= d; k += 2) {
+			int x, y;
+
+			if (k == -d || (k != d && v[k - 1] < v[k + 1]))
+				x = v[k + 1];
+			else
+				x = v[k - 1] + 1;
+			y = x - k;
+			while (x < n && y < m && line_equal(a + x, b + y)) {
+				x++;
+				y++;
+			}
+			v[k] = x;
+			if (x >= n && y >= m)
+				found = d;
+		}
+		memcpy(trace + d * d, v - d, (2 * d + 1) * sizeof(int));
+	}
+
+	/* 从终点往回找出每一步之前的对角线(snake) */
+	if (found >= 0) {
+		int x = n, y = m;
+
+		for (d = found; d > 0; d--) {
+			int *prev = trace + (d - 1) * (d - 1) + (d - 1);
+			int prevk, prevx, prevy;
+
+			k = x - y;
+			if (k == -d || (k != d && prev[k - 1] < prev[k + 1]))
+				prevk = k + 1;
+			else
+				prevk = k - 1;
+			prevx = prev[prevk];
+			prevy = prevx - prevk;
+			while (x > prevx && y > prevy) {
+				x--;
+				y--;
+				match[prefix + x] = prefix + y;
+			}
+			x = prevx;
+			y = prevy;
+		}
+		while (x > 0 && y > 0) {
+			x--;
+			y--;
+			match[prefix + x] = prefix + y;
+		}
+	}
+	free(v - max - 1);
+	free(trace);
+}
+
+struct merge_buffer {
+	char *buf;
+	unsigned long size, alloc;
+};
+
+static void merge_add(struct merge_buffer *out, const char *p, unsigned long len)
+{
+	if (out->size + len > out->alloc) {
+		out->alloc = alloc_nr(out->size + len);
+		out->buf = realloc(out->buf, out->alloc);
+	}
+	memcpy(out->buf + out->size, p, len);
+	out->size += len;
+}
+
+static void merge_add_lines(struct merge_buffer *out, struct line *lines, int from, int to)
+{
+	for (; from < to; from++)
+		merge_add(out, lines[from].p, lines[from].len);
+}
+
+/* 冲突标记总是从新的一行开始 */
+static void merge_add_marker(struct merge_buffer *out, const char *marker)
+{
+	if (out->size && out->buf[out->size - 1] != '\n')
+		merge_add(out, "\n", 1);
+	merge_add(out, marker, strlen(marker));
+}
+
+static int same_lines(struct line *a, int afrom, int ato, struct line *b, int bfrom, int bto)
+{
+	if (ato - afrom != bto - bfrom)
+		return 0;
+	for (; afrom < ato; afrom++, bfrom++)
+		if (!line_equal(a + afrom, b + bfrom))
+			return 0;
+	return 1;
+}
+
+/* 合并结果存放在 out 中, 返回冲突的数目 */
+static int merge_lines(struct line *base, int nb, struct line *ours, int no, struct line *theirs, int nt,
+		       struct merge_buffer *out)
+{
+	int *mo = malloc((nb + 1) * sizeof(int)), *mt = malloc((nb + 1) * sizeof(int));
+	int i = 0, o = 0, t = 0, nr_conflicts = 0;
+
+	myers_match(base, nb, ours, no, mo);
+	myers_match(base, nb, theirs, nt, mt);
+	for (;;) {
+		int j, oend, tend;
+
+		/* 稳定区: 三边对应的行 */
+		while (i < nb && mo[i] == o && mt[i] == t) {
+			merge_add(out, base[i].p, base[i].len);
+			i++;
+			o++;
+			t++;
+		}
+		if (i >= nb && o >= no && t >= nt)
+			break;
+		/* 找到下一个稳定的行, 中间是不稳定区 */
+		for (j = i; j < nb && (mo[j] < 0 || mt[j] < 0); j++)
+			;
+		oend = j < nb ? mo[j] : no;
+		tend = j < nb ? mt[j] : nt;
+		if (same_lines(base, i, j, ours, o, oend))
+			merge_add_lines(out, theirs, t, tend);
+		else if (same_lines(base, i, j, theirs, t, tend) || same_lines(ours, o, oend, theirs, t, tend))
+			merge_add_lines(out, ours, o, oend);
+		else {
+			merge_add_marker(out, "<<<<<<< ours\n");
+			merge_add_lines(out, ours, o, oend);
+			merge_add_marker(out, "=======\n");
+			merge_add_lines(out, theirs, t, tend);
+			merge_add_marker(out, ">>>>>>> theirs\n");
+			nr_conflicts++;
+		}
+		i = j;
+		o = oend;
+		t = tend;
+	}
+	free(mo);
+	free(mt);
+	return nr_conflicts;
+}
+
+/* 将 buf 写入 blob 对象 */
+static void write_blob(const char *buf, unsigned long size, unsigned char *sha1)
+{
+	char *obj = malloc(size + 32);
+	int hdrlen = sprintf(obj, "blob %lu", size) + 1;
+
+	memcpy(obj + hdrlen, buf, size);
+	if (write_sha1_file(obj, size + hdrlen, sha1) < 0)
+		usage("unable to write blob object");
+	free(obj);
+}
+
+/* 两边都修改过的文件: 按行合并, 结果写入新的 blob, 有冲突时返回 1 */
+static int merge_file(struct name_entry *b, struct name_entry *o, struct name_entry *t, unsigned char *sha1)
+{
+	unsigned long bsize = 0, osize, tsize;
+	char *bbuf = b ? read_object(b->sha1, "blob", &bsize) : NULL;
+	char *obuf = read_object(o->sha1, "blob", &osize);
+	char *tbuf = read_object(t->sha1, "blob", &tsize);
+	struct line *blines = NULL, *olines, *tlines;
+	struct merge_buffer out = { NULL, 0, 0 };
+	int nb, no, nt, ret = 1;
+
+	/* 二进制文件不做合并, 保留 ours 的版本 */
+	if (memchr(obuf, 0, osize < 8000 ? osize : 8000) || memchr(tbuf, 0, tsize < 8000 ? tsize : 8000) ||
+	    (bbuf && memchr(bbuf, 0, bsize < 8000 ? bsize : 8000))) {
+		memcpy(sha1, o->sha1, 20);
+		goto out;
+	}
+	nb = split_lines(bbuf, bsize, &blines);
+	no = split_lines(obuf, osize, &olines);
+	nt = split_lines(tbuf, tsize, &tlines);
+	ret = merge_lines(blines, nb, olines, no, tlines, nt, &out) ? 1 : 0;
+	write_blob(out.buf, out.size, sha1);
+	free(blines);
+	free(olines);
+	free(tlines);
+	free(out.buf);
+out:
+	free(bbuf);
+	free(obuf);
+	free(tbuf);
+	return ret;
+}
+
+/* 三路遍历时每个 tree 的当前记录 */
+struct merge_side {
+	struct tree_desc desc;
+	struct name_entry entry;
+	int valid;
+	void *buf;
+};
+
+static void side_next(struct merge_side *side)
+{
+	int ret = tree_entry(&side->desc, &side->entry);
+
+	if (ret < 0)
+		usage("corrupt 'tree' file");
+	side->valid = ret;
+}
+
+static void side_init(struct merge_side *side, const unsigned char *sha1)
+{
+	unsigned long size = 0;
+
+	side->buf = sha1 ? read_object(sha1, "tree", &size) : NULL;
+	init_tree_desc(&side->desc, side->buf, size);
+	side_next(side);
+}
+
+static int same_entry(struct name_entry *a, struct name_entry *b)
+{
+	if (!a || !b)
+		return a == b;
+	return a->mode == b->mode && !memcmp(a->sha1, b->sha1, 20);
+}
+
+static void tree_add(char **buffer, unsigned long *offset, unsigned long *size,
+		     unsigned int mode, const char *path, int pathlen, const unsigned char *sha1)
+{
+	if (*offset + pathlen + 60 > *size) {
+		*size = alloc_nr(*offset + pathlen + 60);
+		*buffer = realloc(*buffer, *size);
+	}
+	*offset += sprintf(*buffer + *offset, "%o %.*s", mode, pathlen, path);
+	(*buffer)[(*offset)++] = 0;
+	memcpy(*buffer + *offset, sha1, 20);
+	*offset += 20;
+}
+
+static void report_conflict(const char *what, const char *base, int baselen, const char *path, int pathlen)
+{
+	printf("conflict (%s): %.*s%.*s\n", what, baselen, base, pathlen, path);
+	conflicts++;
+}
+
+/*
+ * 当前 tree 中已经写出的文件: 在 tree 数据中的位置和长度, 在 new_cache 中的位置
+ * tree 的顺序中文件 "a" 和目录 "a/" 之间还可能有 "a.c" 之类的名字, 所以要记录所有的文件
+ */
+struct emitted_file {
+	const char *path;
+	int pathlen;
+	unsigned long offset, len;
+	int pos;
+};
+
+/* 查找同名的文件, 只需要从后往前检查以 path 开头的文件 */
+static int find_emitted(struct emitted_file *files, int nr, const char *path, int pathlen)
+{
+	while (--nr >= 0) {
+		if (files[nr].pathlen < pathlen || memcmp(files[nr].path, path, pathlen))
+			break;
+		if (files[nr].pathlen == pathlen)
+			return nr;
+	}
+	return -1;
+}
+
+/* 从 tree 数据和暂存区中去掉已经写出的文件 files[k] */
+static void drop_emitted(struct emitted_file *files, int nr, int k, char *buffer, unsigned long *offset)
+{
+	struct emitted_file *f = files + k;
+	int i;
+
+	memmove(buffer + f->offset, buffer + f->offset + f->len, *offset - f->offset - f->len);
+	*offset -= f->len;
+	memmove(new_cache + f->pos, new_cache + f->pos + 1, (new_nr - f->pos - 1) * sizeof(struct cache_entry *));
+	new_nr--;
+	for (i = k + 1; i < nr; i++) {
+		files[i].offset -= f->len;
+		files[i].pos--;
+	}
+	memmove(files + k, files + k + 1, (nr - k - 1) * sizeof(struct emitted_file));
+}
+
+/*
+ * 合并 base 目录(长度为 baselen, 包括结尾的 '/')下的三个 tree (不存在的为 NULL),
+ * 合并后的文件加入暂存区, 合并后的 tree 写入 returnsha1, 返回文件数(0 表示目录为空)
+ */
+static int merge_trees(const unsigned char *bsha1, const unsigned char *osha1, const unsigned char *tsha1,
+		       const char *base, int baselen, unsigned char *returnsha1)
+{
+	struct merge_side side[3];
+	unsigned long size = 4096, offset = ORIG_OFFSET;
+	char *buffer = malloc(size);
+	struct emitted_file *files = NULL;
+	int files_nr = 0, files_alloc = 0, entries = 0, i;
+
+	side_init(side + 0, bsha1);
+	side_init(side + 1, osha1);
+	side_init(side + 2, tsha1);
+	while (side[0].valid || side[1].valid || side[2].valid) {
+		struct name_entry *e[3], *first = NULL, *result;
+		unsigned char sha1[20];
+		unsigned int mode;
+		int trivial, isdir, clash;
+
+		/* 三个 tree 中排在最前面的名字 */
+		for (i = 0; i < 3; i++)
+			if (side[i].valid && (!first ||
+			    tree_name_compare(side[i].entry.path, side[i].entry.pathlen, side[i].entry.mode,
+					      first->path, first->pathlen, first->mode) < 0))
+				first = &side[i].entry;
+		for (i = 0; i < 3; i++)
+			e[i] = side[i].valid && !tree_name_compare(side[i].entry.path, side[i].entry.pathlen,
+						side[i].entry.mode, first->path, first->pathlen, first->mode) ?
+				&side[i].entry : NULL;
+
+		trivial = 1;
+		if (same_entry(e[1], e[2]) || same_entry(e[0], e[2]))
+			result = e[1];
+		else if (same_entry(e[0], e[1]))
+			result = e[2];
+		else
+			trivial = 0;
+
+		/*
+		 * 合并后同名的文件和目录不能同时存在: 报告冲突, 保留 ours 的一边
+		 * ours 中是文件时不使用这个目录, 否则目录写出以后去掉已经写出的文件
+		 */
+		if (trivial)
+			isdir = result && S_ISDIR(result->mode);
+		else
+			isdir = S_ISDIR((e[1] ? e[1] : e[2])->mode);
+		clash = isdir ? find_emitted(files, files_nr, first->path, first->pathlen) : -1;
+		if (clash >= 0 && !e[1]) {
+			report_conflict("directory/file", base, baselen, first->path, first->pathlen);
+			goto next;
+		}
+
+		if (trivial) {
+			/* 简单的情况: 只比较 sha1 就可以确定结果, 结果为 NULL 表示已经删除 */
+			if (!result)
+				goto next;
+			mode = result->mode;
+			memcpy(sha1, result->sha1, 20);
+			if (S_ISDIR(mode)) {
+				char *newbase = make_base(base, baselen, result->path, result->pathlen);
+				entries += expand_tree(sha1, newbase, baselen + result->pathlen + 1);
+				free(newbase);
+			} else {
+				add_new_entry(mode, base, baselen, result->path, result->pathlen, sha1);
+				entries++;
+			}
+		} else if (e[1] && e[2] && S_ISDIR(e[1]->mode) && S_ISDIR(e[2]->mode)) {
+			/* 两边都修改过的子目录, 递归合并 */
+			char *newbase = make_base(base, baselen, e[1]->path, e[1]->pathlen);
+			int n = merge_trees(e[0] && S_ISDIR(e[0]->mode) ? e[0]->sha1 : NULL, e[1]->sha1, e[2]->sha1,
+					    newbase, baselen + e[1]->pathlen + 1, sha1);
+			free(newbase);
+			if (!n)
+				goto next;
+			entries += n;
+			mode = S_IFDIR;
+		} else if (e[1] && e[2] && S_ISREG(e[1]->mode) && S_ISREG(e[2]->mode) && (!e[0] || S_ISREG(e[0]->mode))) {
+			/* 两边都修改过的文件, 按行合并; mode 按照同样的规则合并 */
+			if (merge_file(e[0], e[1], e[2], sha1))
+				report_conflict("content", base, baselen, e[1]->path, e[1]->pathlen);
+			mode = e[1]->mode;
+			if (e[0] && e[0]->mode == e[1]->mode)
+				mode = e[2]->mode;
+			add_new_entry(mode, base, baselen, e[1]->path, e[1]->pathlen, sha1);
+			entries++;
+		} else {
+			/* 一边删除一边修改, 或者类型改变: 保留 ours (ours 删除时保留 theirs) */
+			result = e[1] ? e[1] : e[2];
+			report_conflict(e[1] && e[2] ? "type" : "modify/delete", base, baselen, result->path, result->pathlen);
+			mode = result->mode;
+			memcpy(sha1, result->sha1, 20);
+			if (S_ISDIR(mode)) {
+				char *newbase = make_base(base, baselen, result->path, result->pathlen);
+				entries += expand_tree(sha1, newbase, baselen + result->pathlen + 1);
+				free(newbase);
+			} else {
+				add_new_entry(mode, base, baselen, result->path, result->pathlen, sha1);
+				entries++;
+			}
+		}
+
+		first = e[1] ? e[1] : e[2] ? e[2] : e[0];
+		if (S_ISDIR(mode) && clash >= 0) {
+			report_conflict("directory/file", base, baselen, first->path, first->pathlen);
+			drop_emitted(files, files_nr--, clash, buffer, &offset);
+			entries--;
+		}
+		if (!S_ISDIR(mode)) {
+			if (files_nr == files_alloc) {
+				files_alloc = alloc_nr(files_alloc);
+				files = realloc(files, files_alloc * sizeof(struct emitted_file));
+			}
+			files[files_nr].path = first->path;
+			files[files_nr].pathlen = first->pathlen;
+			files[files_nr].offset = offset;
+			files[files_nr].pos = new_nr - 1;
+		}
+		tree_add(&buffer, &offset, &size, mode, first->path, first->pathlen, sha1);
+		if (!S_ISDIR(mode)) {
+			files[files_nr].len = offset - files[files_nr].offset;
+			files_nr++;
+		}
+next:
+		for (i = 0; i < 3; i++)
+			if (e[i])
+				side_next(side + i);
+	}
+
+	if (entries) {
+		int hdrlen = sprintf(buffer, "tree %lu", offset - ORIG_OFFSET) + 1;
+		/* 把 "tree <size>\0" 移到数据前面 */
+		memmove(buffer + ORIG_OFFSET - hdrlen, buffer, hdrlen);
+		if (write_sha1_file(buffer + ORIG_OFFSET - hdrlen, offset - ORIG_OFFSET + hdrlen, returnsha1) < 0)
+			usage("unable to write tree object");
+		cache_tree_update(base, baselen ? baselen - 1 : 0, entries, returnsha1);
+	}
+	for (i = 0; i < 3; i++)
+		free(side[i].buf);
+	free(buffer);
+	free(files);
+	return entries;
+}
+
+/*
+ * 命令: "merge-tree <base-tree> <our-tree> <their-tree>"
+ * 示例: $ ./merge-tree 63a90d7208bd2c9ddad96d1bbb6b15951c80b97d 4115f4d67a301d1187050b3f6f0ae24f14891cbb cee625afb9d062f12bfbf070364bc4684a317be0
+ */
+int main(int argc, char **argv)
+{
+	unsigned char sha1[3][20], result[20];
+	int i, newfd;
+
+	if (argc != 4)
+		usage("merge-tree <base-tree> <our-tree> <their-tree>");
+	for (i = 0; i < 3; i++)
+		if (get_sha1_hex(argv[i + 1], sha1[i]))
+			usage("merge-tree <base-tree> <our-tree> <their-tree>");
+
+	/* 读取对象出错时直接退出, 所以先在内存中完成合并, 只在写入结果时才创建 index.lock */
+	if (!merge_trees(sha1[0], sha1[1], sha1[2], "", 0, result)) {
+		/* 合并结果为空 */
+		static char empty[] = "tree 0";
+		write_sha1_file(empty, sizeof(empty), result);
+	}
+	newfd = open(".dircache/index.lock", O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (newfd < 0) {
+		perror("unable to create new cachefile");
+		return 1;
+	}
+	if (write_cache(newfd, new_cache, new_nr) || rename(".dircache/index.lock", ".dircache/index")) {
+		unlink(".dircache/index.lock");
+		usage("unable to write new index file");
+	}
+	printf("%s\n", sha1_to_hex(result));
+	arena_release();
+	return conflicts ? 1 : 0;
+}
+
+/* #
+ * # merge-tree 使用示例
+ * #
+ *
+ * # 1. base: a.txt (1~10 共 10 行), b.txt (1~5 共 5 行), sub/s, deep/x/d, gone.txt, keep.txt
+ * git-e83c5163$ ./write-tree
+ * 63a90d7208bd2c9ddad96d1bbb6b15951c80b97d
+ *
+ * # 2. ours: 修改 a.txt 第 2 行, b.txt 第 3 行和 sub/s, 删除 gone.txt, 新增 new-ours
+ * git-e83c5163$ ./write-tree
+ * 4115f4d67a301d1187050b3f6f0ae24f14891cbb
+ *
+ * # 3. theirs: 在 base 的基础上修改 a.txt 第 8 行, b.txt 第 3 行和 deep/x/d
+ * git-e83c5163$ ./write-tree
+ * cee625afb9d062f12bfbf070364bc4684a317be0
+ *
+ * # 4. 三路合并, 只有 b.txt 需要按行合并(两边都修改了第 3 行, 有冲突), 其他文件和目录只比较 sha1
+ * git-e83c5163$ ./merge-tree 63a90d7208bd2c9ddad96d1bbb6b15951c80b97d 4115f4d67a301d1187050b3f6f0ae24f14891cbb cee625afb9d062f12bfbf070364bc4684a317be0
+ * conflict (content): b.txt
+ * d6466dff6bb58c1adbdc31b4d0ed6a4dab17c642
+ * git-e83c5163$ ./read-tree d6466dff6bb58c1adbdc31b4d0ed6a4dab17c642
+ * 100644 a.txt (985bce84142efb588a8947b1164393b488f30026)
+ * 100644 b.txt (60e689c9f061ca38928669344961bfc580820539)
+ * 100644 deep/x/d (975dacff2844df3145f7aabae22eae2b5a60c5f7)
+ * 100644 keep.txt (03c56192823fa22c073e68f40c6b40b5d46f575e)
+ * 100644 new-ours (2e67ee6aa87dbe3262e73b2c2ebbc939d7c8209f)
+ * 100644 sub/s (1172356ef303462ce3bb681d85cd07b5314e1f54)
+ *
+ * # 5. 暂存区已经是合并的结果, 检出到工作区查看合并后的文件
+ * git-e83c5163$ ./read-tree -u d6466dff6bb58c1adbdc31b4d0ed6a4dab17c642
+ * git-e83c5163$ cat a.txt | tr '\n' ' '
+ * 1 two 3 4 5 6 7 eight 9 10
+ * git-e83c5163$ cat b.txt
+ * 1
+ * 2
+ * <<<<<<< ours
+ * three-ours
+ * =======
+ * three-theirs
+ * >>>>>>> theirs
+ * 4
+ * 5
+ */
\ No newline at end of file
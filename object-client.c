@@ -0,0 +1,149 @@
+#include "cache.h"
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ * 对象服务器(object-server)的客户端, 编译在 libdircache.a 中
+ *
+ * 每个函数发送一个请求并等待回复, 出错时返回 DIRCACHE_ERR_* 错误码;
+ * 连接断开或者收到不完整的回复时返回 DIRCACHE_ERR_IO, 这个连接就不能再用了.
+ * 一个连接同一时间只能由一个线程使用, 多个线程各自建立连接.
+ */
+int read_in_full(int fd, void *buf, unsigned long len)
+{
+	char *p = buf;
+
+	while (len) {
+		ssize_t ret = read(fd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+int write_in_full(int fd, const void *buf, unsigned long len)
+{
+	const char *p = buf;
+
+	while (len) {
+		ssize_t ret = write(fd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+int object_client_connect(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (!path)
+		path = getenv(SERVER_ENVIRONMENT) ? : DEFAULT_SERVER_SOCKET;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return DIRCACHE_ERR_IO;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return DIRCACHE_ERR_IO;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return DIRCACHE_ERR_IO;
+	}
+	return fd;
+}
+
+/* 发送请求 req (后面跟着 len 字节的 data), 读取回复的头部到 res */
+static int request(int fd, struct object_message *req, const void *data, unsigned long len, struct object_message *res)
+{
+	if (write_in_full(fd, req, sizeof(*req)) < 0 ||
+	    write_in_full(fd, data, len) < 0 ||
+	    read_in_full(fd, res, sizeof(*res)) < 0)
+		return DIRCACHE_ERR_IO;
+	return res->code;
+}
+
+/* 读取回复中 size 字节的数据到 out, 后面加上 '\0' */
+static int read_payload(int fd, struct object_message *res, struct dircache_buffer *out)
+{
+	if (res->size > OBJECT_MESSAGE_MAX)
+		return DIRCACHE_ERR_IO;
+	if (dircache_buffer_grow(out, (unsigned long)res->size + 1) < 0)
+		return DIRCACHE_ERR_NOMEM;
+	if (read_in_full(fd, out->buf, res->size) < 0)
+		return DIRCACHE_ERR_IO;
+	((char *)out->buf)[res->size] = 0;
+	out->len = res->size;
+	return 0;
+}
+
+int object_client_read(int fd, const unsigned char *sha1, char *type, struct dircache_buffer *out)
+{
+	struct object_message req, res;
+	int ret;
+
+	memset(&req, 0, sizeof(req));
+	req.code = OBJECT_READ;
+	memcpy(req.sha1, sha1, 20);
+	ret = request(fd, &req, NULL, 0, &res);
+	if (ret < 0)
+		return ret;
+	res.type[sizeof(res.type) - 1] = 0;
+	strcpy(type, res.type);
+	return read_payload(fd, &res, out);
+}
+
+int object_client_exists(int fd, const unsigned char *sha1)
+{
+	struct object_message req, res;
+
+	memset(&req, 0, sizeof(req));
+	req.code = OBJECT_EXISTS;
+	memcpy(req.sha1, sha1, 20);
+	return request(fd, &req, NULL, 0, &res);
+}
+
+int object_client_write(int fd, const char *type, const void *buf, unsigned long len, unsigned char *sha1)
+{
+	struct object_message req, res;
+	int ret;
+
+	if (strlen(type) >= sizeof(req.type) || len > OBJECT_MESSAGE_MAX)
+		return DIRCACHE_ERR_CORRUPT;
+	memset(&req, 0, sizeof(req));
+	req.code = OBJECT_WRITE;
+	req.size = len;
+	strcpy(req.type, type);
+	ret = request(fd, &req, buf, len, &res);
+	if (ret < 0)
+		return ret;
+	memcpy(sha1, res.sha1, 20);
+	return 0;
+}
+
+int object_client_stats(int fd, struct dircache_buffer *out)
+{
+	struct object_message req, res;
+	int ret;
+
+	memset(&req, 0, sizeof(req));
+	req.code = OBJECT_STATS;
+	ret = request(fd, &req, NULL, 0, &res);
+	if (ret < 0)
+		return ret;
+	return read_payload(fd, &res, out);
+}
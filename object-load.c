@@ -0,0 +1,170 @@
+#include "cache.h"
+
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+/*
+ * 对象服务器的压力测试: 启动若干个客户端线程, 每个线程建立一个连接,
+ * 从 stdin 给出的 sha1 列表中随机选取对象发送请求, 最后输出吞吐量和延迟分布,
+ * 以及服务器的统计信息(缓存命中次数等).
+ * --write 时不需要 sha1 列表, 每个请求写入一个新的小 blob 对象.
+ */
+#define MAX_CLIENTS 256
+
+static int mode = OBJECT_READ;
+static int nr_clients = 4, nr_requests = 10000, nr_errors;
+static const char *socket_path;
+
+static unsigned char (*sha1s)[20];
+static int nr_sha1s;
+
+/* 所有请求的延迟(微秒), 每个线程写入自己的那一段 */
+static unsigned long *latency;
+
+static unsigned long now_usec(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000ul + tv.tv_usec;
+}
+
+static void *client_thread(void *data)
+{
+	long id = (long)data;
+	int start = (long)nr_requests * id / nr_clients;
+	int end = (long)nr_requests * (id + 1) / nr_clients;
+	struct dircache_buffer buf = { NULL, 0, 0 };
+	unsigned int seed = id + 1;
+	int i, fd, errors = 0;
+
+	fd = object_client_connect(socket_path);
+	if (fd < 0) {
+		perror("object-load: connect");
+		__sync_fetch_and_add(&nr_errors, end - start);
+		return NULL;
+	}
+	for (i = start; i < end; i++) {
+		unsigned char *sha1 = nr_sha1s ? sha1s[rand_r(&seed) % nr_sha1s] : NULL;
+		unsigned long t = now_usec();
+		unsigned char result[20];
+		char type[20], text[64];
+		int ret;
+
+		switch (mode) {
+		case OBJECT_READ:
+			ret = object_client_read(fd, sha1, type, &buf);
+			break;
+		case OBJECT_EXISTS:
+			ret = object_client_exists(fd, sha1);
+			break;
+		default:
+			snprintf(text, sizeof(text), "object-load %d %lu\n", i, t);
+			ret = object_client_write(fd, "blob", text, strlen(text), result);
+			break;
+		}
+		latency[i] = now_usec() - t;
+		if (ret < 0)
+			errors++;
+	}
+	close(fd);
+	dircache_buffer_release(&buf);
+	__sync_fetch_and_add(&nr_errors, errors);
+	return NULL;
+}
+
+static int compare_ulong(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void read_sha1_list(void)
+{
+	char line[100];
+	int alloc = 0;
+
+	while (fgets(line, sizeof(line), stdin)) {
+		if (nr_sha1s == alloc) {
+			alloc = alloc_nr(alloc);
+			sha1s = realloc(sha1s, alloc * 20);
+		}
+		if (!get_sha1_hex(line, sha1s[nr_sha1s]))
+			nr_sha1s++;
+	}
+}
+
+/*
+ * 命令: "object-load [-c <clients>] [-n <requests>] [--exists | --write] [<socket>] < <sha1 列表>"
+ * 示例: $ ./object-load -c 8 -n 100000 < sha1-list
+ */
+int main(int argc, char **argv)
+{
+	pthread_t threads[MAX_CLIENTS];
+	struct dircache_buffer stats = { NULL, 0, 0 };
+	unsigned long start, usec;
+	long i;
+	int fd;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+			nr_clients = atoi(argv[++i]);
+			continue;
+		}
+		if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+			nr_requests = atoi(argv[++i]);
+			continue;
+		}
+		if (!strcmp(argv[i], "--exists")) {
+			mode = OBJECT_EXISTS;
+			continue;
+		}
+		if (!strcmp(argv[i], "--write")) {
+			mode = OBJECT_WRITE;
+			continue;
+		}
+		usage("object-load [-c <clients>] [-n <requests>] [--exists | --write] [<socket>] < <sha1 list>");
+	}
+	if (i < argc)
+		socket_path = argv[i];
+	if (nr_clients < 1 || nr_clients > MAX_CLIENTS || nr_requests < 1)
+		usage("object-load: bad number of clients or requests");
+	if (mode != OBJECT_WRITE) {
+		read_sha1_list();
+		if (!nr_sha1s)
+			usage("object-load: no sha1 on stdin");
+	}
+
+	latency = calloc(nr_requests, sizeof(unsigned long));
+	start = now_usec();
+	for (i = 0; i < nr_clients; i++)
+		pthread_create(&threads[i], NULL, client_thread, (void *)i);
+	for (i = 0; i < nr_clients; i++)
+		pthread_join(threads[i], NULL);
+	usec = now_usec() - start;
+
+	qsort(latency, nr_requests, sizeof(unsigned long), compare_ulong);
+	printf("%d requests from %d clients in %lu.%03lu s (%lu requests/s), %d errors\n",
+	       nr_requests, nr_clients, usec / 1000000, usec / 1000 % 1000,
+	       usec ? nr_requests * 1000000ul / usec : 0, nr_errors);
+	printf("latency: p50 %lu us, p99 %lu us, max %lu us\n",
+	       latency[nr_requests / 2], latency[nr_requests * 99ul / 100], latency[nr_requests - 1]);
+
+	fd = object_client_connect(socket_path);
+	if (fd >= 0 && !object_client_stats(fd, &stats))
+		printf("server: %s", (char *)stats.buf);
+	return nr_errors ? 1 : 0;
+}
+
+/* #
+ * # object-load 使用示例
+ * #
+ *
+ * # 1. 先启动 object-server, 然后查询 rev-list 列出的 commit 对象是否存在(参考 object-server 示例)
+ * git-e83c5163$ ./rev-list c82df15b2137ec4a6b7927ce6a3141c5abc20015 | ./object-load --exists -n 1000
+ * 1000 requests from 4 clients in 0.006 s (166666 requests/s), 0 errors
+ * latency: p50 16 us, p99 66 us, max 250 us
+ * server: 11 connections, 11002 requests, 9991 hits, 9 misses, 3 objects (619 bytes) cached
+ */
@@ -0,0 +1,407 @@
+#include "cache.h"
+
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+/*
+ * 删除不可达的对象
+ *
+ * 1. 读取 256 个目录, 每个目录的对象按 sha1 排序, 对象的位置(第几个对象)就是它在位图中的下标
+ * 2. 从根对象开始标记所有可达的对象, 每个对象只占位图中的 1 位:
+ *    - 命令行(或者 --stdin)给出的 commit/tree/blob
+ *    - 暂存区中所有的 blob, 以及暂存区中缓存的 tree 对象
+ *    暂存区不引用任何 commit, 所以必须给出至少一个根对象, 只用暂存区时要指定 --index-only
+ *    commit 用 parse_commit() 解析(在 commit-graph 中时不需要读取对象), tree 逐条标记,
+ *    blob 不需要读取. 可达的对象不存在或者损坏时不删除任何对象, 直接退出.
+ * 3. 没有标记的对象, 修改时间早于宽限期(默认 2 周)的才删除
+ *
+ * 和同时写入对象的进程之间的安全性依赖于宽限期:
+ *   - 第 1 步之后新写入的对象不在列表中, 不会被删除
+ *   - 宽限期内写入的对象(比如 update-cache 刚写入, 还没有 commit 的 blob)不会被删除
+ *   - 写入对象时发现对象已经存在, 会更新它的修改时间(dircache_freshen_object),
+ *     所以新的 tree/commit 重新引用的旧对象也不会被删除
+ * 删除之前会再检查一次修改时间. 宽限期设为 0 时只能在没有其他进程写入对象时使用.
+ *
+ * 只删除主对象目录中的对象, 备用对象目录(alternates)是只读的.
+ * 对象库本身不知道哪些工作区把它用作备用对象目录, 所以不要在共享的对象库中运行 prune-cache.
+ *
+ * 写入对象时中断留下的临时文件 tmp_XXXXXX 超过宽限期后也在第 3 步一起删除.
+ * 被删除的 commit 如果在 commit-graph 文件中, 需要重新运行 commit-graph.
+ */
+#define DEFAULT_GRACE (14 * 24 * 3600)
+
+#define TYPE_UNKNOWN	0
+#define TYPE_BLOB	1
+#define TYPE_TREE	2
+#define TYPE_COMMIT	3
+
+/* 每个目录的对象按 sha1 排序, start 为第一个对象在位图中的位置 */
+struct prune_dir {
+	unsigned char (*sha1s)[20];
+	int nr, alloc;
+	unsigned long start;
+};
+
+/* 待处理(已经标记但还没有读取)的 tree 和 commit */
+struct pending {
+	unsigned char sha1[20];
+	int type;
+};
+
+static struct dircache repo;
+static struct dircache_handle handle;
+static struct dircache_buffer buf;
+static struct prune_dir dirs[256];
+static unsigned char *reachable;
+static unsigned long nr_objects, nr_reachable, nr_roots;
+
+/* 第 1 步找到的临时文件, 第 3 步才删除 */
+static char **tmp_files;
+static int tmp_nr, tmp_alloc;
+
+static struct pending *pending;
+static unsigned long pending_nr, pending_alloc;
+
+static int dry_run, verbose, index_only;
+static time_t expire;
+
+static int compare_sha1(const void *a, const void *b)
+{
+	return memcmp(a, b, 20);
+}
+
+/* 删除超过宽限期的临时文件, 返回删除的个数 */
+static int remove_stale_tmp(const char *path)
+{
+	struct stat st;
+
+	if (lstat(path, &st) < 0 || st.st_mtime > expire)
+		return 0;
+	if (verbose || dry_run)
+		printf("%s\n", path);
+	if (!dry_run && unlink(path) < 0) {
+		perror(path);
+		return 0;
+	}
+	return 1;
+}
+
+/* 第 1 步: 读取目录 xx 中的对象, 记录临时文件 */
+static void scan_dir(int n)
+{
+	struct prune_dir *dir = dirs + n;
+	char path[PATH_MAX], hex[41];
+	struct dirent *de;
+	DIR *d;
+
+	snprintf(path, sizeof(path), "%s/%02x", repo.object_dir, n);
+	d = opendir(path);
+	if (!d) {
+		if (errno != ENOENT)
+			usage("prune-cache: unable to read object directory");
+		return;
+	}
+	sprintf(hex, "%02x", n);
+	while ((de = readdir(d)) != NULL) {
+		if (!strncmp(de->d_name, "tmp_", 4)) {
+			char tmp[PATH_MAX];
+
+			snprintf(tmp, sizeof(tmp), "%s/%s", path, de->d_name);
+			if (tmp_nr == tmp_alloc) {
+				tmp_alloc = alloc_nr(tmp_alloc);
+				tmp_files = realloc(tmp_files, tmp_alloc * sizeof(char *));
+			}
+			tmp_files[tmp_nr++] = strdup(tmp);
+			continue;
+		}
+		if (strlen(de->d_name) != 38)
+			continue;
+		memcpy(hex + 2, de->d_name, 39);
+		if (dir->nr == dir->alloc) {
+			dir->alloc = alloc_nr(dir->alloc);
+			dir->sha1s = realloc(dir->sha1s, dir->alloc * 20);
+		}
+		if (!get_sha1_hex(hex, dir->sha1s[dir->nr]))
+			dir->nr++;
+	}
+	closedir(d);
+	qsort(dir->sha1s, dir->nr, 20, compare_sha1);
+}
+
+/* 对象在位图中的位置, 不存在时返回 -1 */
+static long object_pos(const unsigned char *sha1)
+{
+	struct prune_dir *dir = dirs + sha1[0];
+	int first = 0, last = dir->nr;
+
+	while (first < last) {
+		int next = (first + last) / 2;
+		int cmp = memcmp(sha1, dir->sha1s[next], 20);
+
+		if (!cmp)
+			return dir->start + next;
+		if (cmp < 0)
+			last = next;
+		else
+			first = next + 1;
+	}
+	return -1;
+}
+
+static const char *type_name(int type)
+{
+	static const char *names[] = { "object", "blob", "tree", "commit" };
+
+	return names[type];
+}
+
+/* 标记一个可达的对象, 第一次标记的 tree/commit 放入待处理列表 */
+static void mark_object(const unsigned char *sha1, int type)
+{
+	long pos = object_pos(sha1);
+
+	/* 备用对象目录中的对象不会被删除, 它引用的对象也都在备用对象目录中, 不需要继续标记 */
+	if (pos < 0 && dircache_has_object(&repo, sha1))
+		return;
+	if (pos < 0) {
+		fprintf(stderr, "prune-cache: missing %s %s\n", type_name(type), sha1_to_hex((unsigned char *)sha1));
+		usage("prune-cache: reachable object is missing, nothing pruned");
+	}
+	if (reachable[pos >> 3] & (1 << (pos & 7)))
+		return;
+	reachable[pos >> 3] |= 1 << (pos & 7);
+	nr_reachable++;
+	if (type == TYPE_BLOB)
+		return;
+	if (pending_nr == pending_alloc) {
+		pending_alloc = alloc_nr(pending_alloc);
+		pending = realloc(pending, pending_alloc * sizeof(struct pending));
+	}
+	memcpy(pending[pending_nr].sha1, sha1, 20);
+	pending[pending_nr].type = type;
+	pending_nr++;
+}
+
+static void corrupt(const unsigned char *sha1)
+{
+	fprintf(stderr, "prune-cache: bad object %s\n", sha1_to_hex((unsigned char *)sha1));
+	usage("prune-cache: reachable object is corrupt, nothing pruned");
+}
+
+static void mark_tree_entries(const unsigned char *sha1)
+{
+	struct tree_desc desc;
+	struct name_entry entry;
+	char type[20];
+	int ret;
+
+	if (dircache_read_object(&handle, sha1, type, &buf) < 0 || strcmp(type, "tree"))
+		corrupt(sha1);
+	init_tree_desc(&desc, buf.buf, buf.len);
+	while ((ret = tree_entry(&desc, &entry)) > 0)
+		mark_object(entry.sha1, S_ISDIR(entry.mode) ? TYPE_TREE : TYPE_BLOB);
+	if (ret < 0)
+		corrupt(sha1);
+}
+
+static void mark_commit_refs(const unsigned char *sha1)
+{
+	struct commit *commit = lookup_commit(sha1);
+	struct commit_list *parent;
+
+	if (parse_commit(commit) < 0)
+		corrupt(sha1);
+	mark_object(commit->tree, TYPE_TREE);
+	for (parent = commit->parents; parent; parent = parent->next)
+		mark_object(parent->item->sha1, TYPE_COMMIT);
+}
+
+/* 第 2 步: 处理待处理列表, 直到所有可达的对象都已经标记 */
+static void mark_reachable(void)
+{
+	while (pending_nr) {
+		struct pending p = pending[--pending_nr];
+		char type[20];
+		unsigned long size;
+
+		/* 命令行给出的对象类型未知, 先读取头部 */
+		if (p.type == TYPE_UNKNOWN) {
+			if (dircache_read_header(&handle, p.sha1, type, &size) < 0)
+				corrupt(p.sha1);
+			if (!strcmp(type, "tree"))
+				p.type = TYPE_TREE;
+			else if (!strcmp(type, "commit"))
+				p.type = TYPE_COMMIT;
+			else
+				continue;
+		}
+		if (p.type == TYPE_TREE)
+			mark_tree_entries(p.sha1);
+		else
+			mark_commit_refs(p.sha1);
+	}
+}
+
+/* 暂存区中的 blob 和缓存的 tree 对象也是根对象 */
+static void mark_index(void)
+{
+	int i;
+
+	if (read_cache() < 0)
+		usage("prune-cache: unable to read index, nothing pruned");
+	for (i = 0; i < active_nr; i++)
+		mark_object(active_cache[i]->sha1, TYPE_BLOB);
+	for (i = 0; i < tree_nr; i++)
+		if (active_tree[i]->entries >= 0)
+			mark_object(active_tree[i]->sha1, TYPE_TREE);
+	mark_reachable();
+}
+
+static void add_root(const char *hex)
+{
+	unsigned char sha1[20];
+
+	if (get_sha1_hex((char *)hex, sha1) < 0)
+		usage("prune-cache: bad sha1");
+	mark_object(sha1, TYPE_UNKNOWN);
+	mark_reachable();
+	nr_roots++;
+}
+
+/* 第 3 步: 删除目录 xx 中没有标记并且超过宽限期的对象 */
+static void prune_dir(int n, unsigned long *pruned, unsigned long *bytes, unsigned long *recent)
+{
+	struct prune_dir *dir = dirs + n;
+	char path[PATH_MAX];
+	struct stat st;
+	int i;
+
+	for (i = 0; i < dir->nr; i++) {
+		unsigned long pos = dir->start + i;
+
+		if (reachable[pos >> 3] & (1 << (pos & 7)))
+			continue;
+		dircache_object_path(&repo, dir->sha1s[i], path, sizeof(path));
+		if (lstat(path, &st) < 0)
+			continue;
+		if (st.st_mtime > expire) {
+			(*recent)++;
+			continue;
+		}
+		if (verbose || dry_run)
+			printf("%s\n", sha1_to_hex(dir->sha1s[i]));
+		if (!dry_run && unlink(path) < 0) {
+			perror(path);
+			continue;
+		}
+		(*pruned)++;
+		*bytes += st.st_size;
+	}
+}
+
+/*
+ * 命令: "prune-cache [-n] [-v] [--grace=<seconds>] [--index-only] [--stdin] [<sha1>...]"
+ * 示例: $ ./rev-list <head> | head -1 | ./prune-cache --stdin
+ *
+ * -n: 只列出会被删除的对象, 不删除; -v: 列出删除的对象
+ * --stdin: 从 stdin 读取根对象的 sha1, 每行一个
+ * --index-only: 没有给出根对象时只保留暂存区引用的对象, 所有 commit 都会被删除
+ */
+int main(int argc, char **argv)
+{
+	unsigned long start, usec, pruned = 0, bytes = 0, recent = 0;
+	int i, n, from_stdin = 0, stale = 0;
+	long grace = DEFAULT_GRACE;
+	struct timeval tv;
+	char line[100];
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (!strcmp(argv[i], "-n")) {
+			dry_run = 1;
+			continue;
+		}
+		if (!strcmp(argv[i], "-v")) {
+			verbose = 1;
+			continue;
+		}
+		if (!strncmp(argv[i], "--grace=", 8)) {
+			grace = atol(argv[i] + 8);
+			continue;
+		}
+		if (!strcmp(argv[i], "--stdin")) {
+			from_stdin = 1;
+			continue;
+		}
+		if (!strcmp(argv[i], "--index-only")) {
+			index_only = 1;
+			continue;
+		}
+		usage("prune-cache [-n] [-v] [--grace=<seconds>] [--index-only] [--stdin] [<sha1>...]");
+	}
+	if (grace < 0)
+		usage("prune-cache: bad grace period");
+	gettimeofday(&tv, NULL);
+	start = tv.tv_sec * 1000000ul + tv.tv_usec;
+	expire = tv.tv_sec - grace;
+	if (dircache_init(&repo, NULL) < 0 || dircache_handle_init(&handle, &repo) < 0)
+		usage("prune-cache: out of memory");
+
+	for (n = 0; n < 256; n++) {
+		scan_dir(n);
+		dirs[n].start = nr_objects;
+		nr_objects += dirs[n].nr;
+	}
+	reachable = calloc(nr_objects / 8 + 1, 1);
+
+	mark_index();
+	for (; i < argc; i++)
+		add_root(argv[i]);
+	if (from_stdin)
+		while (fgets(line, sizeof(line), stdin))
+			if (line[0] != '\n')
+				add_root(line);
+	/* 暂存区不引用 commit, 没有给出根对象时所有 commit 都不可达, 多半是用法错误 */
+	if (!nr_roots && !index_only)
+		usage("prune-cache: no commit or tree given (use --index-only to keep only what the index references), nothing pruned");
+	if (!nr_roots && !active_nr)
+		usage("prune-cache: empty index and no sha1 given, nothing pruned");
+
+	for (n = 0; n < 256; n++)
+		prune_dir(n, &pruned, &bytes, &recent);
+	for (n = 0; n < tmp_nr; n++)
+		stale += remove_stale_tmp(tmp_files[n]);
+
+	gettimeofday(&tv, NULL);
+	usec = tv.tv_sec * 1000000ul + tv.tv_usec - start;
+	fflush(stdout);
+	fprintf(stderr, "%lu objects, %lu reachable, %s %lu unreachable (%lu KB), kept %lu within grace period, "
+		"%d stale temporary files, %lu.%03lu s\n",
+		nr_objects, nr_reachable, dry_run ? "would prune" : "pruned", pruned, bytes >> 10, recent,
+		stale, usec / 1000000, usec / 1000 % 1000);
+	return 0;
+}
+
+/* #
+ * # prune-cache 使用示例
+ * #
+ *
+ * # 1. 提交以后 a 修改了两次, 每次 update-cache 都写入一个新的 blob, 第一次写入的 blob 已经不可达,
+ * #    但是还在宽限期内, 不会被删除
+ * git-e83c5163$ ./prune-cache b9e40b930eefa65a12bcc0a4409578013a03e098
+ * 6 objects, 5 reachable, pruned 0 unreachable (0 KB), kept 1 within grace period, 0 stale temporary files, 0.001 s
+ *
+ * # 2. 宽限期为 0, -n 只列出会被删除的对象
+ * git-e83c5163$ ./prune-cache -n --grace=0 b9e40b930eefa65a12bcc0a4409578013a03e098
+ * 0bbbd381a14cb213fe2580483f7701792c7263bf
+ * 6 objects, 5 reachable, would prune 1 unreachable (0 KB), kept 0 within grace period, 0 stale temporary files, 0.001 s
+ *
+ * # 3. 可达的对象不存在时, 不删除任何对象
+ * git-e83c5163$ ./prune-cache --grace=0 b9e40b930eefa65a12bcc0a4409578013a03e098
+ * prune-cache: missing blob 5b920853712e665adfc15a90cdf99ac6bfe10c6a
+ * read-tree: prune-cache: reachable object is missing, nothing pruned
+ *
+ * # 4. fast-import 导入的 10 万个 commit 中, 只保留倒数第 50001 个 commit 可达的对象
+ * git-e83c5163$ ./rev-list 8c57b8d68fc9fac39f5de65607c9339f95d5c821 | sed -n 50001p | ./prune-cache --stdin
+ * 518932 objects, 268932 reachable, pruned 250000 unreachable (111452 KB), kept 0 within grace period, 1 stale temporary files, 23.719 s
+ */
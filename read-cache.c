@@ -1,4 +1,7 @@
 #include "cache.h"
+#include <dirent.h>
+#include <limits.h>
+#include <sys/time.h>
 
 /*
  * read-cache.c 定义了各组件共用的函数
@@ -14,6 +17,142 @@ struct cache_entry **active_cache = NULL;
  */
 unsigned int active_nr = 0, active_alloc = 0;
 
+/* 缓存的各级目录 tree 对象, 按目录名排序 */
+struct cache_tree **active_tree = NULL;
+unsigned int tree_nr = 0, tree_alloc = 0;
+
+/* sparse 目录列表, 不包含结尾的 '/' */
+char **sparse_dirs = NULL;
+int sparse_nr = 0;
+
+/*
+ * arena 由若干 chunk 组成的链表, arena_head 为当前正在使用的 chunk
+ * 超过 ARENA_CHUNK/4 的大块内存单独分配, 放在 arena_big 链表中, 避免浪费普通 chunk 的剩余空间
+ */
+#define ARENA_CHUNK (1ul << 20)
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	unsigned long size, used;
+	char data[0];
+};
+
+static struct arena_chunk *arena_head, *arena_big, *arena_spare;
+
+/* 分配统计: 分配次数, 分配字节数, 实际调用 malloc 的次数, 最大占用 */
+static unsigned long arena_allocs, arena_bytes, arena_mallocs, arena_inuse, arena_peak;
+
+static struct arena_chunk *new_chunk(unsigned long size)
+{
+	struct arena_chunk *chunk;
+
+	/* 回退时保留了一个普通 chunk, 优先重复使用 */
+	if (size == ARENA_CHUNK && arena_spare) {
+		chunk = arena_spare;
+		arena_spare = NULL;
+	} else {
+		chunk = malloc(sizeof(*chunk) + size);
+		if (!chunk)
+			return NULL;
+		chunk->size = size;
+		arena_mallocs++;
+	}
+	chunk->used = 0;
+	arena_inuse += chunk->size;
+	if (arena_inuse > arena_peak)
+		arena_peak = arena_inuse;
+	return chunk;
+}
+
+static void free_chunk(struct arena_chunk *chunk)
+{
+	arena_inuse -= chunk->size;
+	if (chunk->size == ARENA_CHUNK && !arena_spare) {
+		arena_spare = chunk;
+		return;
+	}
+	free(chunk);
+}
+
+/*
+ * 从 arena 中分配 size 字节(8字节对齐), 内存不需要也不能单独 free
+ */
+void *arena_alloc(unsigned long size)
+{
+	struct arena_chunk *chunk = arena_head;
+	void *ret;
+
+	size = (size + 7) & ~7ul;
+	arena_allocs++;
+	arena_bytes += size;
+	if (size > ARENA_CHUNK / 4) {
+		chunk = new_chunk(size);
+		if (!chunk)
+			return NULL;
+		chunk->used = size;
+		chunk->next = arena_big;
+		arena_big = chunk;
+		return chunk->data;
+	}
+	if (!chunk || chunk->size - chunk->used < size) {
+		chunk = new_chunk(ARENA_CHUNK);
+		if (!chunk)
+			return NULL;
+		chunk->next = arena_head;
+		arena_head = chunk;
+	}
+	ret = chunk->data + chunk->used;
+	chunk->used += size;
+	return ret;
+}
+
+/* 记录 arena 的当前位置, 之后分配的内存可以通过 arena_rewind() 一次性回收 */
+void arena_mark(struct arena_mark *mark)
+{
+	mark->chunk = arena_head;
+	mark->big = arena_big;
+	mark->used = arena_head ? arena_head->used : 0;
+}
+
+/* 回收 arena_mark() 之后分配的所有内存 */
+void arena_rewind(struct arena_mark *mark)
+{
+	while (arena_big != mark->big) {
+		struct arena_chunk *chunk = arena_big;
+		arena_big = chunk->next;
+		free_chunk(chunk);
+	}
+	while (arena_head != mark->chunk) {
+		struct arena_chunk *chunk = arena_head;
+		arena_head = chunk->next;
+		free_chunk(chunk);
+	}
+	if (arena_head)
+		arena_head->used = mark->used;
+}
+
+static void free_list(struct arena_chunk *chunk)
+{
+	while (chunk) {
+		struct arena_chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+}
+
+/* 运行结束时释放 arena 的所有内存 */
+void arena_release(void)
+{
+	if (getenv("DIRCACHE_STATS"))
+		fprintf(stderr, "arena: %lu allocs, %lu bytes, %lu mallocs, peak %lu bytes\n",
+			arena_allocs, arena_bytes, arena_mallocs, arena_peak);
+	free_list(arena_head);
+	free_list(arena_big);
+	free(arena_spare);
+	arena_head = arena_big = arena_spare = NULL;
+	arena_inuse = 0;
+}
+
 void usage(const char *err)
 {
 	fprintf(stderr, "read-tree: %s\n", err);
@@ -59,16 +198,8 @@ int get_sha1_hex(char *hex, unsigned char *sha1)
 char * sha1_to_hex(unsigned char *sha1)
 {
 	static char buffer[50];
-	static const char hex[] = "0123456789abcdef";
-	char *buf = buffer;
-	int i;
 
-	for (i = 0; i < 20; i++) {
-		unsigned int val = *sha1++;
-		*buf++ = hex[val >> 4];
-		*buf++ = hex[val & 0xf];
-	}
-	return buffer;
+	return dircache_sha1_to_hex(sha1, buffer);
 }
 
 /*
@@ -114,22 +245,55 @@ char *sha1_file_name(unsigned char *sha1)
 }
 
 /*
- * 返回 sha1 值对应的文件内容(解压缩后返回)
+ * 旧接口(read_sha1_file() 等)使用的对象库, 第一次使用时初始化, 用于查找备用对象目录
+ * 初始化失败(内存不足)时只使用主对象目录
  */
-void * read_sha1_file(unsigned char *sha1, char *type, unsigned long *size)
+static struct dircache *default_repo(void)
+{
+	static struct dircache repo;
+	static int initialized;
+
+	if (!initialized) {
+		dircache_init(&repo, NULL);
+		initialized = 1;
+	}
+	return &repo;
+}
+
+/* 打开对象文件, 主对象目录中没有时在备用对象目录中查找 */
+static int open_sha1_file(unsigned char *sha1)
+{
+	int fd = open(sha1_file_name(sha1), O_RDONLY);
+
+	if (fd < 0 && errno == ENOENT && default_repo()->nr_alternates) {
+		fd = dircache_open_object(default_repo(), sha1);
+		if (fd < 0) {
+			errno = ENOENT;
+			fd = -1;
+		}
+	}
+	return fd;
+}
+
+int has_sha1_file(unsigned char *sha1)
+{
+	return dircache_has_object(default_repo(), sha1);
+}
+
+/*
+ * 将 sha1 值对应的对象文件映射到内存, 返回映射地址, 文件大小存放在 *size 中
+ * NOTE! sha1_file_name() 使用静态缓冲区, 多线程使用时需要调用者加锁
+ */
+void *map_sha1_file(unsigned char *sha1, unsigned long *size)
 {
-	z_stream stream;
-	char buffer[8192];
 	struct stat st;
-	int i, fd, ret, bytes;
-	void *map, *buf;
-	/* 将 sha1 值转换成文件名 */
-	char *filename = sha1_file_name(sha1);
+	void *map;
+	int fd;
 
-	/* 打开文件 */
-	fd = open(filename, O_RDONLY);
+	/* 打开文件(包括备用对象目录中的) */
+	fd = open_sha1_file(sha1);
 	if (fd < 0) {
-		perror(filename);
+		perror(sha1_file_name(sha1));
 		return NULL;
 	}
 	/* 获取文件大小 */
@@ -142,12 +306,26 @@ void * read_sha1_file(unsigned char *sha1, char *type, unsigned long *size)
 	close(fd);
 	if (-1 == (int)(long)map)
 		return NULL;
+	*size = st.st_size;
+	return map;
+}
+
+/*
+ * 解压 map_sha1_file() 映射的对象数据, 返回内容类型(blob/tree/commit)和 size
+ * 返回的缓冲区由 malloc 分配, 不会访问任何全局数据, 可以在多个线程中同时调用
+ */
+void *unpack_sha1_file(void *map, unsigned long mapsize, char *type, unsigned long *size)
+{
+	z_stream stream;
+	char buffer[8192];
+	int ret, bytes;
+	void *buf;
 
 	/* Get the data stream */
 	/* 初始化 zlib stream 结构体 */
 	memset(&stream, 0, sizeof(stream));
 	stream.next_in = map;
-	stream.avail_in = st.st_size;
+	stream.avail_in = mapsize;
 	stream.next_out = buffer;
 	stream.avail_out = sizeof(buffer);
 
@@ -158,13 +336,17 @@ void * read_sha1_file(unsigned char *sha1, char *type, unsigned long *size)
 	 * 原始数据的头部格式为: <ascii tag without space> + <space> + <ascii decimal size> + <byte\0> + <binary object data>
 	 *                即: <type>                    + ' '     + <size>               + '\0'     + <binary data>
 	 */
-	if (sscanf(buffer, "%10s %lu", type, size) != 2)
+	if (sscanf(buffer, "%10s %lu", type, size) != 2) {
+		inflateEnd(&stream);
 		return NULL;
+	}
 	bytes = strlen(buffer) + 1;
-	/* 根据解析得到的 size (最终数据大小), 分配对应大小的 buf */
-	buf = malloc(*size);
-	if (!buf)
+	/* 根据解析得到的 size (最终数据大小), 分配对应大小的 buf, 空对象也返回有效指针 */
+	buf = malloc(*size + 1);
+	if (!buf) {
+		inflateEnd(&stream);
 		return NULL;
+	}
 
 	/* 复制第一次解压缩后, 头部后面的二进制数据到缓冲区 buf */
 	memcpy(buf, buffer + bytes, stream.total_out - bytes);
@@ -182,18 +364,633 @@ void * read_sha1_file(unsigned char *sha1, char *type, unsigned long *size)
 	return buf;
 }
 
+/*
+ * 返回 sha1 值对应的文件内容(解压缩后返回)
+ */
+void * read_sha1_file(unsigned char *sha1, char *type, unsigned long *size)
+{
+	unsigned long mapsize;
+	void *map, *buf;
+
+	map = map_sha1_file(sha1, &mapsize);
+	if (!map)
+		return NULL;
+	buf = unpack_sha1_file(map, mapsize, type, size);
+	munmap(map, mapsize);
+	return buf;
+}
+
+/*
+ * 只读取对象的头部 "<type> <size>\0", 返回类型和大小
+ * 只从文件开头读取一小块压缩数据, 解压出头部就停止, 开销和对象大小无关
+ */
+int read_sha1_header(unsigned char *sha1, char *type, unsigned long *size)
+{
+	unsigned char in[1024];
+	char hdr[64];
+	z_stream stream;
+	ssize_t len;
+	int fd;
+
+	fd = open_sha1_file(sha1);
+	if (fd < 0)
+		return -1;
+	len = read(fd, in, sizeof(in));
+	close(fd);
+	if (len <= 0)
+		return -1;
+
+	memset(&stream, 0, sizeof(stream));
+	stream.next_in = in;
+	stream.avail_in = len;
+	stream.next_out = (unsigned char *)hdr;
+	stream.avail_out = sizeof(hdr) - 1;
+	inflateInit(&stream);
+	inflate(&stream, 0);
+	inflateEnd(&stream);
+	hdr[sizeof(hdr) - 1 - stream.avail_out] = 0;
+	if (sscanf(hdr, "%10s %lu", type, size) != 2)
+		return -1;
+	return 0;
+}
+
+/*
+ * libdircache: 可重入的对象库接口
+ *
+ * 对象文件的路径写入调用者的缓冲区, zlib stream 和临时缓冲区放在每个线程自己的 handle 中,
+ * 读出的数据放在调用者的 dircache_buffer 中, 出错时返回错误码而不是打印信息或者退出.
+ */
+/* 添加一个备用对象目录, 相对路径相对于主对象目录, 去掉结尾的 '/' */
+static int add_alternate(struct dircache *repo, const char *dir, int len)
+{
+	char *path;
+
+	while (len > 1 && dir[len - 1] == '/')
+		len--;
+	if (!len)
+		return 0;
+	path = malloc(repo->object_dir_len + len + 2);
+	if (!path)
+		return DIRCACHE_ERR_NOMEM;
+	if (dir[0] == '/') {
+		memcpy(path, dir, len);
+		path[len] = 0;
+	} else
+		sprintf(path, "%s/%.*s", repo->object_dir, len, dir);
+	if (repo->nr_alternates == repo->alloc_alternates) {
+		char **alternates;
+
+		repo->alloc_alternates = alloc_nr(repo->alloc_alternates);
+		alternates = realloc(repo->alternates, repo->alloc_alternates * sizeof(char *));
+		if (!alternates) {
+			free(path);
+			return DIRCACHE_ERR_NOMEM;
+		}
+		repo->alternates = alternates;
+	}
+	repo->alternates[repo->nr_alternates++] = path;
+	return 0;
+}
+
+/* 先读取 "<object_dir>/info/alternates" (忽略空行和 '#' 开头的行), 再读取环境变量 */
+static int read_alternates(struct dircache *repo)
+{
+	char path[PATH_MAX], line[PATH_MAX];
+	const char *env, *end;
+	FILE *f;
+	int ret = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", repo->object_dir, ALTERNATES_FILE);
+	f = fopen(path, "r");
+	if (f) {
+		while (!ret && fgets(line, sizeof(line), f)) {
+			int len = strcspn(line, "\n");
+
+			if (line[0] != '#')
+				ret = add_alternate(repo, line, len);
+		}
+		fclose(f);
+	}
+	for (env = getenv(ALTERNATE_DB_ENVIRONMENT); !ret && env && *env; env = *end ? end + 1 : end) {
+		end = strchr(env, ':');
+		if (!end)
+			end = env + strlen(env);
+		ret = add_alternate(repo, env, end - env);
+	}
+	return ret;
+}
+
+int dircache_init(struct dircache *repo, const char *object_dir)
+{
+	memset(repo, 0, sizeof(*repo));
+	if (!object_dir)
+		object_dir = getenv(DB_ENVIRONMENT) ? : DEFAULT_DB_ENVIRONMENT;
+	repo->object_dir = strdup(object_dir);
+	if (!repo->object_dir)
+		return DIRCACHE_ERR_NOMEM;
+	repo->object_dir_len = strlen(object_dir);
+	return read_alternates(repo);
+}
+
+void dircache_release(struct dircache *repo)
+{
+	int i;
+
+	for (i = 0; i < repo->nr_alternates; i++)
+		free(repo->alternates[i]);
+	free(repo->alternates);
+	free(repo->object_dir);
+	memset(repo, 0, sizeof(*repo));
+}
+
+int dircache_handle_init(struct dircache_handle *h, struct dircache *repo)
+{
+	memset(h, 0, sizeof(*h));
+	h->repo = repo;
+	h->level = Z_BEST_COMPRESSION;
+	if (inflateInit(&h->inflate) != Z_OK)
+		return DIRCACHE_ERR_NOMEM;
+	return 0;
+}
+
+void dircache_handle_release(struct dircache_handle *h)
+{
+	inflateEnd(&h->inflate);
+	if (h->deflate_ready)
+		deflateEnd(&h->deflate);
+	dircache_buffer_release(&h->in);
+	dircache_buffer_release(&h->out);
+}
+
+/* 保证 b 至少有 size 字节的空间, 原有的数据保留 */
+int dircache_buffer_grow(struct dircache_buffer *b, unsigned long size)
+{
+	void *buf;
+
+	if (size <= b->alloc)
+		return 0;
+	buf = realloc(b->buf, size);
+	if (!buf)
+		return DIRCACHE_ERR_NOMEM;
+	b->buf = buf;
+	b->alloc = size;
+	return 0;
+}
+
+void dircache_buffer_release(struct dircache_buffer *b)
+{
+	free(b->buf);
+	b->buf = NULL;
+	b->len = b->alloc = 0;
+}
+
+const char *dircache_strerror(int err)
+{
+	switch (err) {
+	case 0:
+		return "success";
+	case DIRCACHE_ERR_MISSING:
+		return "object not found";
+	case DIRCACHE_ERR_CORRUPT:
+		return "corrupt object";
+	case DIRCACHE_ERR_NOMEM:
+		return "out of memory";
+	case DIRCACHE_ERR_IO:
+		return "i/o error";
+	}
+	return "unknown error";
+}
+
+/* 和 sha1_to_hex() 相同, 但是写入调用者的缓冲区 hex (至少 41 字节) */
+char *dircache_sha1_to_hex(const unsigned char *sha1, char *hex)
+{
+	static const char hexchar[] = "0123456789abcdef";
+	int i;
+
+	for (i = 0; i < 20; i++) {
+		unsigned int val = sha1[i];
+		hex[i*2] = hexchar[val >> 4];
+		hex[i*2 + 1] = hexchar[val & 0xf];
+	}
+	hex[40] = 0;
+	return hex;
+}
+
+/* "<dir>/xx/<38 个字符>" */
+static int object_path_in(const char *dir, int len, const unsigned char *sha1, char *path, unsigned long size)
+{
+	char hex[41];
+
+	if (size < len + 43)
+		return DIRCACHE_ERR_NOMEM;
+	dircache_sha1_to_hex(sha1, hex);
+	memcpy(path, dir, len);
+	path += len;
+	*path++ = '/';
+	*path++ = hex[0];
+	*path++ = hex[1];
+	*path++ = '/';
+	memcpy(path, hex + 2, 39);
+	return 0;
+}
+
+/* 和 sha1_file_name() 相同(主对象目录中的路径), 但是写入调用者的缓冲区 path, size 不够时返回错误 */
+int dircache_object_path(struct dircache *repo, const unsigned char *sha1, char *path, unsigned long size)
+{
+	return object_path_in(repo->object_dir, repo->object_dir_len, sha1, path, size);
+}
+
+/* 在备用对象目录中查找对象, 找到时返回 0, 路径写入 path */
+static int find_alternate(struct dircache *repo, const unsigned char *sha1, char *path, unsigned long size)
+{
+	int i;
+
+	for (i = 0; i < repo->nr_alternates; i++) {
+		const char *dir = repo->alternates[i];
+
+		if (!object_path_in(dir, strlen(dir), sha1, path, size) && !access(path, F_OK))
+			return 0;
+	}
+	return DIRCACHE_ERR_MISSING;
+}
+
+int dircache_open_object(struct dircache *repo, const unsigned char *sha1)
+{
+	char path[PATH_MAX];
+	int fd, i;
+
+	if (dircache_object_path(repo, sha1, path, sizeof(path)) < 0)
+		return DIRCACHE_ERR_NOMEM;
+	fd = open(path, O_RDONLY);
+	for (i = 0; fd < 0 && errno == ENOENT && i < repo->nr_alternates; i++) {
+		const char *dir = repo->alternates[i];
+
+		if (!object_path_in(dir, strlen(dir), sha1, path, sizeof(path)))
+			fd = open(path, O_RDONLY);
+	}
+	if (fd < 0)
+		return errno == ENOENT ? DIRCACHE_ERR_MISSING : DIRCACHE_ERR_IO;
+	return fd;
+}
+
+int dircache_has_object(struct dircache *repo, const unsigned char *sha1)
+{
+	char path[PATH_MAX];
+
+	if (dircache_object_path(repo, sha1, path, sizeof(path)) < 0)
+		return 0;
+	return !access(path, F_OK) || !find_alternate(repo, sha1, path, sizeof(path));
+}
+
+/* 读取对象文件的全部(压缩的)内容到 h->in */
+static int read_object_file(struct dircache_handle *h, const unsigned char *sha1)
+{
+	struct stat st;
+	ssize_t len;
+	int fd;
+
+	fd = dircache_open_object(h->repo, sha1);
+	if (fd < 0)
+		return fd;
+	if (fstat(fd, &st) < 0 || dircache_buffer_grow(&h->in, st.st_size + 1) < 0) {
+		close(fd);
+		return DIRCACHE_ERR_IO;
+	}
+	for (len = 0; len < st.st_size; ) {
+		ssize_t n = read(fd, (char *)h->in.buf + len, st.st_size - len);
+		if (n <= 0)
+			break;
+		len += n;
+	}
+	close(fd);
+	if (len != st.st_size)
+		return DIRCACHE_ERR_IO;
+	h->in.len = len;
+	return 0;
+}
+
+/*
+ * 读取并解压对象, 内容放在 out->buf 中(后面多一个 '\0'), out->len 为内容的大小
+ * 头部先解压到栈上的小缓冲区, 得到对象大小后 out 一次扩大到位, 内容直接解压到 out 中
+ */
+int dircache_read_object(struct dircache_handle *h, const unsigned char *sha1, char *type, struct dircache_buffer *out)
+{
+	unsigned long size, hdrlen, len;
+	char hdr[64], *end;
+	int ret;
+
+	ret = read_object_file(h, sha1);
+	if (ret < 0)
+		return ret;
+	inflateReset(&h->inflate);
+	h->inflate.next_in = h->in.buf;
+	h->inflate.avail_in = h->in.len;
+	h->inflate.next_out = (unsigned char *)hdr;
+	h->inflate.avail_out = sizeof(hdr);
+	ret = inflate(&h->inflate, 0);
+	end = memchr(hdr, 0, h->inflate.total_out);
+	if (!end || sscanf(hdr, "%10s %lu", type, &size) != 2)
+		return DIRCACHE_ERR_CORRUPT;
+	hdrlen = end - hdr + 1;
+	len = h->inflate.total_out - hdrlen;
+	if (len > size)
+		return DIRCACHE_ERR_CORRUPT;
+	if (dircache_buffer_grow(out, size + 1) < 0)
+		return DIRCACHE_ERR_NOMEM;
+	memcpy(out->buf, hdr + hdrlen, len);
+	/* 多留一个字节, 数据比头部记录的长时可以检查出来 */
+	h->inflate.next_out = (unsigned char *)out->buf + len;
+	h->inflate.avail_out = size - len + 1;
+	while (ret == Z_OK)
+		ret = inflate(&h->inflate, Z_FINISH);
+	if (ret != Z_STREAM_END || h->inflate.total_out != hdrlen + size)
+		return DIRCACHE_ERR_CORRUPT;
+	((char *)out->buf)[size] = 0;
+	out->len = size;
+	return 0;
+}
+
+/* 只解压对象的头部, 得到类型和大小 */
+int dircache_read_header(struct dircache_handle *h, const unsigned char *sha1, char *type, unsigned long *size)
+{
+	unsigned char in[1024];
+	char hdr[64];
+	ssize_t len;
+	int fd;
+
+	fd = dircache_open_object(h->repo, sha1);
+	if (fd < 0)
+		return fd;
+	len = read(fd, in, sizeof(in));
+	close(fd);
+	if (len <= 0)
+		return DIRCACHE_ERR_IO;
+	inflateReset(&h->inflate);
+	h->inflate.next_in = in;
+	h->inflate.avail_in = len;
+	h->inflate.next_out = (unsigned char *)hdr;
+	h->inflate.avail_out = sizeof(hdr) - 1;
+	inflate(&h->inflate, 0);
+	hdr[sizeof(hdr) - 1 - h->inflate.avail_out] = 0;
+	if (sscanf(hdr, "%10s %lu", type, size) != 2)
+		return DIRCACHE_ERR_CORRUPT;
+	return 0;
+}
+
+/*
+ * 对象已经存在时更新它的修改时间并返回 0, 不存在时返回 DIRCACHE_ERR_MISSING
+ * prune-cache 只删除修改时间早于宽限期的对象, 新的 tree/commit 引用一个已经存在的旧对象时,
+ * 写入方需要调用这个函数, 否则这个对象可能在新的引用写入之前被删除
+ */
+int dircache_freshen_object(struct dircache *repo, const unsigned char *sha1)
+{
+	char path[PATH_MAX];
+
+	if (dircache_object_path(repo, sha1, path, sizeof(path)) < 0)
+		return DIRCACHE_ERR_NOMEM;
+	if (!utimes(path, NULL))
+		return 0;
+	return errno == ENOENT ? DIRCACHE_ERR_MISSING : DIRCACHE_ERR_IO;
+}
+
+/*
+ * 压缩 "<type> <len>\0" + buf, 压缩后的数据放在 h->out 中, sha1 返回压缩后数据的 sha1 值
+ * 压缩级别为 h->level, 在第一次压缩之前可以修改
+ */
+int dircache_deflate_object(struct dircache_handle *h, const char *type, const void *buf, unsigned long len, unsigned char *sha1)
+{
+	char hdr[64];
+	unsigned long size;
+	int hdrlen, ret;
+	SHA_CTX c;
+
+	hdrlen = snprintf(hdr, sizeof(hdr), "%s %lu", type, len) + 1;
+	if (hdrlen > sizeof(hdr))
+		return DIRCACHE_ERR_CORRUPT;
+	if (!h->deflate_ready) {
+		if (deflateInit(&h->deflate, h->level) != Z_OK)
+			return DIRCACHE_ERR_NOMEM;
+		h->deflate_ready = 1;
+	} else
+		deflateReset(&h->deflate);
+	size = deflateBound(&h->deflate, hdrlen + len);
+	if (dircache_buffer_grow(&h->out, size) < 0)
+		return DIRCACHE_ERR_NOMEM;
+	h->deflate.next_out = h->out.buf;
+	h->deflate.avail_out = size;
+	h->deflate.next_in = (unsigned char *)hdr;
+	h->deflate.avail_in = hdrlen;
+	while (h->deflate.avail_in && deflate(&h->deflate, Z_NO_FLUSH) == Z_OK)
+		/* nothing */;
+	h->deflate.next_in = (unsigned char *)buf;
+	h->deflate.avail_in = len;
+	while ((ret = deflate(&h->deflate, Z_FINISH)) == Z_OK)
+		/* nothing */;
+	if (ret != Z_STREAM_END)
+		return DIRCACHE_ERR_NOMEM;
+	h->out.len = h->deflate.total_out;
+
+	SHA1_Init(&c);
+	SHA1_Update(&c, h->out.buf, h->out.len);
+	SHA1_Final(sha1, &c);
+	return 0;
+}
+
+/*
+ * 压缩对象并写入对象库
+ * 先写入同一目录下的临时文件再改名, 其他线程或者进程不会读到写了一半的对象
+ */
+int dircache_write_object(struct dircache_handle *h, const char *type, const void *buf, unsigned long len, unsigned char *sha1)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	int fd, ret;
+
+	ret = dircache_deflate_object(h, type, buf, len, sha1);
+	if (ret < 0)
+		return ret;
+	if (dircache_object_path(h->repo, sha1, path, sizeof(path)) < 0)
+		return DIRCACHE_ERR_NOMEM;
+	/*
+	 * 已经存在的对象不需要再写, 只更新修改时间(见 dircache_freshen_object)
+	 * 别人写入的只读对象不能修改时间(EPERM/EACCES), 确认文件存在就可以了;
+	 * 其他错误(比如目录不能访问)不能当作已经写入, 继续写临时文件, 失败时返回错误
+	 */
+	if (!utimes(path, NULL))
+		return 0;
+	if ((errno == EPERM || errno == EACCES) && !access(path, F_OK))
+		return 0;
+	/* 备用对象目录中已经有的对象也不需要写入 */
+	if (!find_alternate(h->repo, sha1, tmp, sizeof(tmp)))
+		return 0;
+	/* tmp = ".dircache/objects/xx/tmp_XXXXXX" */
+	memcpy(tmp, path, h->repo->object_dir_len + 4);
+	strcpy(tmp + h->repo->object_dir_len + 4, "tmp_XXXXXX");
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return DIRCACHE_ERR_IO;
+	fchmod(fd, 0444);
+	if (write(fd, h->out.buf, h->out.len) != h->out.len || close(fd) < 0) {
+		unlink(tmp);
+		return DIRCACHE_ERR_IO;
+	}
+	if (rename(tmp, path) < 0) {
+		unlink(tmp);
+		return DIRCACHE_ERR_IO;
+	}
+	return 0;
+}
+
+/*
+ * 批量读取对象
+ *
+ * 逐个调用 read_sha1_file() 时, 每个对象都要 inflateInit/inflateEnd 一次, mmap 一次文件,
+ * 并且按 sha1 的顺序访问, 会在 256 个目录之间来回跳.
+ * 这里先按 sha1 排序, 把同一个目录中的对象放在一起, 再读取目录得到每个文件的 inode,
+ * 目录内按 inode 排序, 尽量按文件在磁盘上的顺序读取;
+ * 整个过程使用同一个 dircache_handle (每个对象 inflateReset 一次), 输入和输出缓冲区也重复使用.
+ */
+struct bulk_object {
+	unsigned char *sha1;
+	unsigned long ino;
+	int index;
+};
+
+static int compare_bulk_sha1(const void *a, const void *b)
+{
+	const struct bulk_object *o1 = a, *o2 = b;
+
+	return memcmp(o1->sha1, o2->sha1, 20);
+}
+
+static int compare_bulk_ino(const void *a, const void *b)
+{
+	const struct bulk_object *o1 = a, *o2 = b;
+
+	if (o1->ino != o2->ino)
+		return o1->ino < o2->ino ? -1 : 1;
+	return o1->index - o2->index;
+}
+
+/* 读取目录 dir, 为 list 中的 nr 个对象(已按 sha1 排序, 都在这个目录下)填上文件的 inode */
+static void fill_bulk_inodes(char *dir, struct bulk_object *list, int nr)
+{
+	struct dirent *de;
+	char hex[41];
+	DIR *d;
+
+	d = opendir(dir);
+	if (!d)
+		return;
+	/* dir 以 "/xx" 结尾, 就是 sha1 字符串的前两个字符 */
+	memcpy(hex, dir + strlen(dir) - 2, 2);
+	while ((de = readdir(d)) != NULL) {
+		unsigned char sha1[20];
+		int lo = 0, hi = nr;
+
+		if (strlen(de->d_name) != 38)
+			continue;
+		memcpy(hex + 2, de->d_name, 39);
+		if (get_sha1_hex(hex, sha1))
+			continue;
+		while (lo < hi) {
+			int mi = (lo + hi) / 2;
+			int cmp = memcmp(sha1, list[mi].sha1, 20);
+			if (!cmp) {
+				/* 同一个对象可能出现多次 */
+				while (mi > 0 && !memcmp(sha1, list[mi - 1].sha1, 20))
+					mi--;
+				while (mi < nr && !memcmp(sha1, list[mi].sha1, 20))
+					list[mi++].ino = de->d_ino;
+				break;
+			}
+			if (cmp < 0)
+				hi = mi;
+			else
+				lo = mi + 1;
+		}
+	}
+	closedir(d);
+}
+
+int read_sha1_files(unsigned char **sha1s, int nr, sha1_file_fn fn, void *data)
+{
+	struct dircache_buffer out = { NULL, 0, 0 };
+	unsigned long in_bytes = 0, out_bytes = 0;
+	struct timeval start, end, now;
+	struct dircache_handle h;
+	struct bulk_object *list;
+	struct dircache repo;
+	char path[PATH_MAX];
+	int i, j, ret = 0;
+
+	gettimeofday(&start, NULL);
+	if (dircache_init(&repo, NULL) < 0 || dircache_handle_init(&h, &repo) < 0)
+		return -1;
+	list = malloc((nr + 1) * sizeof(*list));
+	for (i = 0; i < nr; i++) {
+		list[i].sha1 = sha1s[i];
+		list[i].ino = 0;
+		list[i].index = i;
+	}
+	qsort(list, nr, sizeof(*list), compare_bulk_sha1);
+
+	for (i = 0; i < nr; i = j) {
+		for (j = i + 1; j < nr && list[j].sha1[0] == list[i].sha1[0]; j++)
+			/* nothing */;
+		/* 目录中只有一个要读的对象时不需要排序 */
+		if (j - i < 2)
+			continue;
+		/* path = ".dircache/objects/xx" */
+		dircache_object_path(&repo, list[i].sha1, path, sizeof(path));
+		path[repo.object_dir_len + 3] = 0;
+		fill_bulk_inodes(path, list + i, j - i);
+		qsort(list + i, j - i, sizeof(*list), compare_bulk_ino);
+	}
+
+	for (i = 0; i < nr && ret >= 0; i++) {
+		char type[20] = "";
+		void *buf = NULL;
+
+		if (!dircache_read_object(&h, list[i].sha1, type, &out)) {
+			buf = out.buf;
+			in_bytes += h.in.len;
+			out_bytes += out.len;
+		}
+		gettimeofday(&end, NULL);
+		ret = fn(list[i].index, type, buf, buf ? out.len : 0, data);
+		/* 统计的时间不包括回调函数的时间 */
+		gettimeofday(&now, NULL);
+		start.tv_sec += now.tv_sec - end.tv_sec;
+		start.tv_usec += now.tv_usec - end.tv_usec;
+	}
+
+	gettimeofday(&end, NULL);
+	if (getenv("DIRCACHE_STATS")) {
+		unsigned long usec = (end.tv_sec - start.tv_sec) * 1000000 + end.tv_usec - start.tv_usec;
+		fprintf(stderr, "read_sha1_files: %d objects in %lu.%03lu s (%lu objects/s), %lu bytes read, %lu bytes inflated\n",
+			i, usec / 1000000, usec / 1000 % 1000, usec ? i * 1000000ul / usec : 0,
+			in_bytes, out_bytes);
+	}
+	dircache_buffer_release(&out);
+	dircache_handle_release(&h);
+	dircache_release(&repo);
+	free(list);
+	return ret < 0 ? ret : 0;
+}
+
 /*
  * 将 buf 数据写入到文件中
  * 1. 压缩 buf 数据;
  * 2. 计算压缩数据的 sha1 值;
  * 3. 将压缩后数据写入 sha1 值对应的文件中;
+ * 得到的 sha1 值存放在 returnsha1 中, 由调用者决定是否输出
  */
-int write_sha1_file(char *buf, unsigned len)
+int write_sha1_file(char *buf, unsigned len, unsigned char *returnsha1)
 {
-	int size;
+	int size, ret;
 	char *compressed;
 	z_stream stream;
-	unsigned char sha1[20];
+	unsigned char *sha1 = returnsha1;
 	SHA_CTX c;
 
 	/* 压缩传入的 buf 数据 */
@@ -224,10 +1021,9 @@ int write_sha1_file(char *buf, unsigned len)
 	SHA1_Final(sha1, &c);
 
 	/* 将压缩后的数据写入到 sha1 值对应的文件中 */
-	if (write_sha1_buffer(sha1, compressed, size) < 0)
-		return -1;
-	printf("%s\n", sha1_to_hex(sha1));
-	return 0;
+	ret = write_sha1_buffer(sha1, compressed, size);
+	free(compressed);
+	return ret;
 }
 
 /*
@@ -236,13 +1032,21 @@ int write_sha1_file(char *buf, unsigned len)
 int write_sha1_buffer(unsigned char *sha1, void *buf, unsigned int size)
 {
 	/* 将 sha1 值转换成文件名 filename */
-	char *filename = sha1_file_name(sha1);
+	char *filename = sha1_file_name(sha1), path[PATH_MAX];
 	int i, fd;
 
+	/* 备用对象目录中已经有的对象不需要写入 */
+	if (default_repo()->nr_alternates && !find_alternate(default_repo(), sha1, path, sizeof(path)))
+		return 0;
 	/* 打开文件, 写入 buf 中的数据 */
 	fd = open(filename, O_WRONLY | O_CREAT | O_EXCL, 0666);
-	if (fd < 0)
-		return (errno == EEXIST) ? 0 : -1;
+	if (fd < 0) {
+		if (errno != EEXIST)
+			return -1;
+		/* 对象已经存在, 更新修改时间, 避免被 prune-cache 删除 */
+		utimes(filename, NULL);
+		return 0;
+	}
 	write(fd, buf, size);
 	close(fd);
 	return 0;
@@ -254,6 +1058,426 @@ static int error(const char * string)
 	return -1;
 }
 
+void init_tree_desc(struct tree_desc *desc, const void *buf, unsigned long size)
+{
+	desc->buf = buf;
+	desc->size = size;
+}
+
+/*
+ * 解析 tree 中的下一条记录, 每一步访问数据前都先检查边界
+ * mode 使用手写的八进制解析, 不调用 sscanf
+ */
+int tree_entry(struct tree_desc *desc, struct name_entry *entry)
+{
+	const unsigned char *buf = desc->buf, *end = buf + desc->size, *path, *nul;
+	unsigned int mode = 0;
+
+	if (!desc->size)
+		return 0;
+	/* mode: 至少一位八进制数字, 后面跟着一个空格 */
+	while (buf < end && *buf >= '0' && *buf <= '7') {
+		mode = (mode << 3) | (*buf++ - '0');
+		if (mode > 07777777)
+			return error("corrupt 'tree' file: bad mode");
+	}
+	if (buf == desc->buf || buf >= end || *buf != ' ')
+		return error("corrupt 'tree' file: bad mode");
+	/* name: 非空, 以 '\0' 结尾, 后面还需要有 20 字节的 sha1 */
+	path = buf + 1;
+	nul = memchr(path, 0, end - path);
+	if (!nul || nul == path || end - nul < 21)
+		return error("corrupt 'tree' file: truncated entry");
+	entry->mode = mode;
+	entry->path = (const char *)path;
+	entry->pathlen = nul - path;
+	entry->sha1 = nul + 1;
+	desc->size = end - (nul + 21);
+	desc->buf = nul + 21;
+	return 1;
+}
+
+/* 按照 tree 中的排序规则比较两个名字: 目录名后面相当于跟着一个 '/' */
+int tree_name_compare(const char *name1, int len1, unsigned int mode1,
+		      const char *name2, int len2, unsigned int mode2)
+{
+	int len = len1 < len2 ? len1 : len2;
+	unsigned char c1, c2;
+	int cmp = memcmp(name1, name2, len);
+
+	if (cmp)
+		return cmp;
+	c1 = len < len1 ? name1[len] : (S_ISDIR(mode1) ? '/' : 0);
+	c2 = len < len2 ? name2[len] : (S_ISDIR(mode2) ? '/' : 0);
+	/* 名字中不会出现 '/' 和 '\0', 所以 c1 == c2 时两个名字完全相同 */
+	return c1 - c2;
+}
+
+/*
+ * commit 对象的哈希表, 以 sha1 的前 4 个字节作为哈希值(sha1 本身已经足够随机)
+ * 开放寻址, 使用超过一半时容量翻倍
+ */
+int save_commit_buffer = 0;
+static struct commit **commit_hash;
+static unsigned int commit_hash_size, commit_hash_nr;
+
+static unsigned int hash_sha1(const unsigned char *sha1)
+{
+	unsigned int hash;
+
+	memcpy(&hash, sha1, sizeof(hash));
+	return hash;
+}
+
+static void insert_commit_hash(struct commit *commit)
+{
+	unsigned int i = hash_sha1(commit->sha1) & (commit_hash_size - 1);
+
+	while (commit_hash[i])
+		i = (i + 1) & (commit_hash_size - 1);
+	commit_hash[i] = commit;
+}
+
+static void grow_commit_hash(void)
+{
+	struct commit **old = commit_hash;
+	unsigned int i, oldsize = commit_hash_size;
+
+	commit_hash_size = oldsize ? oldsize * 2 : 1024;
+	commit_hash = calloc(commit_hash_size, sizeof(struct commit *));
+	for (i = 0; i < oldsize; i++)
+		if (old[i])
+			insert_commit_hash(old[i]);
+	free(old);
+}
+
+/* 查找 sha1 对应的 commit, 没有时新建一个(尚未解析) */
+struct commit *lookup_commit(const unsigned char *sha1)
+{
+	struct commit *commit;
+	unsigned int i;
+
+	if (commit_hash_nr * 2 >= commit_hash_size)
+		grow_commit_hash();
+	i = hash_sha1(sha1) & (commit_hash_size - 1);
+	while ((commit = commit_hash[i]) != NULL) {
+		if (!memcmp(commit->sha1, sha1, 20))
+			return commit;
+		i = (i + 1) & (commit_hash_size - 1);
+	}
+	/* commit 一直使用到运行结束, 从 arena 中分配 */
+	commit = arena_alloc(sizeof(*commit));
+	memset(commit, 0, sizeof(*commit));
+	memcpy(commit->sha1, sha1, 20);
+	commit_hash[i] = commit;
+	commit_hash_nr++;
+	return commit;
+}
+
+/* 从 "Thu Jul 15 14:33:07 2021" 中按顺序取出数字 */
+static const char *parse_number(const char *p, const char *end, unsigned long *val)
+{
+	unsigned long n = 0;
+
+	while (p < end && *p == ' ')
+		p++;
+	if (p >= end || *p < '0' || *p > '9')
+		return NULL;
+	while (p < end && *p >= '0' && *p <= '9')
+		n = n * 10 + (*p++ - '0');
+	*val = n;
+	return p;
+}
+
+/*
+ * commit-tree 默认写入的是 ctime() 格式的本地时间(没有时区), 这里只用来给提交排序,
+ * 所以直接当作 UTC 换算成秒数, 不调用 mktime() (每次都要查询时区, 很慢)
+ */
+unsigned long parse_commit_date(const char *date, const char *end)
+{
+	static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	unsigned long mon, day, hour, min, sec, year, days;
+	const char *p = date;
+	int i;
+
+	while (p < end && *p == ' ')
+		p++;
+	if (p < end && *p >= '0' && *p <= '9') {
+		parse_number(p, end, &sec);
+		return sec;
+	}
+	/* 跳过星期, 然后是月份 */
+	while (p < end && *p != ' ')
+		p++;
+	while (p < end && *p == ' ')
+		p++;
+	if (end - p < 3)
+		return 0;
+	for (i = 0; i < 12; i++)
+		if (!memcmp(months + i * 3, p, 3))
+			break;
+	if (i == 12)
+		return 0;
+	mon = i + 1;
+	p += 3;
+	if (!(p = parse_number(p, end, &day)) ||
+	    !(p = parse_number(p, end, &hour)) || p >= end || *p++ != ':' ||
+	    !(p = parse_number(p, end, &min)) || p >= end || *p++ != ':' ||
+	    !(p = parse_number(p, end, &sec)) ||
+	    !(p = parse_number(p, end, &year)) || year < 1970)
+		return 0;
+	/* 公历日期换算成 1970-01-01 以来的天数 */
+	if (mon <= 2) {
+		year--;
+		mon += 12;
+	}
+	days = 365 * year + year / 4 - year / 100 + year / 400 + (153 * (mon - 3) + 2) / 5 + day - 719469;
+	return ((days * 24 + hour) * 60 + min) * 60 + sec;
+}
+
+/* 解析 commit 头部, 遇到空行(提交信息的开始)就停止 */
+static int parse_commit_buffer(struct commit *commit, const char *buf, unsigned long size)
+{
+	const char *end = buf + size, *line = buf;
+	struct commit_list **tail = &commit->parents;
+
+	if (size < 46 || memcmp(buf, "tree ", 5) || get_sha1_hex((char *)buf + 5, commit->tree))
+		return error("bad commit: no tree");
+	while (line < end && *line != '\n') {
+		const char *eol = memchr(line, '\n', end - line);
+
+		if (!eol)
+			eol = end;
+		if (eol - line >= 47 && !memcmp(line, "parent ", 7)) {
+			unsigned char sha1[20];
+			struct commit_list *list;
+
+			if (get_sha1_hex((char *)line + 7, sha1))
+				return error("bad commit: bad parent");
+			list = arena_alloc(sizeof(*list));
+			list->item = lookup_commit(sha1);
+			list->next = NULL;
+			*tail = list;
+			tail = &list->next;
+		} else if (eol - line > 10 && !memcmp(line, "committer ", 10)) {
+			const char *date = eol;
+
+			while (date > line && date[-1] != '>')
+				date--;
+			commit->date = parse_commit_date(date, eol);
+		}
+		line = eol + 1;
+	}
+	commit->parsed = 1;
+	return 0;
+}
+
+/*
+ * commit-graph 文件只读映射到内存, 只检查长度和 signature,
+ * 整个文件的 sha1 在写入时计算, 这里不做校验(每次查询都校验整个文件太慢)
+ */
+struct commit_graph_entry *commit_graph;
+unsigned int commit_graph_nr;
+static unsigned int *graph_fanout, *graph_extra;
+static int graph_read;
+
+int read_commit_graph(void)
+{
+	struct commit_graph_header *hdr;
+	struct stat st;
+	unsigned long size = 0;
+	void *map = MAP_FAILED;
+	int fd;
+
+	if (graph_read)
+		return commit_graph_nr;
+	graph_read = 1;
+	fd = open(COMMIT_GRAPH_FILE, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (!fstat(fd, &st) && st.st_size >= sizeof(*hdr) + 256 * sizeof(unsigned int)) {
+		size = st.st_size;
+		map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if (map == MAP_FAILED)
+		return error("bad commit-graph file");
+	hdr = map;
+	if (hdr->signature != COMMIT_GRAPH_SIGNATURE || hdr->version != 1 ||
+	    size != sizeof(*hdr) + 256 * sizeof(unsigned int) +
+		    (unsigned long)hdr->nr * sizeof(struct commit_graph_entry) +
+		    (unsigned long)hdr->extra_nr * sizeof(unsigned int)) {
+		munmap(map, size);
+		return error("bad commit-graph file");
+	}
+	graph_fanout = (unsigned int *)(hdr + 1);
+	commit_graph = (struct commit_graph_entry *)(graph_fanout + 256);
+	graph_extra = (unsigned int *)(commit_graph + hdr->nr);
+	commit_graph_nr = hdr->nr;
+	return commit_graph_nr;
+}
+
+int commit_graph_pos(const unsigned char *sha1)
+{
+	unsigned int first, last;
+
+	if (read_commit_graph() <= 0)
+		return -1;
+	first = sha1[0] ? graph_fanout[sha1[0] - 1] : 0;
+	last = graph_fanout[sha1[0]];
+	while (last > first) {
+		unsigned int next = (last + first) >> 1;
+		int cmp = memcmp(sha1, commit_graph[next].sha1, 20);
+		if (!cmp)
+			return next;
+		if (cmp < 0) {
+			last = next;
+			continue;
+		}
+		first = next + 1;
+	}
+	return -1;
+}
+
+static void add_graph_parent(struct commit_list ***tail, unsigned int pos)
+{
+	struct commit_list *list = arena_alloc(sizeof(*list));
+
+	list->item = lookup_commit(commit_graph[pos].sha1);
+	list->next = NULL;
+	**tail = list;
+	*tail = &list->next;
+}
+
+/* 从 commit-graph 中取出 commit 的信息, commit 不在 commit-graph 中时返回 0 */
+static int fill_commit_from_graph(struct commit *commit)
+{
+	struct commit_graph_entry *entry;
+	struct commit_list **tail = &commit->parents;
+	int pos = commit_graph_pos(commit->sha1);
+	unsigned int p;
+
+	if (pos < 0)
+		return 0;
+	entry = commit_graph + pos;
+	memcpy(commit->tree, entry->tree, 20);
+	commit->date = entry->date;
+	commit->generation = entry->generation;
+	commit->graph_pos = pos;
+	if (entry->parent[0] != GRAPH_NO_PARENT)
+		add_graph_parent(&tail, entry->parent[0]);
+	p = entry->parent[1];
+	if (p != GRAPH_NO_PARENT && (p & GRAPH_EXTRA_PARENTS)) {
+		unsigned int *extra = graph_extra + (p & ~GRAPH_EXTRA_PARENTS);
+		do {
+			p = *extra++;
+			add_graph_parent(&tail, p & ~GRAPH_LAST_PARENT);
+		} while (!(p & GRAPH_LAST_PARENT));
+	} else if (p != GRAPH_NO_PARENT)
+		add_graph_parent(&tail, p);
+	commit->parsed = 1;
+	return 1;
+}
+
+/*
+ * 有 commit-graph 时直接从中取出 commit 的信息, 不需要读取 commit 对象
+ * (需要提交信息, 也就是 save_commit_buffer 时除外)
+ */
+int parse_commit(struct commit *commit)
+{
+	char type[20];
+	unsigned long size;
+	void *buf;
+
+	if (commit->parsed)
+		return 0;
+	if (!save_commit_buffer && fill_commit_from_graph(commit))
+		return 0;
+	commit->generation = GENERATION_INFINITY;
+	buf = read_sha1_file(commit->sha1, type, &size);
+	if (!buf)
+		return error("unable to read commit object");
+	if (strcmp(type, "commit") || parse_commit_buffer(commit, buf, size) < 0) {
+		free(buf);
+		return error("not a valid commit object");
+	}
+	if (save_commit_buffer) {
+		commit->buffer = buf;
+		commit->size = size;
+	} else
+		free(buf);
+	return 0;
+}
+
+/*
+ * 优先队列使用二叉堆, commit 较新(时间相同时 seq 较小)的排在前面, by_generation 时先比较 generation
+ */
+static int queue_before(struct commit_queue *queue, struct commit_queue_entry *a, struct commit_queue_entry *b)
+{
+	if (queue->by_generation && a->item->generation != b->item->generation)
+		return a->item->generation > b->item->generation;
+	if (a->item->date != b->item->date)
+		return a->item->date > b->item->date;
+	return a->seq < b->seq;
+}
+
+void commit_queue_put(struct commit_queue *queue, struct commit *commit)
+{
+	struct commit_queue_entry *array;
+	unsigned int i;
+
+	if (queue->nr == queue->alloc) {
+		queue->alloc = alloc_nr(queue->alloc);
+		queue->array = realloc(queue->array, queue->alloc * sizeof(struct commit_queue_entry));
+	}
+	array = queue->array;
+	i = queue->nr++;
+	array[i].item = commit;
+	array[i].seq = queue->seq++;
+	/* 上浮 */
+	while (i) {
+		unsigned int parent = (i - 1) / 2;
+		struct commit_queue_entry tmp;
+
+		if (!queue_before(queue, array + i, array + parent))
+			break;
+		tmp = array[i];
+		array[i] = array[parent];
+		array[parent] = tmp;
+		i = parent;
+	}
+}
+
+struct commit *commit_queue_get(struct commit_queue *queue)
+{
+	struct commit_queue_entry *array = queue->array;
+	struct commit *commit;
+	unsigned int i, nr;
+
+	if (!queue->nr)
+		return NULL;
+	commit = array[0].item;
+	nr = --queue->nr;
+	array[0] = array[nr];
+	/* 下沉 */
+	for (i = 0; ; ) {
+		unsigned int child = i * 2 + 1;
+		struct commit_queue_entry tmp;
+
+		if (child >= nr)
+			break;
+		if (child + 1 < nr && queue_before(queue, array + child + 1, array + child))
+			child++;
+		if (!queue_before(queue, array + child, array + i))
+			break;
+		tmp = array[i];
+		array[i] = array[child];
+		array[child] = tmp;
+		i = child;
+	}
+	return commit;
+}
+
 /*
  * 检查暂存区文件(".dircache/index")的 header 数据
  * 1. 检查 header 部分的 signature 和 version
@@ -281,6 +1505,289 @@ static int verify_hdr(struct cache_header *hdr, unsigned long size)
 	return 0;
 }
 
+/*
+ * 读取 ".dircache/sparse" 到 sparse_dirs[], 空行和 '#' 开头的行会被忽略
+ * 只读取一次, 文件不存在时不启用 sparse
+ */
+int read_sparse(void)
+{
+	static int done;
+	char line[4096];
+	int alloc = 0;
+	FILE *f;
+
+	if (done)
+		return sparse_nr;
+	done = 1;
+	f = fopen(SPARSE_FILE, "r");
+	if (!f)
+		return (errno == ENOENT) ? 0 : error("unable to read " SPARSE_FILE);
+	while (fgets(line, sizeof(line), f)) {
+		int len = strlen(line);
+
+		/* 去掉结尾的换行和 '/' */
+		while (len && (line[len-1] == '\n' || line[len-1] == '/'))
+			len--;
+		if (!len || line[0] == '#')
+			continue;
+		if (sparse_nr == alloc) {
+			alloc = alloc_nr(alloc);
+			sparse_dirs = realloc(sparse_dirs, alloc * sizeof(char *));
+		}
+		sparse_dirs[sparse_nr++] = strndup(line, len);
+	}
+	fclose(f);
+	return sparse_nr;
+}
+
+/*
+ * 判断 name 是否在 sparse 范围内(cone 模式):
+ * 1. 顶层文件总是包含在内;
+ * 2. 位于某个 sparse 目录下的文件(任意深度);
+ * 3. 位于某个 sparse 目录的父目录下的直接文件, 如 "src/sub" 会包含 "src/Makefile"
+ */
+int path_in_sparse(const char *name, int namelen)
+{
+	int i, dirlen;
+
+	if (!sparse_nr)
+		return 1;
+	/* dirlen 为 name 所在目录的长度 */
+	for (dirlen = namelen; dirlen > 0; dirlen--)
+		if (name[dirlen-1] == '/')
+			break;
+	if (!dirlen)
+		return 1;
+	dirlen--;
+	for (i = 0; i < sparse_nr; i++) {
+		const char *dir = sparse_dirs[i];
+		int len = strlen(dir);
+
+		if (namelen > len && name[len] == '/' && !memcmp(name, dir, len))
+			return 1;
+		if (len > dirlen && dir[dirlen] == '/' && !memcmp(dir, name, dirlen))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * 比较 cache entry 和 stat 结构体中存放的文件信息
+ */
+int match_stat(struct cache_entry *ce, struct stat *st)
+{
+	unsigned int changed = 0;
+
+	if (ce->mtime.sec  != (unsigned int)st->st_mtim.tv_sec ||
+	    ce->mtime.nsec != (unsigned int)st->st_mtim.tv_nsec)
+		changed |= MTIME_CHANGED;
+	if (ce->ctime.sec  != (unsigned int)st->st_ctim.tv_sec ||
+	    ce->ctime.nsec != (unsigned int)st->st_ctim.tv_nsec)
+		changed |= CTIME_CHANGED;
+	if (ce->st_uid != (unsigned int)st->st_uid ||
+	    ce->st_gid != (unsigned int)st->st_gid)
+		changed |= OWNER_CHANGED;
+	if (ce->st_mode != (unsigned int)st->st_mode)
+		changed |= MODE_CHANGED;
+	if (ce->st_dev != (unsigned int)st->st_dev ||
+	    ce->st_ino != (unsigned int)st->st_ino)
+		changed |= INODE_CHANGED;
+	if (ce->st_size != (unsigned int)st->st_size)
+		changed |= DATA_CHANGED;
+	return changed;
+}
+
+/*
+ * 比较字符串 name1 和 name2
+ */
+int cache_name_compare(const char *name1, int len1, const char *name2, int len2)
+{
+	/* 获取 name1 和 name2 的最小长度 */
+	int len = len1 < len2 ? len1 : len2;
+	int cmp;
+
+	/* 检查最小长度部分 */
+	cmp = memcmp(name1, name2, len);
+	if (cmp)
+		return cmp;
+	/* 名字前面部分一样, 但长度不同的情况 */
+	if (len1 < len2)
+		return -1;
+	if (len1 > len2)
+		return 1;
+	return 0;
+}
+
+/*
+ * 查找目录 name (不包含结尾的 '/', 顶层目录为 "") 的 tree 缓存记录
+ * 找到, 返回 -pos-1; 没有找到, 返回插入位置 pos
+ */
+int cache_tree_pos(const char *name, int namelen)
+{
+	int first = 0, last = tree_nr;
+
+	while (last > first) {
+		int next = (last + first) >> 1;
+		struct cache_tree *ct = active_tree[next];
+		int cmp = cache_name_compare(name, namelen, ct->name, ct->namelen);
+		if (!cmp)
+			return -next-1;
+		if (cmp < 0) {
+			last = next;
+			continue;
+		}
+		first = next+1;
+	}
+	return first;
+}
+
+/* 返回目录 name 有效的 tree 缓存记录, 没有或者已失效时返回 NULL */
+struct cache_tree *cache_tree_lookup(const char *name, int namelen)
+{
+	int pos = cache_tree_pos(name, namelen);
+
+	if (pos >= 0 || active_tree[-pos-1]->entries < 0)
+		return NULL;
+	return active_tree[-pos-1];
+}
+
+/* 更新(或者插入)目录 name 的 tree 缓存记录 */
+void cache_tree_update(const char *name, int namelen, int entries, unsigned char *sha1)
+{
+	int pos = cache_tree_pos(name, namelen);
+	struct cache_tree *ct;
+
+	if (pos < 0) {
+		ct = active_tree[-pos-1];
+		ct->entries = entries;
+		memcpy(ct->sha1, sha1, 20);
+		return;
+	}
+	ct = malloc(cache_tree_size(namelen));
+	memset(ct, 0, cache_tree_size(namelen));
+	ct->entries = entries;
+	memcpy(ct->sha1, sha1, 20);
+	ct->namelen = namelen;
+	memcpy(ct->name, name, namelen);
+	if (tree_nr == tree_alloc) {
+		tree_alloc = alloc_nr(tree_alloc);
+		active_tree = realloc(active_tree, tree_alloc * sizeof(struct cache_tree *));
+	}
+	memmove(active_tree + pos + 1, active_tree + pos, (tree_nr - pos) * sizeof(ct));
+	active_tree[pos] = ct;
+	tree_nr++;
+}
+
+/*
+ * 路径 path 的条目有变化(添加, 修改或删除), 它所在的各级目录缓存的 tree 对象都已失效,
+ * 如 "a/b/c" 会使 "", "a" 和 "a/b" 的记录失效
+ */
+static void invalidate_one(const char *name, int namelen)
+{
+	int pos = cache_tree_pos(name, namelen);
+	if (pos < 0)
+		active_tree[-pos-1]->entries = -1;
+}
+
+void cache_tree_invalidate(const char *path, int len)
+{
+	int i;
+
+	invalidate_one("", 0);
+	for (i = 0; i < len; i++)
+		if (path[i] == '/')
+			invalidate_one(path, i);
+}
+
+/* 解析索引文件中 "TREE" 扩展的数据, 复制到 active_tree[] 中(映射的内存是只读的) */
+static int read_cache_tree(void *data, unsigned long size)
+{
+	unsigned long offset = 0;
+
+	while (offset < size) {
+		struct cache_tree *ct = data + offset, *copy;
+		int len;
+
+		if (size - offset < offsetof(struct cache_tree, name) ||
+		    size - offset < ct_size(ct))
+			return error("corrupt tree cache");
+		len = ct_size(ct);
+		copy = malloc(len);
+		memcpy(copy, ct, len);
+		if (tree_nr == tree_alloc) {
+			tree_alloc = alloc_nr(tree_alloc);
+			active_tree = realloc(active_tree, tree_alloc * sizeof(struct cache_tree *));
+		}
+		active_tree[tree_nr++] = copy;
+		offset += len;
+	}
+	return 0;
+}
+
+/*
+ * 将 cache entry 中的数据写入到 newfd 指定的文件中
+ * 有缓存的 tree 对象时, 在所有 cache entry 之后追加 "TREE" 扩展数据, 同样计入 header 的 sha1
+ */
+int write_cache(int newfd, struct cache_entry **cache, int entries)
+{
+	SHA_CTX c;
+	struct cache_header hdr;
+	struct cache_extension ext;
+	int i;
+
+	hdr.signature = CACHE_SIGNATURE;
+	hdr.version = 1;
+	hdr.entries = entries;
+
+	/* 扩展数据: 所有有效的 tree 缓存记录 */
+	ext.signature = CACHE_TREE_SIGNATURE;
+	ext.size = 0;
+	for (i = 0; i < tree_nr; i++)
+		if (active_tree[i]->entries >= 0)
+			ext.size += ct_size(active_tree[i]);
+
+	/* 计算 cache entry 的哈希值 */
+	SHA1_Init(&c);
+	SHA1_Update(&c, &hdr, offsetof(struct cache_header, sha1));
+	/* 遍历每个 cache entry 条目, 累积计算每个条目的 sha1 */
+	for (i = 0; i < entries; i++) {
+		struct cache_entry *ce = cache[i];
+		int size = ce_size(ce);
+		SHA1_Update(&c, ce, size);
+	}
+	if (ext.size) {
+		SHA1_Update(&c, &ext, sizeof(ext));
+		for (i = 0; i < tree_nr; i++)
+			if (active_tree[i]->entries >= 0)
+				SHA1_Update(&c, active_tree[i], ct_size(active_tree[i]));
+	}
+	/* 最终得到的 sha1 值写入到 hdr.sha1 中 */
+	SHA1_Final(hdr.sha1, &c);
+
+	/* 保存 hdr 数据到 fd */
+	if (write(newfd, &hdr, sizeof(hdr)) != sizeof(hdr))
+		return -1;
+
+	/* 逐条保存 cache entry 条目数据到文件 newfd */
+	for (i = 0; i < entries; i++) {
+		struct cache_entry *ce = cache[i];
+		int size = ce_size(ce);
+		if (write(newfd, ce, size) != size)
+			return -1;
+	}
+	if (!ext.size)
+		return 0;
+	if (write(newfd, &ext, sizeof(ext)) != sizeof(ext))
+		return -1;
+	for (i = 0; i < tree_nr; i++) {
+		struct cache_tree *ct = active_tree[i];
+		int size = ct_size(ct);
+		if (ct->entries >= 0 && write(newfd, ct, size) != size)
+			return -1;
+	}
+	return 0;
+}
+
 /* 读取索引文件".dircache/index", 建立缓存, 返回条目数 */
 int read_cache(void)
 {
@@ -293,6 +1800,8 @@ int read_cache(void)
 	errno = EBUSY;
 	if (active_cache)
 		return error("more than one cachefile");
+	if (read_sparse() < 0)
+		return -1;
 	errno = ENOENT;
 	sha1_file_directory = getenv(DB_ENVIRONMENT);
 	if (!sha1_file_directory)
@@ -311,11 +1820,11 @@ int read_cache(void)
 		map = NULL;
 		size = st.st_size;
 		errno = EINVAL;
-		if (size > sizeof(struct cache_header))
+		if (size >= sizeof(struct cache_header))
 			map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
 	}
 	close(fd);
-	if (-1 == (int)(long)map)
+	if (!map || -1 == (int)(long)map)
 		return error("mmap failed");
 
 	/* 检查映射数据的 header */
@@ -338,6 +1847,17 @@ int read_cache(void)
 		offset = offset + ce_size(ce);
 		active_cache[i] = ce;
 	}
+	/* cache entry 后面是扩展数据, 不认识的扩展直接跳过 */
+	while (offset + sizeof(struct cache_extension) <= size) {
+		struct cache_extension *ext = map + offset;
+		offset += sizeof(*ext);
+		if (ext->size > size - offset)
+			goto unmap;
+		if (ext->signature == CACHE_TREE_SIGNATURE &&
+		    read_cache_tree(map + offset, ext->size) < 0)
+			goto unmap;
+		offset += ext->size;
+	}
 	return active_nr;
 
 unmap:
@@ -1,13 +1,52 @@
 #include "cache.h"
 
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/*
+ * read_index: 将 tree 读入暂存区(-i), 而不是打印
+ * checkout:   同时将文件检出到工作区(-u)
+ */
+static int read_index, checkout;
+
+/* 从 tree 读取的新暂存区条目, 按照 tree 中的顺序(也就是暂存区的顺序)存放 */
+static struct cache_entry **new_cache;
+static int new_nr, new_alloc;
+
+/* 根据 tree 中的一条记录创建 cache entry, 没有 stat 信息 */
+static void add_new_entry(unsigned int mode, const char *base, int baselen, const char *path, unsigned char *sha1)
+{
+	int pathlen = strlen(path), namelen = baselen + pathlen;
+	int size = cache_entry_size(namelen);
+	struct cache_entry *ce = arena_alloc(size);
+
+	memset(ce, 0, size);
+	ce->st_mode = mode;
+	memcpy(ce->sha1, sha1, 20);
+	ce->namelen = namelen;
+	memcpy(ce->name, base, baselen);
+	memcpy(ce->name + baselen, path, pathlen);
+	if (new_nr == new_alloc) {
+		new_alloc = alloc_nr(new_alloc);
+		new_cache = realloc(new_cache, new_alloc * sizeof(struct cache_entry *));
+	}
+	new_cache[new_nr++] = ce;
+}
+
 /*
  * 提取 sha1 值对应 tree 对象, 并显示每一个文件的 mode path sha1 数据
+ * 子目录(mode 为 S_IFDIR)会递归展开, base 为当前 tree 所在目录的路径前缀
+ * 读入暂存区时, 返回该 tree 包含的条目数(包括子目录)
  */
-static int unpack(unsigned char *sha1)
+static int unpack(unsigned char *sha1, const char *base, int baselen)
 {
 	void *buffer;
 	unsigned long size;
 	char type[20];
+	struct tree_desc desc;
+	struct name_entry entry;
+	int entries = 0, ret;
 
 	/* 获取 sha1 值对应的文件内容(解压缩) */
 	buffer = read_sha1_file(sha1, type, &size);
@@ -16,45 +55,393 @@ static int unpack(unsigned char *sha1)
 	/* 检查 sha1 文件数据的类型是否为 tree */
 	if (strcmp(type, "tree"))
 		usage("expected a 'tree' node");
-	while (size) {
-		int len = strlen(buffer)+1;
-		unsigned char *sha1 = buffer + len;
-		/* 查找空格' '字符 */
-		char *path = strchr(buffer, ' ')+1;
-		unsigned int mode;
-		/* 使用 scanf + %o 提取文件的 mode 数据 */
-		if (size < len + 20 || sscanf(buffer, "%o", &mode) != 1)
-			usage("corrupt 'tree' file");
-		buffer = sha1 + 20;
-		size -= len + 20;
+	/* 逐条解析 tree 中的记录, entry 中的 path 和 sha1 直接指向 buffer */
+	init_tree_desc(&desc, buffer, size);
+	while ((ret = tree_entry(&desc, &entry)) > 0) {
+		/* 子目录: 以 "base/path/" 为前缀递归展开 */
+		if (S_ISDIR(entry.mode)) {
+			char *newbase = malloc(baselen + entry.pathlen + 2);
+			memcpy(newbase, base, baselen);
+			memcpy(newbase + baselen, entry.path, entry.pathlen);
+			newbase[baselen + entry.pathlen] = '/';
+			newbase[baselen + entry.pathlen + 1] = 0;
+			entries += unpack((unsigned char *)entry.sha1, newbase, baselen + entry.pathlen + 1);
+			free(newbase);
+			continue;
+		}
+		entries++;
+		if (read_index) {
+			add_new_entry(entry.mode, base, baselen, entry.path, (unsigned char *)entry.sha1);
+			continue;
+		}
 		/* 打印展示 tree 对象中每一条数据的 mode, path, sha1 */
-		printf("%o %s (%s)\n", mode, path, sha1_to_hex(sha1));
+		printf("%o %.*s%s (%s)\n", entry.mode, baselen, base, entry.path, sha1_to_hex((unsigned char *)entry.sha1));
+	}
+	if (ret < 0)
+		usage("corrupt 'tree' file");
+	/* 读入暂存区时, 每个目录的 tree 对象都是已知的, 直接记录到 tree 缓存中 */
+	if (read_index)
+		cache_tree_update(base, baselen ? baselen - 1 : 0, entries, sha1);
+	free(buffer);
+	return entries;
+}
+
+/*
+ * 并行检出文件: 待检出的条目平均分成若干段, 每个线程用 read_sha1_files() 批量读取一段,
+ * 解压 blob 写入工作区, 然后把文件的 stat 信息记录到 cache entry 中.
+ * 每段内按对象文件在磁盘上的位置读取, 而不是按路径名的顺序.
+ */
+#define MAX_CHECKOUT_THREADS 32
+
+static pthread_mutex_t checkout_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct cache_entry **todo;
+static int nr_todo, checkout_errors;
+
+/* 每个线程负责 todo 中 [start, end) 的条目 */
+struct checkout_range {
+	int start, end;
+};
+
+/* 创建 path 的各级父目录, 其他线程可能同时在创建, 已经存在不是错误 */
+static int create_leading_dirs(char *path)
+{
+	char *slash = path;
+
+	while ((slash = strchr(slash, '/')) != NULL) {
+		*slash = 0;
+		if (mkdir(path, 0777) < 0 && errno != EEXIST) {
+			*slash = '/';
+			return -1;
+		}
+		*slash++ = '/';
 	}
 	return 0;
 }
 
+static int checkout_entry(struct cache_entry *ce, const char *type, void *buf, unsigned long size)
+{
+	struct stat st;
+	int fd, ret;
+
+	if (!buf || strcmp(type, "blob"))
+		return -1;
+
+	/* 先删除旧文件, 不会写入到其他硬链接的文件中 */
+	unlink((char *)ce->name);
+	fd = open((char *)ce->name, O_WRONLY | O_CREAT | O_EXCL, (ce->st_mode & 0100) ? 0777 : 0666);
+	if (fd < 0 && errno == ENOENT && !create_leading_dirs((char *)ce->name))
+		fd = open((char *)ce->name, O_WRONLY | O_CREAT | O_EXCL, (ce->st_mode & 0100) ? 0777 : 0666);
+	if (fd < 0) {
+		perror((char *)ce->name);
+		return -1;
+	}
+	ret = write(fd, buf, size) == size ? 0 : -1;
+
+	/* 记录检出后文件的 stat 信息, 之后 show-diff 会认为文件没有变化 */
+	if (!ret && !fstat(fd, &st)) {
+		ce->ctime.sec = st.st_ctime;
+		ce->ctime.nsec = st.st_ctim.tv_nsec;
+		ce->mtime.sec = st.st_mtime;
+		ce->mtime.nsec = st.st_mtim.tv_nsec;
+		ce->st_dev = st.st_dev;
+		ce->st_ino = st.st_ino;
+		ce->st_mode = st.st_mode;
+		ce->st_uid = st.st_uid;
+		ce->st_gid = st.st_gid;
+		ce->st_size = st.st_size;
+	}
+	close(fd);
+	return ret;
+}
+
+/* read_sha1_files() 的回调函数, i 为对象在本段中的下标 */
+static int checkout_object(int i, const char *type, void *buf, unsigned long size, void *data)
+{
+	struct checkout_range *range = data;
+
+	if (checkout_entry(todo[range->start + i], type, buf, size) < 0) {
+		pthread_mutex_lock(&checkout_mutex);
+		checkout_errors++;
+		pthread_mutex_unlock(&checkout_mutex);
+	}
+	return 0;
+}
+
+static void *checkout_thread(void *data)
+{
+	struct checkout_range *range = data;
+	int i, nr = range->end - range->start;
+	unsigned char **sha1s = malloc((nr + 1) * sizeof(unsigned char *));
+
+	for (i = 0; i < nr; i++)
+		sha1s[i] = todo[range->start + i]->sha1;
+	read_sha1_files(sha1s, nr, checkout_object, range);
+	free(sha1s);
+	return NULL;
+}
+
+/* stat 信息不一致时(比如 "read-tree -i" 读入的条目没有 stat 信息)再比较文件内容 */
+static int same_content(struct cache_entry *old, struct stat *st)
+{
+	static struct dircache repo;
+	static struct dircache_handle handle;
+	unsigned char sha1[20];
+	void *map = NULL;
+	int fd, ret;
+
+	if (!S_ISREG(st->st_mode))
+		return 0;
+	if (!repo.object_dir && (dircache_init(&repo, NULL) < 0 || dircache_handle_init(&handle, &repo) < 0))
+		return 0;
+	fd = open((char *)old->name, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (st->st_size)
+		map = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+	ret = dircache_deflate_object(&handle, "blob", map, st->st_size, sha1);
+	if (map)
+		munmap(map, st->st_size);
+	return !ret && !memcmp(sha1, old->sha1, 20);
+}
+
+/* 旧暂存区中是否有 name 这个条目 */
+static int in_old_cache(const char *name, int namelen)
+{
+	int first = 0, last = active_nr;
+
+	while (last > first) {
+		int next = (last + first) >> 1;
+		struct cache_entry *ce = active_cache[next];
+		int cmp = cache_name_compare(name, namelen, ce->name, ce->namelen);
+		if (!cmp)
+			return 1;
+		if (cmp < 0)
+			last = next;
+		else
+			first = next + 1;
+	}
+	return 0;
+}
+
+/*
+ * 新 tree 中的文件 path 在工作区中是一个目录时, 新 tree 中不会有这个目录下的条目,
+ * 所以其中暂存区里的文件都会被删除; 只有这样的文件(没有未跟踪的文件)时, 删除以后目录就空了, 可以写入新文件
+ */
+static int only_removed_files(const char *path)
+{
+	int len = strlen(path), ret = 1;
+	struct dirent *de;
+	DIR *dir = opendir(path);
+
+	if (!dir)
+		return 0;
+	while (ret && (de = readdir(dir)) != NULL) {
+		int namelen = strlen(de->d_name);
+		char *sub;
+		struct stat st;
+
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		sub = malloc(len + namelen + 2);
+		memcpy(sub, path, len);
+		sub[len] = '/';
+		memcpy(sub + len + 1, de->d_name, namelen + 1);
+		if (lstat(sub, &st) < 0)
+			ret = 0;
+		else if (S_ISDIR(st.st_mode))
+			ret = only_removed_files(sub);
+		else
+			ret = in_old_cache(sub, len + namelen + 1) && path_in_sparse(sub, len + namelen + 1);
+		free(sub);
+	}
+	closedir(dir);
+	return ret;
+}
+
+/* 删除文件以后, 依次删除已经空了的上级目录 */
+static void remove_empty_dirs(const char *name)
+{
+	char *path = strdup(name), *slash;
+
+	while ((slash = strrchr(path, '/')) != NULL) {
+		*slash = 0;
+		if (rmdir(path) < 0)
+			break;
+	}
+	free(path);
+}
+
+static int would_lose_changes(struct cache_entry *old, struct cache_entry *ce)
+{
+	const char *name = (char *)(old ? old->name : ce->name);
+	struct stat st;
+
+	if (lstat(name, &st) < 0)
+		return 0;
+	if (!old && S_ISDIR(st.st_mode) && only_removed_files(name))
+		return 0;
+	if (!old)
+		fprintf(stderr, "%s: untracked file would be overwritten\n", name);
+	else if (match_stat(old, &st) && !same_content(old, &st))
+		fprintf(stderr, "%s: has local modifications\n", name);
+	else
+		return 0;
+	return 1;
+}
+
+/*
+ * 检出 new_cache 中的文件, 删除旧暂存区中有而新 tree 中没有的文件, 以及因此空了的目录
+ * 旧暂存区中 sha1 和 mode 相同的条目不需要重新写入, 直接沿用旧的 stat 信息(工作区的修改也保留)
+ * 要删除或者覆盖的文件如果有本地修改(和旧暂存区中的内容不一致), 或者是暂存区中没有的文件,
+ * 不修改工作区中的任何文件, 直接返回 -1
+ */
+static int checkout_files(void)
+{
+	pthread_t threads[MAX_CHECKOUT_THREADS];
+	struct checkout_range ranges[MAX_CHECKOUT_THREADS];
+	struct cache_entry **removed;
+	int i, j, nr_threads, nr_removed = 0, conflicts = 0;
+
+	todo = malloc((new_nr + 1) * sizeof(struct cache_entry *));
+	removed = malloc((active_nr + 1) * sizeof(struct cache_entry *));
+	i = j = 0;
+	while (i < active_nr || j < new_nr) {
+		struct cache_entry *old = i < active_nr ? active_cache[i] : NULL;
+		struct cache_entry *ce = j < new_nr ? new_cache[j] : NULL;
+		int cmp;
+
+		if (!old)
+			cmp = 1;
+		else if (!ce)
+			cmp = -1;
+		else
+			cmp = cache_name_compare(old->name, old->namelen, ce->name, ce->namelen);
+		if (cmp < 0) {
+			/* 新 tree 中已经没有这个文件 */
+			if (path_in_sparse(old->name, old->namelen)) {
+				conflicts += would_lose_changes(old, NULL);
+				removed[nr_removed++] = old;
+			}
+			i++;
+			continue;
+		}
+		if (cmp > 0) {
+			if (path_in_sparse(ce->name, ce->namelen)) {
+				conflicts += would_lose_changes(NULL, ce);
+				todo[nr_todo++] = ce;
+			}
+			j++;
+			continue;
+		}
+		if (path_in_sparse(ce->name, ce->namelen)) {
+			struct stat st;
+			/* 内容没有变化的文件重新写入一次, 更新 stat 信息; 有本地修改的文件保留 */
+			if (!memcmp(old->sha1, ce->sha1, 20) &&
+			    (old->st_mode & 0100) == (ce->st_mode & 0100) &&
+			    !lstat((char *)old->name, &st) &&
+			    (!match_stat(old, &st) || !same_content(old, &st)))
+				memcpy(ce, old, ce_size(old));
+			else {
+				conflicts += would_lose_changes(old, ce);
+				todo[nr_todo++] = ce;
+			}
+		}
+		i++;
+		j++;
+	}
+	if (conflicts) {
+		free(removed);
+		free(todo);
+		return -1;
+	}
+	/* 先删除所有的文件, 再删除空目录, 新 tree 中同名的文件才能写入 */
+	for (i = 0; i < nr_removed; i++)
+		unlink((char *)removed[i]->name);
+	for (i = 0; i < nr_removed; i++)
+		remove_empty_dirs((char *)removed[i]->name);
+	free(removed);
+
+	nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_threads < 1)
+		nr_threads = 1;
+	if (nr_threads > MAX_CHECKOUT_THREADS)
+		nr_threads = MAX_CHECKOUT_THREADS;
+	if (nr_threads > nr_todo)
+		nr_threads = nr_todo;
+	for (i = 0; i < nr_threads; i++) {
+		ranges[i].start = (long)nr_todo * i / nr_threads;
+		ranges[i].end = (long)nr_todo * (i + 1) / nr_threads;
+		pthread_create(&threads[i], NULL, checkout_thread, &ranges[i]);
+	}
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+	free(todo);
+	return checkout_errors ? -1 : 0;
+}
+
 /*
- * 命令: "read-tree <key>"
+ * 命令: "read-tree [-i | -u] <key>"
  * 示例: $ ./read-tree cb8b8e042b2abdf1070f9f60d83f3fb9cbe204ce
+ *
+ * -i: 用 tree 的内容替换暂存区(".dircache/index"), 不修改工作区
+ * -u: 替换暂存区, 并将文件检出到工作区
  */
 int main(int argc, char **argv)
 {
-	int fd;
+	int i, newfd;
 	unsigned char sha1[20];
 
-	if (argc != 2)
-		usage("read-tree <key>");
-	/* 将 argv[1] 的 sha1 字符串转换成 sha1 值 */
-	if (get_sha1_hex(argv[1], sha1) < 0)
-		usage("read-tree <key>");
+	if (argc == 3 && !strcmp(argv[1], "-i"))
+		read_index = 1;
+	else if (argc == 3 && !strcmp(argv[1], "-u"))
+		read_index = checkout = 1;
+	else if (argc != 2)
+		usage("read-tree [-i | -u] <key>");
+	/* 将 sha1 字符串转换成 sha1 值 */
+	if (get_sha1_hex(argv[argc-1], sha1) < 0)
+		usage("read-tree [-i | -u] <key>");
 	/* sha1_file_directory = getenv("SHA1_FILE_DIRECTORY") */
 	sha1_file_directory = getenv(DB_ENVIRONMENT);
 	if (!sha1_file_directory)
 		sha1_file_directory = DEFAULT_DB_ENVIRONMENT;
-	/* 解包并打印 sha1 值对应文件的 mode path sha1 数据 */
-	if (unpack(sha1) < 0)
-		usage("unpack failed");
-	return 0;
+	if (!read_index) {
+		/* 解包并打印 sha1 值对应文件的 mode path sha1 数据 */
+		if (unpack(sha1, "", 0) < 0)
+			usage("unpack failed");
+		return 0;
+	}
+
+	/* 读取旧的暂存区, 检出时用来判断哪些文件需要删除, 哪些文件不需要重新写入 */
+	if (read_cache() < 0) {
+		perror("cache corrupted");
+		return 1;
+	}
+	/* 旧的 tree 缓存全部作废, 由新 tree 重新填充 */
+	for (i = 0; i < tree_nr; i++)
+		free(active_tree[i]);
+	tree_nr = 0;
+	/* unpack() 遇到错误时直接退出, 所以先在内存中展开, 然后才创建 index.lock */
+	unpack(sha1, "", 0);
+	newfd = open(".dircache/index.lock", O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (newfd < 0) {
+		perror("unable to create new cachefile");
+		return 1;
+	}
+	if (checkout && checkout_files() < 0) {
+		fprintf(stderr, "unable to check out all files\n");
+		goto out;
+	}
+	if (!write_cache(newfd, new_cache, new_nr) && !rename(".dircache/index.lock", ".dircache/index")) {
+		arena_release();
+		return 0;
+	}
+out:
+	unlink(".dircache/index.lock");
+	arena_release();
+	return 1;
 }
 
 /* #
@@ -87,4 +474,21 @@ int main(int argc, char **argv)
  * # 5. 使用 read-tree 尝试读取一个 blob 对象 (Makefile 的 blob 对象)
  * git-e83c5163$ ./read-tree b04fb99b9a176ff05e03d5e6e739f0a82b83c56c
  * read-tree: expected a 'tree' node
- */
\ No newline at end of file
+ *
+ * # 6. 使用 read-tree -u 切换到另一个 tree: 替换暂存区, 检出文件并删除新 tree 中没有的文件
+ * git-e83c5163$ ./read-tree -u cb8b8e042b2abdf1070f9f60d83f3fb9cbe204ce
+ * git-e83c5163$ ./show-diff
+ * Makefile: ok
+ * README: ok
+ *
+ * # 7. 检出时批量读取 blob 对象, 设置 DIRCACHE_STATS 可以看到读取的对象数目和速度
+ * git-e83c5163$ DIRCACHE_STATS=1 ./read-tree -u 829c10d96d2f0356ccab7dd65ba38824ec3ab771
+ * read_sha1_files: 1 objects in 0.000 s (1953 objects/s), 3526 bytes read, 8392 bytes inflated
+ * arena: 4 allocs, 320 bytes, 1 mallocs, peak 1048576 bytes
+ *
+ * # 8. 要删除或者覆盖的文件有本地修改时, 不修改工作区和暂存区
+ * git-e83c5163$ echo mod >> README
+ * git-e83c5163$ ./read-tree -u 6e6a9efbf99bafd29c1855788a7ffc7a670972cb
+ * README: has local modifications
+ * unable to check out all files
+ */
@@ -0,0 +1,200 @@
+#include "cache.h"
+
+/*
+ * 列出提交历史
+ *
+ * 从指定的 commit 开始沿 parent 往回遍历, 使用按 committer 时间排序的优先队列,
+ * 每次取出最新的一个 commit 输出, 再把它没有见过(SEEN)的 parent 放入队列.
+ * "A..B" (或者 "^A B") 表示 B 可以到达但 A 不能到达的提交:
+ * A 标记为 UNINTERESTING, 这个标记会沿 parent 传递, 队列中只剩下 UNINTERESTING 的 commit 时就可以停止了.
+ * commit 只在放入队列时解析头部, 提交信息只在 --pretty 时才保留.
+ */
+static int max_count = -1;
+static int pretty;
+
+/* 队列中还没有标记为 UNINTERESTING 的 commit 数目, 为 0 时遍历结束 */
+static int nr_interesting;
+
+static void queue_commit(struct commit_queue *queue, struct commit *commit)
+{
+	if (commit->flags & SEEN)
+		return;
+	commit->flags |= SEEN | IN_QUEUE;
+	if (parse_commit(commit) < 0)
+		usage("bad commit object");
+	if (!(commit->flags & UNINTERESTING))
+		nr_interesting++;
+	commit_queue_put(queue, commit);
+}
+
+/* 标记 commit 为 UNINTERESTING; 已经解析过的各级 parent 也一并标记(不使用递归, 历史可能很长) */
+static void mark_uninteresting(struct commit *commit)
+{
+	struct commit_list *stack = NULL, *list;
+
+	for (;;) {
+		if (!(commit->flags & UNINTERESTING)) {
+			commit->flags |= UNINTERESTING;
+			if (commit->flags & IN_QUEUE)
+				nr_interesting--;
+			if (commit->parsed) {
+				for (list = commit->parents; list; list = list->next) {
+					struct commit_list *item = malloc(sizeof(*item));
+					item->item = list->item;
+					item->next = stack;
+					stack = item;
+				}
+			}
+		}
+		if (!stack)
+			break;
+		list = stack;
+		commit = list->item;
+		stack = list->next;
+		free(list);
+	}
+}
+
+static void show_commit(struct commit *commit)
+{
+	if (!pretty) {
+		printf("%s\n", sha1_to_hex(commit->sha1));
+		return;
+	}
+	printf("commit %s\n", sha1_to_hex(commit->sha1));
+	fwrite(commit->buffer, 1, commit->size, stdout);
+	putchar('\n');
+}
+
+static void add_argument(struct commit_queue *queue, char *arg, int flags)
+{
+	unsigned char sha1[20];
+	struct commit *commit;
+
+	if (strlen(arg) != 40 || get_sha1_hex(arg, sha1))
+		usage("rev-list [--max-count=<n>] [--pretty] <commit>... [^<commit>]... | <commit>..<commit>");
+	commit = lookup_commit(sha1);
+	if (flags)
+		mark_uninteresting(commit);
+	queue_commit(queue, commit);
+}
+
+/*
+ * 命令: "rev-list [--max-count=<n>] [--pretty] <commit>... [^<commit>]... | <commit>..<commit>"
+ * 示例: $ ./rev-list fc4d6681a2878fa9eecadb7efe96d96d8580928c..c82df15b2137ec4a6b7927ce6a3141c5abc20015
+ */
+int main(int argc, char **argv)
+{
+	struct commit_queue queue = { NULL, 0, 0, 0 };
+	struct commit *commit;
+	int i, shown = 0;
+
+	/*
+	 * 先处理所有选项, 再解析 commit 参数:
+	 * --pretty 必须在解析任何 commit 之前设置 save_commit_buffer, 否则排在它前面的 commit 不会保留提交信息
+	 * 处理过的选项在 argv 中置为 NULL
+	 */
+	for (i = 1; i < argc; i++) {
+		char *arg = argv[i];
+
+		if (!strncmp(arg, "--max-count=", 12)) {
+			max_count = atoi(arg + 12);
+			argv[i] = NULL;
+			continue;
+		}
+		if (!strcmp(arg, "-n") && i + 1 < argc) {
+			max_count = atoi(argv[i + 1]);
+			argv[i++] = NULL;
+			argv[i] = NULL;
+			continue;
+		}
+		if (!strcmp(arg, "--pretty")) {
+			pretty = 1;
+			save_commit_buffer = 1;
+			argv[i] = NULL;
+			continue;
+		}
+	}
+
+	for (i = 1; i < argc; i++) {
+		char *arg = argv[i], *dots;
+
+		if (!arg)
+			continue;
+		if (*arg == '^') {
+			add_argument(&queue, arg + 1, UNINTERESTING);
+			continue;
+		}
+		dots = strstr(arg, "..");
+		if (dots) {
+			*dots = 0;
+			add_argument(&queue, arg, UNINTERESTING);
+			add_argument(&queue, dots + 2, 0);
+			continue;
+		}
+		add_argument(&queue, arg, 0);
+	}
+	if (!queue.nr)
+		usage("rev-list [--max-count=<n>] [--pretty] <commit>... [^<commit>]... | <commit>..<commit>");
+
+	while (nr_interesting && shown != max_count && (commit = commit_queue_get(&queue)) != NULL) {
+		struct commit_list *parents;
+
+		commit->flags &= ~IN_QUEUE;
+		if (!(commit->flags & UNINTERESTING))
+			nr_interesting--;
+		for (parents = commit->parents; parents; parents = parents->next) {
+			if (commit->flags & UNINTERESTING)
+				mark_uninteresting(parents->item);
+			queue_commit(&queue, parents->item);
+		}
+		if (commit->flags & UNINTERESTING)
+			continue;
+		show_commit(commit);
+		shown++;
+	}
+	arena_release();
+	return 0;
+}
+
+/* #
+ * # rev-list 使用示例
+ * #
+ *
+ * # 1. 连续提交三次
+ * git-e83c5163$ echo "First Commit!" | ./commit-tree e8b54b68b8afd3aaccc159b0336e0ec2ac2cd8c2
+ * Committing initial tree e8b54b68b8afd3aaccc159b0336e0ec2ac2cd8c2
+ * fc4d6681a2878fa9eecadb7efe96d96d8580928c
+ * git-e83c5163$ echo "Second Commit!" | ./commit-tree 829c10d96d2f0356ccab7dd65ba38824ec3ab771 -p fc4d6681a2878fa9eecadb7efe96d96d8580928c
+ * ea2bc8ba7c383a53df835946a8da7bcbcc0916a6
+ * git-e83c5163$ echo "Third Commit!" | ./commit-tree 6e6a9efbf99bafd29c1855788a7ffc7a670972cb -p ea2bc8ba7c383a53df835946a8da7bcbcc0916a6
+ * c82df15b2137ec4a6b7927ce6a3141c5abc20015
+ *
+ * # 2. 列出从最新提交可以到达的所有提交, 最新的在前
+ * git-e83c5163$ ./rev-list c82df15b2137ec4a6b7927ce6a3141c5abc20015
+ * c82df15b2137ec4a6b7927ce6a3141c5abc20015
+ * ea2bc8ba7c383a53df835946a8da7bcbcc0916a6
+ * fc4d6681a2878fa9eecadb7efe96d96d8580928c
+ *
+ * # 3. 只列出最近的 1 个提交
+ * git-e83c5163$ ./rev-list -n 1 c82df15b2137ec4a6b7927ce6a3141c5abc20015
+ * c82df15b2137ec4a6b7927ce6a3141c5abc20015
+ *
+ * # 4. 第一次提交之后的提交(和 "^fc4d6681... c82df15b..." 相同), 同时显示提交内容
+ * git-e83c5163$ ./rev-list --pretty fc4d6681a2878fa9eecadb7efe96d96d8580928c..c82df15b2137ec4a6b7927ce6a3141c5abc20015
+ * commit c82df15b2137ec4a6b7927ce6a3141c5abc20015
+ * tree 6e6a9efbf99bafd29c1855788a7ffc7a670972cb
+ * parent ea2bc8ba7c383a53df835946a8da7bcbcc0916a6
+ * author guyongqiang <ygu@guyongqiangx> Sun Jul 18 09:00:00 2021
+ * committer root <root@vm> Sun Oct 18 18:12:15 2026
+ *
+ * Third Commit!
+ *
+ * commit ea2bc8ba7c383a53df835946a8da7bcbcc0916a6
+ * tree 829c10d96d2f0356ccab7dd65ba38824ec3ab771
+ * parent fc4d6681a2878fa9eecadb7efe96d96d8580928c
+ * author guyongqiang <ygu@guyongqiangx> Sat Jul 17 18:20:00 2021
+ * committer root <root@vm> Sun Oct 18 18:12:15 2026
+ *
+ * Second Commit!
+ */
\ No newline at end of file
@@ -1,38 +1,5 @@
 #include "cache.h"
 
-#define MTIME_CHANGED	0x0001
-#define CTIME_CHANGED	0x0002
-#define OWNER_CHANGED	0x0004
-#define MODE_CHANGED    0x0008
-#define INODE_CHANGED   0x0010
-#define DATA_CHANGED    0x0020
-
-/*
- * 比较 cache entry 和 stat 结构体中存放的文件信息
- */
-static int match_stat(struct cache_entry *ce, struct stat *st)
-{
-	unsigned int changed = 0;
-
-	if (ce->mtime.sec  != (unsigned int)st->st_mtim.tv_sec ||
-	    ce->mtime.nsec != (unsigned int)st->st_mtim.tv_nsec)
-		changed |= MTIME_CHANGED;
-	if (ce->ctime.sec  != (unsigned int)st->st_ctim.tv_sec ||
-	    ce->ctime.nsec != (unsigned int)st->st_ctim.tv_nsec)
-		changed |= CTIME_CHANGED;
-	if (ce->st_uid != (unsigned int)st->st_uid ||
-	    ce->st_gid != (unsigned int)st->st_gid)
-		changed |= OWNER_CHANGED;
-	if (ce->st_mode != (unsigned int)st->st_mode)
-		changed |= MODE_CHANGED;
-	if (ce->st_dev != (unsigned int)st->st_dev ||
-	    ce->st_ino != (unsigned int)st->st_ino)
-		changed |= INODE_CHANGED;
-	if (ce->st_size != (unsigned int)st->st_size)
-		changed |= DATA_CHANGED;
-	return changed;
-}
-
 /*
  * 比较 old_contents 和 cache entry 条目中对应的文件数据
  */
@@ -52,15 +19,39 @@ static void show_differences(struct cache_entry *ce, struct stat *cur,
 }
 
 /*
- * 命令: "show-diff <file>"
- * 示例: $ ./show-diff Makefile
+ * 输出模式:
+ *   默认: 显示每个文件的状态, 有改动的文件显示 diff 内容
+ *   -z:   只输出有改动的文件路径, 以 '\0' 分隔, 方便脚本解析
+ *   -q:   不输出任何内容, 发现第一个改动后立即退出
+ * 后两种模式只比较 stat 信息, 不会解压任何对象
+ */
+static int name_only = 0, quiet = 0;
+
+/*
+ * 命令: "show-diff [-z | -q]"
+ * 示例: $ ./show-diff
+ *
+ * 返回值: 默认为 0, 使用 -z/-q 时, 工作区有改动返回 1
  */
 int main(int argc, char **argv)
 {
 	/* 读取索引文件".dircache/index"到内存, 建立缓存 */
 	int entries = read_cache();
-	int i;
+	int i, dirty = 0;
 
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-z")) {
+			name_only = 1;
+			continue;
+		}
+		if (!strcmp(argv[i], "-q") || !strcmp(argv[i], "--quiet")) {
+			quiet = 1;
+			continue;
+		}
+		/* 以前的用法 "show-diff <file>" 会忽略文件参数, 这里保持不变 */
+		if (argv[i][0] == '-')
+			usage("show-diff [-z | -q]");
+	}
 	if (entries < 0) {
 		perror("read_cache");
 		exit(1);
@@ -70,20 +61,39 @@ int main(int argc, char **argv)
 		struct stat st;
 		struct cache_entry *ce = active_cache[i];
 		int n, changed;
-		unsigned int mode;
 		unsigned long size;
 		char type[20];
 		void *new;
 
+		/* sparse 范围以外的文件不在工作区中, 不需要 stat */
+		if (!path_in_sparse(ce->name, ce->namelen))
+			continue;
 		/* 提取 cache entry 条目同名的文件信息 */
 		if (stat(ce->name, &st) < 0) {
+			dirty = 1;
+			if (quiet)
+				break;
+			if (name_only) {
+				fwrite(ce->name, ce->namelen + 1, 1, stdout);
+				continue;
+			}
 			printf("%s: %s\n", ce->name, strerror(errno));
 			continue;
 		}
 		/* 将提取的文件信息与 cache entry 条目存储的文件信息, */
 		changed = match_stat(ce, &st);
 		if (!changed) {
-			printf("%s: ok\n", ce->name);
+			if (!quiet && !name_only)
+				printf("%s: ok\n", ce->name);
+			continue;
+		}
+		dirty = 1;
+		/* 只需要知道是否有改动, 发现第一个改动就退出 */
+		if (quiet)
+			break;
+		/* 只输出路径, 包括结尾的 '\0' */
+		if (name_only) {
+			fwrite(ce->name, ce->namelen + 1, 1, stdout);
 			continue;
 		}
 		printf("%.*s:  ", ce->namelen, ce->name);
@@ -96,6 +106,8 @@ int main(int argc, char **argv)
 		show_differences(ce, &st, new, size);
 		free(new);
 	}
+	if (quiet || name_only)
+		return dirty;
 	return 0;
 }
 
@@ -118,4 +130,11 @@ int main(int argc, char **argv)
  *  CFLAGS=-g
  *  CC=gcc
  *
+ * # 3. 只列出有改动的文件路径 ('\0' 分隔), 可以配合 xargs -0 使用
+ * git-e83c5163$ ./show-diff -z | xargs -0 -n1 echo
+ * Makefile
+ *
+ * # 4. 只检查工作区是否有改动, 通过返回值判断
+ * git-e83c5163$ ./show-diff -q || echo dirty
+ * dirty
  */
\ No newline at end of file
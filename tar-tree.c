@@ -0,0 +1,430 @@
+#include "cache.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+/*
+ * 将 tree (或者 commit 对应的 tree) 打包成 tar 格式输出到 stdout, -z 时输出 gzip 压缩后的数据
+ *
+ * 先遍历 tree 得到所有条目(只读取 tree 对象), 然后多个线程按顺序领取 blob 解压,
+ * 主线程严格按 tree 中的顺序写出, 所以输出的顺序是确定的.
+ * 解压线程最多领先 MAX_AHEAD 个条目, 已解压还没有写出的数据不超过 MAX_AHEAD_BYTES
+ * (正在写出的条目除外), 所以占用的内存有上限, 不需要任何临时文件.
+ * 输出 ustar 格式, 路径太长时加一个 pax 扩展头.
+ */
+#define MAX_TAR_THREADS 32
+#define MAX_AHEAD 256
+#define MAX_AHEAD_BYTES (64ul << 20)
+#define RECORDSIZE 10240
+#define OUTBUF_SIZE (1ul << 20)
+
+struct tar_item {
+	char *path;
+	unsigned int mode;
+	unsigned char sha1[20];
+	void *data;
+	unsigned long size;
+	int done;
+};
+
+static struct tar_item *items;
+static int nr_items, alloc_items;
+static int next_inflate, next_write;
+static unsigned long ahead_bytes;
+static pthread_mutex_t tar_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tar_cond = PTHREAD_COND_INITIALIZER;
+
+static unsigned long archive_time;
+
+/* 输出缓冲区, gzip 时先压缩再写出 */
+static int use_gzip;
+static z_stream gz;
+static unsigned char *outbuf;
+static unsigned long outlen, total_written;
+
+static void write_or_die(const void *buf, unsigned long len)
+{
+	const char *p = buf;
+
+	while (len) {
+		ssize_t ret = write(1, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			perror("tar-tree: write");
+			exit(1);
+		}
+		p += ret;
+		len -= ret;
+	}
+}
+
+static void flush_output(int flush)
+{
+	if (!use_gzip) {
+		write_or_die(outbuf, outlen);
+		outlen = 0;
+		return;
+	}
+	gz.next_in = outbuf;
+	gz.avail_in = outlen;
+	do {
+		unsigned char chunk[65536];
+
+		gz.next_out = chunk;
+		gz.avail_out = sizeof(chunk);
+		deflate(&gz, flush);
+		write_or_die(chunk, sizeof(chunk) - gz.avail_out);
+	} while (gz.avail_out == 0 || gz.avail_in);
+	outlen = 0;
+}
+
+static void output(const void *buf, unsigned long len)
+{
+	const char *p = buf;
+
+	total_written += len;
+	while (len) {
+		unsigned long n = OUTBUF_SIZE - outlen;
+		if (n > len)
+			n = len;
+		memcpy(outbuf + outlen, p, n);
+		outlen += n;
+		p += n;
+		len -= n;
+		if (outlen == OUTBUF_SIZE)
+			flush_output(Z_NO_FLUSH);
+	}
+}
+
+/* 补齐到 512 字节 */
+static void output_padding(unsigned long size)
+{
+	static const char zeros[512];
+
+	if (size & 511)
+		output(zeros, 512 - (size & 511));
+}
+
+struct ustar_header {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+};
+
+static void output_header(const char *name, int namelen, const char *prefix, int prefixlen,
+			  char typeflag, unsigned int mode, unsigned long size)
+{
+	struct ustar_header hdr;
+	unsigned int i, sum = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.name, name, namelen);
+	memcpy(hdr.prefix, prefix, prefixlen);
+	sprintf(hdr.mode, "%07o", mode);
+	sprintf(hdr.uid, "%07o", 0);
+	sprintf(hdr.gid, "%07o", 0);
+	sprintf(hdr.size, "%011lo", size);
+	sprintf(hdr.mtime, "%011lo", archive_time);
+	hdr.typeflag = typeflag;
+	memcpy(hdr.magic, "ustar", 6);
+	memcpy(hdr.version, "00", 2);
+	strcpy(hdr.uname, "root");
+	strcpy(hdr.gname, "root");
+	sprintf(hdr.devmajor, "%07o", 0);
+	sprintf(hdr.devminor, "%07o", 0);
+	/* 计算校验和时 chksum 字段当作 8 个空格 */
+	memset(hdr.chksum, ' ', sizeof(hdr.chksum));
+	for (i = 0; i < sizeof(hdr); i++)
+		sum += ((unsigned char *)&hdr)[i];
+	sprintf(hdr.chksum, "%06o", sum);
+	hdr.chksum[7] = ' ';
+	output(&hdr, sizeof(hdr));
+}
+
+/* 写出一个条目的 header: 路径放不下时拆成 prefix/name, 还放不下时使用 pax 扩展头 */
+static void output_entry_header(const char *path, char typeflag, unsigned int mode, unsigned long size)
+{
+	int len = strlen(path), split;
+	char record[64 + 4096];
+	int reclen, digits;
+
+	if (len <= 100) {
+		output_header(path, len, "", 0, typeflag, mode, size);
+		return;
+	}
+	for (split = len - 1; split > 0; split--)
+		if (path[split] == '/' && split <= 155 && len - split - 1 <= 100 && len - split - 1 > 0)
+			break;
+	if (split > 0) {
+		output_header(path + split + 1, len - split - 1, path, split, typeflag, mode, size);
+		return;
+	}
+	/* pax 记录 "<长度> path=<路径>\n", 长度包括自身的位数 */
+	reclen = len + 7;
+	for (digits = 1; ; digits++) {
+		int total = reclen + digits, n = 0;
+		while (total) {
+			n++;
+			total /= 10;
+		}
+		if (n == digits)
+			break;
+	}
+	if (len > 4096) {
+		fprintf(stderr, "tar-tree: path too long: %s\n", path);
+		exit(1);
+	}
+	reclen = sprintf(record, "%d path=%s\n", reclen + digits, path);
+	output_header("pax_header", 10, "", 0, 'x', 0644, reclen);
+	output(record, reclen);
+	output_padding(reclen);
+	output_header(path, 100, "", 0, typeflag, mode, size);
+}
+
+/* 遍历 tree, 收集所有条目(目录也作为一个条目) */
+static void add_item(const char *base, int baselen, const char *path, int pathlen, unsigned int mode, const unsigned char *sha1)
+{
+	struct tar_item *item;
+	int dir = S_ISDIR(mode);
+
+	if (nr_items == alloc_items) {
+		alloc_items = alloc_nr(alloc_items);
+		items = realloc(items, alloc_items * sizeof(struct tar_item));
+	}
+	item = items + nr_items++;
+	memset(item, 0, sizeof(*item));
+	item->path = arena_alloc(baselen + pathlen + 2);
+	memcpy(item->path, base, baselen);
+	memcpy(item->path + baselen, path, pathlen);
+	item->path[baselen + pathlen] = dir ? '/' : 0;
+	item->path[baselen + pathlen + 1] = 0;
+	item->mode = mode;
+	memcpy(item->sha1, sha1, 20);
+	item->done = dir;
+}
+
+static void read_tree_items(const unsigned char *sha1, const char *base, int baselen)
+{
+	struct tree_desc desc;
+	struct name_entry entry;
+	unsigned long size;
+	char type[20];
+	void *buf;
+	int ret;
+
+	buf = read_sha1_file((unsigned char *)sha1, type, &size);
+	if (!buf || strcmp(type, "tree"))
+		usage("tar-tree: unable to read tree object");
+	init_tree_desc(&desc, buf, size);
+	while ((ret = tree_entry(&desc, &entry)) > 0) {
+		add_item(base, baselen, entry.path, entry.pathlen, entry.mode, entry.sha1);
+		if (S_ISDIR(entry.mode)) {
+			char *newbase = items[nr_items - 1].path;
+			read_tree_items(entry.sha1, newbase, baselen + entry.pathlen + 1);
+		}
+	}
+	if (ret < 0)
+		usage("corrupt 'tree' file");
+	free(buf);
+}
+
+/* 解压线程: 按顺序领取条目, 不能领先写出线程太多 */
+static void *inflate_thread(void *data)
+{
+	for (;;) {
+		struct tar_item *item;
+		unsigned long mapsize, size;
+		char type[20];
+		void *map, *buf;
+		int i;
+
+		pthread_mutex_lock(&tar_mutex);
+		while (next_inflate < nr_items && next_inflate > next_write &&
+		       (next_inflate - next_write >= MAX_AHEAD || ahead_bytes >= MAX_AHEAD_BYTES))
+			pthread_cond_wait(&tar_cond, &tar_mutex);
+		/* 目录不需要解压 */
+		while (next_inflate < nr_items && items[next_inflate].done)
+			next_inflate++;
+		i = next_inflate++;
+		if (i >= nr_items) {
+			pthread_mutex_unlock(&tar_mutex);
+			break;
+		}
+		item = items + i;
+		map = map_sha1_file(item->sha1, &mapsize);
+		pthread_mutex_unlock(&tar_mutex);
+
+		buf = map ? unpack_sha1_file(map, mapsize, type, &size) : NULL;
+		if (map)
+			munmap(map, mapsize);
+		if (!buf || strcmp(type, "blob")) {
+			fprintf(stderr, "tar-tree: unable to read blob %s\n", sha1_to_hex(item->sha1));
+			exit(1);
+		}
+
+		pthread_mutex_lock(&tar_mutex);
+		item->data = buf;
+		item->size = size;
+		item->done = 1;
+		ahead_bytes += size;
+		pthread_cond_broadcast(&tar_cond);
+		pthread_mutex_unlock(&tar_mutex);
+	}
+	return NULL;
+}
+
+static void write_archive(void)
+{
+	static const char zeros[1024];
+	int i;
+
+	for (i = 0; i < nr_items; i++) {
+		struct tar_item *item = items + i;
+
+		pthread_mutex_lock(&tar_mutex);
+		while (!item->done)
+			pthread_cond_wait(&tar_cond, &tar_mutex);
+		pthread_mutex_unlock(&tar_mutex);
+
+		if (S_ISDIR(item->mode))
+			output_entry_header(item->path, '5', 0755, 0);
+		else {
+			output_entry_header(item->path, '0', (item->mode & 0100) ? 0755 : 0644, item->size);
+			output(item->data, item->size);
+			output_padding(item->size);
+			free(item->data);
+		}
+
+		pthread_mutex_lock(&tar_mutex);
+		next_write = i + 1;
+		ahead_bytes -= item->size;
+		pthread_cond_broadcast(&tar_cond);
+		pthread_mutex_unlock(&tar_mutex);
+	}
+	/* 结尾是两个全 0 的块, 总长度补齐到 RECORDSIZE */
+	output(zeros, sizeof(zeros));
+	if (total_written % RECORDSIZE) {
+		unsigned long pad = RECORDSIZE - total_written % RECORDSIZE;
+		while (pad) {
+			unsigned long n = pad < sizeof(zeros) ? pad : sizeof(zeros);
+			output(zeros, n);
+			pad -= n;
+		}
+	}
+}
+
+/*
+ * 命令: "tar-tree [-z] <tree-or-commit-sha1> [<prefix>]"
+ * 示例: $ ./tar-tree c82df15b2137ec4a6b7927ce6a3141c5abc20015 release/ > release.tar
+ */
+int main(int argc, char **argv)
+{
+	pthread_t threads[MAX_TAR_THREADS];
+	unsigned char sha1[20];
+	const char *prefix = "";
+	char type[20];
+	unsigned long size;
+	int i, nr_threads;
+
+	if (argc > 1 && !strcmp(argv[1], "-z")) {
+		use_gzip = 1;
+		argv++;
+		argc--;
+	}
+	if (argc < 2 || argc > 3 || get_sha1_hex(argv[1], sha1))
+		usage("tar-tree [-z] <tree-or-commit-sha1> [<prefix>]");
+	if (argc == 3)
+		prefix = argv[2];
+
+	/*
+	 * commit 使用它的 tree 和提交时间, 单独的 tree 没有时间, 固定使用 0 (1970-01-01),
+	 * 这样同一个对象每次打包的输出都完全相同
+	 */
+	if (read_sha1_header(sha1, type, &size) < 0)
+		usage("tar-tree: unable to read object");
+	archive_time = 0;
+	if (!strcmp(type, "commit")) {
+		struct commit *commit = lookup_commit(sha1);
+		if (parse_commit(commit) < 0)
+			usage("tar-tree: bad commit object");
+		memcpy(sha1, commit->tree, 20);
+		if (commit->date)
+			archive_time = commit->date;
+	}
+
+	if (*prefix) {
+		int len = strlen(prefix);
+		if (prefix[len - 1] == '/')
+			len--;
+		add_item("", 0, prefix, len, S_IFDIR, sha1);
+		read_tree_items(sha1, items[0].path, len + 1);
+	} else
+		read_tree_items(sha1, "", 0);
+
+	outbuf = malloc(OUTBUF_SIZE);
+	if (use_gzip && deflateInit2(&gz, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		usage("tar-tree: deflateInit2 failed");
+
+	nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_threads < 1)
+		nr_threads = 1;
+	if (nr_threads > MAX_TAR_THREADS)
+		nr_threads = MAX_TAR_THREADS;
+	for (i = 0; i < nr_threads; i++)
+		pthread_create(&threads[i], NULL, inflate_thread, NULL);
+	write_archive();
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	flush_output(use_gzip ? Z_FINISH : Z_NO_FLUSH);
+	if (use_gzip)
+		deflateEnd(&gz);
+	arena_release();
+	return 0;
+}
+
+/* #
+ * # tar-tree 使用示例
+ * #
+ *
+ * # 1. 打包 rev-list 示例中第三次提交的 tree, 所有文件放在 release/ 目录下, 时间为提交时间
+ * git-e83c5163$ ./tar-tree c82df15b2137ec4a6b7927ce6a3141c5abc20015 release/ > release.tar
+ * git-e83c5163$ tar tvf release.tar
+ * drwxr-xr-x root/root         0 2026-10-18 18:12 release/
+ * -rw-r--r-- root/root      1099 2026-10-18 18:12 release/Makefile
+ * drwxr-xr-x root/root         0 2026-10-18 18:12 release/images/
+ * -rw-r--r-- root/root    108221 2026-10-18 18:12 release/images/commit-vs-tree-vs-blob.png
+ * -rw-r--r-- root/root    176538 2026-10-18 18:12 release/images/index.png
+ * drwxr-xr-x root/root         0 2026-10-18 18:12 release/images/sub/
+ * -rw-r--r-- root/root         2 2026-10-18 18:12 release/images/sub/z
+ *
+ * # 2. 使用 -z 直接输出 .tar.gz
+ * git-e83c5163$ ./tar-tree -z c82df15b2137ec4a6b7927ce6a3141c5abc20015 release/ | tar tzf - | head -3
+ * release/
+ * release/Makefile
+ * release/images/
+ *
+ * # 3. 直接打包 tree 时没有提交时间, 使用固定的 0, 多次打包的输出完全相同
+ * git-e83c5163$ ./tar-tree 6e6a9efbf99bafd29c1855788a7ffc7a670972cb | TZ=UTC tar tvf - | head -2
+ * -rw-r--r-- root/root      1099 1970-01-01 00:00 Makefile
+ * drwxr-xr-x root/root         0 1970-01-01 00:00 images/
+ * git-e83c5163$ ./tar-tree -z 6e6a9efbf99bafd29c1855788a7ffc7a670972cb | md5sum
+ * 97a9f2773d9b665481c7f08c4b17aa8a  -
+ * git-e83c5163$ ./tar-tree -z 6e6a9efbf99bafd29c1855788a7ffc7a670972cb | md5sum
+ * 97a9f2773d9b665481c7f08c4b17aa8a  -
+ */
\ No newline at end of file
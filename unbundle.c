@@ -0,0 +1,391 @@
+#define _GNU_SOURCE	/* syncfs() */
+#include "cache.h"
+
+#include <unistd.h>
+#include <sys/time.h>
+
+/*
+ * 把 bundle 文件(格式见 cache.h, 由 bundle 生成)中的对象导入到对象库
+ *
+ * 先检查接收方是否已经有文件头中列出的边界 commit, 缺少任何一个都不写入对象.
+ * bundle 文件从头到尾顺序读取(可以是管道), 每个对象先检查 sha1, 再写入临时文件 tmp_<pid>_xxx,
+ * 已经存在(包括在备用对象目录中)的对象只更新修改时间.
+ * 临时文件积累到 BATCH_OBJECTS 个或者 BATCH_BYTES 字节时调用一次 syncfs() 写入磁盘, 然后再改名,
+ * 所以任何时候断电, 对象目录中都不会出现内容不完整的对象, 而 fsync 的次数只有对象数的几千分之一.
+ * 最后再 syncfs() 一次, 保证改名也写入了磁盘.
+ *
+ * 每个对象都单独检查过 sha1, 所以文件末尾的校验和不对(或者文件不完整)时, 已经写入的对象仍然是正确的,
+ * 只是 bundle 中的 commit 可能不完整, 这时返回 1, 不输出 commit.
+ */
+#define BATCH_OBJECTS	(4096)
+#define BATCH_BYTES	(64ul << 20)
+
+#define FSYNC_NONE	0
+#define FSYNC_BATCH	1
+#define FSYNC_OBJECT	2
+
+static struct dircache repo;
+static int fsync_mode = FSYNC_BATCH, verify_only;
+static unsigned long nr_objects, nr_written, nr_present, nr_syncs, bytes_read;
+
+static unsigned char (*tips)[20];
+static int tips_nr, tips_alloc;
+
+/* 已经写入临时文件, 等待 syncfs() 以后改名的对象 */
+static unsigned char (*batch)[20];
+static unsigned long batch_nr, batch_alloc, batch_bytes;
+static char tmp_prefix[32];
+
+static void flush_batch(void);
+
+/* 已经检查过的对象都是正确的, 退出之前把它们写完 */
+static void die(const char *fmt, const char *arg)
+{
+	flush_batch();
+	fprintf(stderr, "unbundle: ");
+	fprintf(stderr, fmt, arg);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+/*
+ * 读取 bundle: 数据先读到 input 中, 读取的内容(除了最后的校验和)同时计算 sha1
+ */
+static char input[1 << 20];
+static unsigned long input_pos, input_len;
+static int input_fd;
+static SHA_CTX input_ctx;
+
+static int fill_input(void)
+{
+	ssize_t ret;
+
+	input_pos = 0;
+	do {
+		ret = read(input_fd, input, sizeof(input));
+	} while (ret < 0 && errno == EINTR);
+	if (ret <= 0) {
+		input_len = 0;
+		return 0;
+	}
+	input_len = ret;
+	return 1;
+}
+
+static void read_bundle(void *buf, unsigned long len, int checksum)
+{
+	while (len) {
+		unsigned long n = input_len - input_pos;
+
+		if (!n) {
+			if (!fill_input())
+				die("%s", "unexpected end of bundle");
+			continue;
+		}
+		if (n > len)
+			n = len;
+		memcpy(buf, input + input_pos, n);
+		if (checksum)
+			SHA1_Update(&input_ctx, input + input_pos, n);
+		input_pos += n;
+		bytes_read += n;
+		buf = (char *)buf + n;
+		len -= n;
+	}
+}
+
+/* 读取文件头中的一行(去掉结尾的 '\n') */
+static char *read_header_line(void)
+{
+	static char line[100];
+	int len = 0;
+
+	for (;;) {
+		read_bundle(line + len, 1, 1);
+		if (line[len] == '\n')
+			break;
+		if (++len == sizeof(line))
+			die("%s", "bad bundle header");
+	}
+	line[len] = 0;
+	return line;
+}
+
+/*
+ * 写入对象
+ */
+static int fanout_fd[256];
+
+static int open_fanout(int n)
+{
+	char path[PATH_MAX];
+
+	if (!fanout_fd[n]) {
+		snprintf(path, sizeof(path), "%s/%02x", repo.object_dir, n);
+		fanout_fd[n] = open(path, O_RDONLY | O_DIRECTORY);
+		if (fanout_fd[n] < 0)
+			die("unable to open %s", path);
+	}
+	return fanout_fd[n];
+}
+
+/* 对象的文件名(目录 xx 中的 38 个字符)和临时文件名 */
+static void object_names(const unsigned char *sha1, char *name, char *tmp)
+{
+	char hex[41];
+
+	dircache_sha1_to_hex(sha1, hex);
+	strcpy(name, hex + 2);
+	sprintf(tmp, "%s%s", tmp_prefix, hex + 2);
+}
+
+static void rename_object(const unsigned char *sha1)
+{
+	char name[39], tmp[80];
+	int dir = open_fanout(sha1[0]);
+
+	object_names(sha1, name, tmp);
+	if (renameat(dir, tmp, dir, name) < 0) {
+		unlinkat(dir, tmp, 0);
+		die("unable to rename object %s", sha1_to_hex((unsigned char *)sha1));
+	}
+}
+
+/* 一次 syncfs() 把这一批临时文件都写入磁盘, 然后改名 */
+static void flush_batch(void)
+{
+	unsigned long i, nr = batch_nr;
+
+	if (!nr)
+		return;
+	/* rename_object() 失败时 die() 会再次调用 flush_batch() */
+	batch_nr = 0;
+	batch_bytes = 0;
+	if (syncfs(open_fanout(batch[0][0])) < 0)
+		die("%s", "syncfs failed");
+	nr_syncs++;
+	for (i = 0; i < nr; i++)
+		rename_object(batch[i]);
+}
+
+static void write_object(const unsigned char *sha1, const void *buf, unsigned long len)
+{
+	char name[39], tmp[80];
+	int fd, dir = open_fanout(sha1[0]);
+
+	object_names(sha1, name, tmp);
+	/* 已经存在的对象只更新修改时间, 避免被 prune-cache 删除 */
+	if (!utimensat(dir, name, NULL, 0) ||
+	    (errno == ENOENT && repo.nr_alternates && dircache_has_object(&repo, sha1))) {
+		nr_present++;
+		return;
+	}
+	fd = openat(dir, tmp, O_WRONLY | O_CREAT | O_EXCL, 0444);
+	if (fd < 0) {
+		/* 同一个对象已经在这一批中 */
+		if (errno == EEXIST) {
+			nr_present++;
+			return;
+		}
+		die("unable to create object %s", sha1_to_hex((unsigned char *)sha1));
+	}
+	if (write_in_full(fd, buf, len) < 0 ||
+	    (fsync_mode == FSYNC_OBJECT && fsync(fd) < 0) || close(fd) < 0) {
+		unlinkat(dir, tmp, 0);
+		die("unable to write object %s", sha1_to_hex((unsigned char *)sha1));
+	}
+	nr_written++;
+	if (fsync_mode != FSYNC_BATCH) {
+		rename_object(sha1);
+		/* 每个对象都 fsync 一次文件和目录 */
+		if (fsync_mode == FSYNC_OBJECT) {
+			if (fsync(dir) < 0)
+				die("%s", "fsync failed");
+			nr_syncs += 2;
+		}
+		return;
+	}
+	if (batch_nr == batch_alloc) {
+		batch_alloc = alloc_nr(batch_alloc);
+		batch = realloc(batch, batch_alloc * 20);
+	}
+	memcpy(batch[batch_nr++], sha1, 20);
+	batch_bytes += len;
+	if (batch_nr >= BATCH_OBJECTS || batch_bytes >= BATCH_BYTES)
+		flush_batch();
+}
+
+/* 读取文件头, 返回对象数目; 缺少边界 commit 时退出 */
+static unsigned long read_header(void)
+{
+	unsigned char sha1[20];
+	unsigned long nr;
+	int missing = 0;
+	char *line, *end;
+
+	line = read_header_line();
+	if (strcmp(line, "# dircache bundle v1"))
+		die("%s", "not a bundle file");
+	for (;;) {
+		line = read_header_line();
+		if (!strncmp(line, "objects ", 8)) {
+			nr = strtoul(line + 8, &end, 10);
+			if (*end)
+				die("%s", "bad bundle header");
+			break;
+		}
+		if (*line == '-') {
+			if (get_sha1_hex(line + 1, sha1) || line[41])
+				die("%s", "bad bundle header");
+			if (!dircache_has_object(&repo, sha1)) {
+				fprintf(stderr, "unbundle: missing prerequisite commit %s\n", line + 1);
+				missing++;
+			}
+			continue;
+		}
+		if (get_sha1_hex(line, sha1) || line[40])
+			die("%s", "bad bundle header");
+		if (tips_nr == tips_alloc) {
+			tips_alloc = alloc_nr(tips_alloc);
+			tips = realloc(tips, tips_alloc * 20);
+		}
+		memcpy(tips[tips_nr++], sha1, 20);
+	}
+	if (missing)
+		die("%s", "this object store does not have the commits the bundle is based on, nothing written");
+	return nr;
+}
+
+/*
+ * 命令: "unbundle [--verify] [--fsync=<batch|object|none>] [<file>]"
+ * 示例: $ ./unbundle update.bundle
+ *
+ * 没有 file 或者 file 为 "-" 时从 stdin 读取; 成功后在 stdout 输出 bundle 中的 commit
+ * --verify: 只检查边界 commit, 对象的 sha1 和校验和, 不写入对象
+ * --fsync: batch (默认) 每批临时文件 syncfs() 一次; object 每个对象 fsync 文件和目录; none 不写入磁盘
+ */
+int main(int argc, char **argv)
+{
+	struct dircache_buffer buf = { NULL, 0, 0 };
+	unsigned char sha1[20], real[20], len[4];
+	unsigned long i, nr, size, usec;
+	struct timeval start, end;
+	SHA_CTX c;
+	int j;
+
+	for (j = 1; j < argc && argv[j][0] == '-' && argv[j][1]; j++) {
+		if (!strcmp(argv[j], "--verify")) {
+			verify_only = 1;
+			continue;
+		}
+		if (!strcmp(argv[j], "--fsync=batch")) {
+			fsync_mode = FSYNC_BATCH;
+			continue;
+		}
+		if (!strcmp(argv[j], "--fsync=object")) {
+			fsync_mode = FSYNC_OBJECT;
+			continue;
+		}
+		if (!strcmp(argv[j], "--fsync=none")) {
+			fsync_mode = FSYNC_NONE;
+			continue;
+		}
+		usage("unbundle [--verify] [--fsync=<batch|object|none>] [<file>]");
+	}
+	if (j < argc - 1)
+		usage("unbundle [--verify] [--fsync=<batch|object|none>] [<file>]");
+	if (j < argc && strcmp(argv[j], "-")) {
+		input_fd = open(argv[j], O_RDONLY);
+		if (input_fd < 0)
+			die("unable to open %s", argv[j]);
+	}
+	gettimeofday(&start, NULL);
+	if (dircache_init(&repo, NULL) < 0)
+		die("%s", "out of memory");
+	sprintf(tmp_prefix, "tmp_%d_", (int)getpid());
+	SHA1_Init(&input_ctx);
+
+	nr = read_header();
+	for (i = 0; i < nr; i++) {
+		read_bundle(sha1, 20, 1);
+		read_bundle(len, 4, 1);
+		size = (unsigned long)len[0] << 24 | len[1] << 16 | len[2] << 8 | len[3];
+		if (dircache_buffer_grow(&buf, size) < 0)
+			die("%s", "out of memory");
+		read_bundle(buf.buf, size, 1);
+		SHA1_Init(&c);
+		SHA1_Update(&c, buf.buf, size);
+		SHA1_Final(real, &c);
+		if (memcmp(real, sha1, 20))
+			die("corrupt object %s in bundle", sha1_to_hex(sha1));
+		nr_objects++;
+		if (!verify_only)
+			write_object(sha1, buf.buf, size);
+	}
+	flush_batch();
+	/* 改名也要写入磁盘 */
+	if (fsync_mode != FSYNC_NONE && nr_written) {
+		if (syncfs(open_fanout(0)) < 0)
+			die("%s", "syncfs failed");
+		nr_syncs++;
+	}
+
+	SHA1_Final(real, &input_ctx);
+	read_bundle(sha1, 20, 0);
+	if (memcmp(real, sha1, 20))
+		die("%s", "bundle checksum mismatch");
+	if (input_pos < input_len || fill_input())
+		die("%s", "garbage at end of bundle");
+
+	for (j = 0; j < tips_nr; j++)
+		printf("%s\n", sha1_to_hex(tips[j]));
+	gettimeofday(&end, NULL);
+	usec = (end.tv_sec - start.tv_sec) * 1000000 + end.tv_usec - start.tv_usec;
+	fflush(stdout);
+	fprintf(stderr, "%lu objects, %s %lu, already present %lu, %lu KB in %lu.%03lu s, %lu syncs\n",
+		nr_objects, verify_only ? "verified" : "written", verify_only ? nr_objects : nr_written,
+		nr_present, bytes_read >> 10, usec / 1000000, usec / 1000 % 1000, nr_syncs);
+	return 0;
+}
+
+/* #
+ * # unbundle 使用示例
+ * #
+ *
+ * # 1. 在一个用 init-db 新建的空工作区中导入, 还没有第一次提交时不能导入 update.bundle
+ * git-e83c5163$ ./unbundle /tmp/update.bundle
+ * unbundle: missing prerequisite commit fc4d6681a2878fa9eecadb7efe96d96d8580928c
+ * unbundle: this object store does not have the commits the bundle is based on, nothing written
+ *
+ * # 2. 按顺序导入, 输出 bundle 中的 commit
+ * git-e83c5163$ ./unbundle /tmp/first.bundle
+ * fc4d6681a2878fa9eecadb7efe96d96d8580928c
+ * 6 objects, written 6, already present 0, 108 KB in 0.023 s, 2 syncs
+ * git-e83c5163$ ./unbundle /tmp/update.bundle
+ * c82df15b2137ec4a6b7927ce6a3141c5abc20015
+ * 10 objects, written 10, already present 0, 171 KB in 0.006 s, 2 syncs
+ * git-e83c5163$ ./rev-list c82df15b2137ec4a6b7927ce6a3141c5abc20015
+ * c82df15b2137ec4a6b7927ce6a3141c5abc20015
+ * ea2bc8ba7c383a53df835946a8da7bcbcc0916a6
+ * fc4d6681a2878fa9eecadb7efe96d96d8580928c
+ *
+ * # 3. 再导入一次, 对象都已经存在, 不需要写入
+ * git-e83c5163$ ./unbundle < /tmp/update.bundle
+ * c82df15b2137ec4a6b7927ce6a3141c5abc20015
+ * 10 objects, written 0, already present 10, 171 KB in 0.000 s, 0 syncs
+ *
+ * # 4. 在已经导入 fast-import 前 10001 个 commit 的工作区中, 检查 bundle 示例 3 中 inc.bundle 损坏的副本,
+ * #    --verify 只检查不写入, 导入时也不会写入损坏的对象
+ * git-e83c5163$ ./unbundle --verify /tmp/corrupt.bundle
+ * unbundle: corrupt object 807c7c30e5551effb805a376e36fcb0bb8436789 in bundle
+ * git-e83c5163$ ./unbundle --verify /tmp/badsum.bundle
+ * unbundle: bundle checksum mismatch
+ *
+ * # 5. 导入 inc.bundle 的 50000 个对象(ext4), 默认每批 syncfs() 一次, 和每个对象都 fsync 比较(另一个同样的工作区)
+ * git-e83c5163$ ./unbundle /tmp/inc.bundle
+ * 7125ecc424e03150ec32ac89fa3fc226bc74e862
+ * 50000 objects, written 50000, already present 0, 23459 KB in 2.117 s, 14 syncs
+ * git-e83c5163$ ./unbundle --fsync=object /tmp/inc.bundle
+ * 7125ecc424e03150ec32ac89fa3fc226bc74e862
+ * 50000 objects, written 50000, already present 0, 23459 KB in 12.338 s, 100001 syncs
+ */
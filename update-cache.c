@@ -1,25 +1,9 @@
 #include "cache.h"
 
-/*
- * 比较字符串 name1 和 name2
- */
-static int cache_name_compare(const char *name1, int len1, const char *name2, int len2)
-{
-	/* 获取 name1 和 name2 的最小长度 */
-	int len = len1 < len2 ? len1 : len2;
-	int cmp;
-
-	/* 检查最小长度部分 */
-	cmp = memcmp(name1, name2, len);
-	if (cmp)
-		return cmp;
-	/* 名字前面部分一样, 但长度不同的情况 */
-	if (len1 < len2)
-		return -1;
-	if (len1 > len2)
-		return 1;
-	return 0;
-}
+#include <dirent.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <unistd.h>
 
 /*
  * 根据文件名 name, 使用二分查找其在 cache entry 中的位置
@@ -56,12 +40,15 @@ static int remove_file_from_cache(char *path)
 	int pos = cache_name_pos(path, strlen(path));
 	if (pos < 0) {
 		pos = -pos-1;
+		/* 所在各级目录缓存的 tree 对象已经失效 */
+		cache_tree_invalidate(path, strlen(path));
 		active_nr--;
 		if (pos < active_nr)
 			/* 移动后面所有 cache entry 条目的内存 */
 			/* 问题: 每一条 cache_entry 的内容是变长的, 怎么计算总长度? */
-			memmove(active_cache + pos, active_cache + pos + 1, (active_nr - pos - 1) * sizeof(struct cache_entry *));
+			memmove(active_cache + pos, active_cache + pos + 1, (active_nr - pos) * sizeof(struct cache_entry *));
 	}
+	return 0;
 }
 
 /*
@@ -74,6 +61,9 @@ static int add_cache_entry(struct cache_entry *ce)
 	/* 使用二分法根据文件名查找 cache entry 中对应条目的位置, 找到了则得到其位置的 -pos, 没找到, 则返回插入该条目应该在的位置 pos */
 	pos = cache_name_pos(ce->name, ce->namelen);
 
+	/* 所在各级目录缓存的 tree 对象已经失效 */
+	cache_tree_invalidate(ce->name, ce->namelen);
+
 	/* existing match? Just replace it */
 	/* 找到条目, 则直接更新该信息, 然后返回 */
 	if (pos < 0) {
@@ -113,16 +103,26 @@ static int add_cache_entry(struct cache_entry *ce)
 static int index_fd(const char *path, int namelen, struct cache_entry *ce, int fd, struct stat *st)
 {
 	z_stream stream;
-	int max_out_bytes = namelen + st->st_size + 200;
-	void *out = malloc(max_out_bytes);
-	void *metadata = malloc(namelen + 200);
-	/* 将 fd 指定的文件映射到内存 */
-	void *in = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	int ret, max_out_bytes = namelen + st->st_size + 200;
+	struct arena_mark mark;
+	void *out, *metadata;
+	/* 将 fd 指定的文件映射到内存, 空文件不能 mmap */
+	void *in = st->st_size ? mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
 	SHA_CTX c;
 
 	close(fd);
-	if (!out || (int)(long)in == -1)
+	if ((int)(long)in == -1)
 		return -1;
+	/* out 和 metadata 只在这里临时使用, 从 arena 中分配, 结束时回退 */
+	arena_mark(&mark);
+	out = arena_alloc(max_out_bytes);
+	metadata = arena_alloc(namelen + 200);
+	if (!out || !metadata) {
+		if (in)
+			munmap(in, st->st_size);
+		arena_rewind(&mark);
+		return -1;
+	}
 
 	/* 压缩文件数据 */
 	memset(&stream, 0, sizeof(stream));
@@ -147,6 +147,8 @@ static int index_fd(const char *path, int namelen, struct cache_entry *ce, int f
 		/*nothing */;
 
 	deflateEnd(&stream);
+	if (in)
+		munmap(in, st->st_size);
 	
 	/* 计算压缩数据的SHA1哈希值 */
 	SHA1_Init(&c);
@@ -154,7 +156,9 @@ static int index_fd(const char *path, int namelen, struct cache_entry *ce, int f
 	SHA1_Final(ce->sha1, &c);
 
 	/* 将压缩数据写入到 sha1 值对应的文件中 */
-	return write_sha1_buffer(ce->sha1, out, stream.total_out);
+	ret = write_sha1_buffer(ce->sha1, out, stream.total_out);
+	arena_rewind(&mark);
+	return ret;
 }
 
 /*
@@ -193,7 +197,12 @@ static int add_file_to_cache(char *path)
 	/* 分配 cache entry 条目, 用于存放文件信息 */
 	namelen = strlen(path);
 	size = cache_entry_size(namelen);
-	ce = malloc(size);
+	/* cache entry 一直使用到写入索引文件, 从 arena 中分配, 运行结束时统一释放 */
+	ce = arena_alloc(size);
+	if (!ce) {
+		close(fd);
+		return -1;
+	}
 	memset(ce, 0, size);
 	memcpy(ce->name, path, namelen);
 	ce->ctime.sec = st.st_ctime;
@@ -216,45 +225,6 @@ static int add_file_to_cache(char *path)
 	return add_cache_entry(ce);
 }
 
-/*
- * 将 cache entry 中的数据写入到 newfd 指定的文件中
- */
-static int write_cache(int newfd, struct cache_entry **cache, int entries)
-{
-	SHA_CTX c;
-	struct cache_header hdr;
-	int i;
-
-	hdr.signature = CACHE_SIGNATURE;
-	hdr.version = 1;
-	hdr.entries = entries;
-
-	/* 计算 cache entry 的哈希值 */
-	SHA1_Init(&c);
-	SHA1_Update(&c, &hdr, offsetof(struct cache_header, sha1));
-	/* 遍历每个 cache entry 条目, 累积计算每个条目的 sha1 */
-	for (i = 0; i < entries; i++) {
-		struct cache_entry *ce = cache[i];
-		int size = ce_size(ce);
-		SHA1_Update(&c, ce, size);
-	}
-	/* 最终得到的 sha1 值写入到 hdr.sha1 中 */
-	SHA1_Final(hdr.sha1, &c);
-
-	/* 保存 hdr 数据到 fd */
-	if (write(newfd, &hdr, sizeof(hdr)) != sizeof(hdr))
-		return -1;
-
-	/* 逐条保存 cache entry 条目数据到文件 newfd */
-	for (i = 0; i < entries; i++) {
-		struct cache_entry *ce = cache[i];
-		int size = ce_size(ce);
-		if (write(newfd, ce, size) != size)
-			return -1;
-	}
-	return 0;
-}		
-
 /*
  * We fundamentally don't like some paths: we don't want
  * dot or dot-dot anywhere, and in fact, we don't even want
@@ -287,8 +257,393 @@ inside:
 }
 
 /*
- * "update-cache <file>"
+ * 目录模式 "update-cache -r <dir>..." 使用的数据结构
+ *
+ * 多个线程从共享的目录栈中取出目录, 使用 openat/fdopendir 读取目录项,
+ * 子目录压回栈中, 普通文件记录到各线程自己的 found 列表中.
+ * 遍历结束后合并所有列表并排序, 再和已经排好序的 active_cache 做一次归并比较:
+ *   只在列表中   -> 新文件, 添加 (匹配 ".dircache/ignore" 的新文件不添加)
+ *   只在暂存区中 -> 文件已删除, 从暂存区移除
+ *   两边都有     -> match_stat() 有变化时重新添加
+ * 不能读取的目录, stat 失败的文件, 以及被忽略的目录记录在 kept 列表中,
+ * 没有看到它们的内容不等于文件被删除了, 其中已经在暂存区中的条目保持不变.
+ */
+#define MAX_WALK_THREADS 32
+
+struct found_file {
+	char *path;
+	struct stat st;
+	int ignored;
+};
+
+struct walk_thread {
+	pthread_t thread;
+	struct found_file *found;
+	int nr, alloc;
+	char **kept;
+	int kept_nr, kept_alloc;
+};
+
+static pthread_mutex_t walk_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t walk_cond = PTHREAD_COND_INITIALIZER;
+/* 待读取的目录栈, walk_busy 为正在读取目录的线程数, 栈空且 walk_busy 为 0 时遍历结束 */
+static char **walk_dirs;
+static int walk_nr, walk_alloc, walk_busy;
+
+/* ".dircache/ignore" 中的忽略模式, 使用 fnmatch 匹配文件名或者完整路径 */
+static char **ignore_pattern;
+static int ignore_nr;
+
+static void read_ignore(void)
+{
+	char line[1024];
+	FILE *f = fopen(".dircache/ignore", "r");
+	int alloc = 0;
+
+	if (!f)
+		return;
+	while (fgets(line, sizeof(line), f)) {
+		int len = strlen(line);
+		while (len && line[len-1] == '\n')
+			line[--len] = 0;
+		if (!len || line[0] == '#')
+			continue;
+		if (ignore_nr == alloc) {
+			alloc = alloc_nr(alloc);
+			ignore_pattern = realloc(ignore_pattern, alloc * sizeof(char *));
+		}
+		ignore_pattern[ignore_nr++] = strdup(line);
+	}
+	fclose(f);
+}
+
+static int is_ignored(const char *path, const char *name)
+{
+	int i;
+
+	for (i = 0; i < ignore_nr; i++) {
+		if (!fnmatch(ignore_pattern[i], name, 0) ||
+		    !fnmatch(ignore_pattern[i], path, FNM_PATHNAME))
+			return 1;
+	}
+	return 0;
+}
+
+/* 调用时需要持有 walk_mutex */
+static void push_dir(char *path)
+{
+	if (walk_nr == walk_alloc) {
+		walk_alloc = alloc_nr(walk_alloc);
+		walk_dirs = realloc(walk_dirs, walk_alloc * sizeof(char *));
+	}
+	walk_dirs[walk_nr++] = path;
+	pthread_cond_signal(&walk_cond);
+}
+
+static void add_found(struct walk_thread *wt, char *path, struct stat *st, int ignored)
+{
+	if (wt->nr == wt->alloc) {
+		wt->alloc = alloc_nr(wt->alloc);
+		wt->found = realloc(wt->found, wt->alloc * sizeof(struct found_file));
+	}
+	wt->found[wt->nr].path = path;
+	wt->found[wt->nr].st = *st;
+	wt->found[wt->nr].ignored = ignored;
+	wt->nr++;
+}
+
+/* path 及其下面的条目没有遍历到, 暂存区中对应的条目不能删除 */
+static void add_kept(struct walk_thread *wt, char *path)
+{
+	if (wt->kept_nr == wt->kept_alloc) {
+		wt->kept_alloc = alloc_nr(wt->kept_alloc);
+		wt->kept = realloc(wt->kept, wt->kept_alloc * sizeof(char *));
+	}
+	wt->kept[wt->kept_nr++] = path;
+}
+
+/*
+ * 读取目录 dir ("" 表示当前目录) 下的所有目录项
+ * 以 '.' 开头的文件和目录(包括 ".dircache")同 verify_path() 一样直接跳过
+ * 目录或者文件已经不存在(ENOENT/ENOTDIR)说明被删除了, 其他错误记录到 kept 列表
+ */
+static void read_one_dir(struct walk_thread *wt, char *dir)
+{
+	int len = strlen(dir);
+	int fd = openat(AT_FDCWD, len ? dir : ".", O_RDONLY | O_DIRECTORY);
+	struct dirent *de;
+	DIR *d;
+
+	if (fd < 0 || !(d = fdopendir(fd))) {
+		int err = errno;
+
+		if (fd >= 0)
+			close(fd);
+		if (err == ENOENT || err == ENOTDIR)
+			return;
+		fprintf(stderr, "unable to read directory %s, keeping its entries\n", len ? dir : ".");
+		add_kept(wt, strdup(dir));
+		return;
+	}
+	for (;;) {
+		struct stat st;
+		char *path;
+		int namelen, ignored;
+
+		errno = 0;
+		de = readdir(d);
+		if (!de) {
+			if (errno) {
+				fprintf(stderr, "unable to read directory %s, keeping its entries\n", len ? dir : ".");
+				add_kept(wt, strdup(dir));
+			}
+			break;
+		}
+		if (de->d_name[0] == '.')
+			continue;
+		namelen = strlen(de->d_name);
+		/* 多分配一个字节, 子目录需要在结尾临时加上 '/' */
+		path = malloc(len + namelen + 3);
+		if (len) {
+			memcpy(path, dir, len);
+			path[len] = '/';
+			memcpy(path + len + 1, de->d_name, namelen + 1);
+		} else
+			memcpy(path, de->d_name, namelen + 1);
+		if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+			if (errno == ENOENT) {
+				free(path);
+				continue;
+			}
+			fprintf(stderr, "unable to stat %s, keeping its entries\n", path);
+			add_kept(wt, path);
+			continue;
+		}
+		/* 忽略规则只阻止添加新文件: 被忽略的目录不遍历, 其中已经在暂存区中的条目保持不变 */
+		ignored = is_ignored(path, de->d_name);
+		if (S_ISDIR(st.st_mode)) {
+			int plen = strlen(path);
+
+			if (ignored) {
+				add_kept(wt, path);
+				continue;
+			}
+			/* "dir/" 在 sparse 范围内, 说明目录下可能有需要的文件 */
+			path[plen] = '/';
+			path[plen+1] = 0;
+			if (!path_in_sparse(path, plen + 1)) {
+				free(path);
+				continue;
+			}
+			path[plen] = 0;
+			pthread_mutex_lock(&walk_mutex);
+			push_dir(path);
+			pthread_mutex_unlock(&walk_mutex);
+			continue;
+		}
+		if (!S_ISREG(st.st_mode) || !path_in_sparse(path, strlen(path))) {
+			free(path);
+			continue;
+		}
+		add_found(wt, path, &st, ignored);
+	}
+	closedir(d);
+}
+
+static void *walk_thread_fn(void *data)
+{
+	struct walk_thread *wt = data;
+
+	pthread_mutex_lock(&walk_mutex);
+	for (;;) {
+		char *dir;
+
+		while (!walk_nr && walk_busy)
+			pthread_cond_wait(&walk_cond, &walk_mutex);
+		if (!walk_nr)
+			break;
+		dir = walk_dirs[--walk_nr];
+		walk_busy++;
+		pthread_mutex_unlock(&walk_mutex);
+
+		read_one_dir(wt, dir);
+		free(dir);
+
+		pthread_mutex_lock(&walk_mutex);
+		walk_busy--;
+		if (!walk_nr && !walk_busy)
+			pthread_cond_broadcast(&walk_cond);
+	}
+	pthread_mutex_unlock(&walk_mutex);
+	return NULL;
+}
+
+static int compare_found(const void *a, const void *b)
+{
+	const struct found_file *f1 = a, *f2 = b;
+	return strcmp(f1->path, f2->path);
+}
+
+/* 判断 name 是否位于某个遍历的根目录下 */
+static int under_roots(const char *name, int namelen, char **roots, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		int len = strlen(roots[i]);
+		if (!len)
+			return 1;
+		if (namelen > len && name[len] == '/' && !memcmp(name, roots[i], len))
+			return 1;
+	}
+	return 0;
+}
+
+/* 判断 name 是否就是 kept 中的某个路径, 或者位于其下 */
+static int under_kept(const char *name, int namelen, char **kept, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		int len = strlen(kept[i]);
+		if (!len)
+			return 1;
+		if (namelen >= len && !memcmp(name, kept[i], len) &&
+		    (namelen == len || name[len] == '/'))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * 遍历 roots 指定的目录, 添加新增和修改的文件, 删除已经不存在的文件
+ */
+static int update_dirs(char **roots, int nr)
+{
+	struct walk_thread wt[MAX_WALK_THREADS];
+	struct found_file *found;
+	char **removed, **kept;
+	int i, j, threads, started, found_nr, removed_nr, kept_nr;
+
+	read_ignore();
+	/* 规范化根目录: 去掉结尾的 '/', "." 表示整个工作区 */
+	for (i = j = 0; i < nr; i++) {
+		char *root = strdup(roots[i]);
+		int len = strlen(root);
+
+		while (len && root[len-1] == '/')
+			root[--len] = 0;
+		if (!strcmp(root, "."))
+			root[0] = 0;
+		else if (!verify_path(root)) {
+			fprintf(stderr, "Ignoring path %s\n", roots[i]);
+			free(root);
+			continue;
+		}
+		roots[j++] = root;
+		push_dir(strdup(root));
+	}
+	nr = j;
+
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads < 1)
+		threads = 1;
+	if (threads > MAX_WALK_THREADS)
+		threads = MAX_WALK_THREADS;
+	memset(wt, 0, sizeof(wt));
+	for (started = 0; started < threads; started++) {
+		if (pthread_create(&wt[started].thread, NULL, walk_thread_fn, &wt[started]))
+			break;
+	}
+	/* 一个线程也创建不了时, 在主线程中遍历 */
+	if (!started) {
+		walk_thread_fn(&wt[0]);
+		threads = 1;
+	} else
+		threads = started;
+	found_nr = kept_nr = 0;
+	for (i = 0; i < threads; i++) {
+		if (started)
+			pthread_join(wt[i].thread, NULL);
+		found_nr += wt[i].nr;
+		kept_nr += wt[i].kept_nr;
+	}
+
+	/* 合并所有线程的结果并排序, 排序规则和 active_cache 相同 */
+	found = malloc((found_nr + 1) * sizeof(struct found_file));
+	kept = malloc((kept_nr + 1) * sizeof(char *));
+	found_nr = kept_nr = 0;
+	for (i = 0; i < threads; i++) {
+		memcpy(found + found_nr, wt[i].found, wt[i].nr * sizeof(struct found_file));
+		found_nr += wt[i].nr;
+		free(wt[i].found);
+		memcpy(kept + kept_nr, wt[i].kept, wt[i].kept_nr * sizeof(char *));
+		kept_nr += wt[i].kept_nr;
+		free(wt[i].kept);
+	}
+	qsort(found, found_nr, sizeof(struct found_file), compare_found);
+
+	/*
+	 * 和 active_cache 归并比较, 先记录需要删除的条目,
+	 * 因为添加和删除都会移动 active_cache 中的条目
+	 */
+	removed = malloc((active_nr + 1) * sizeof(char *));
+	removed_nr = 0;
+	i = j = 0;
+	while (i < active_nr || j < found_nr) {
+		struct cache_entry *ce = i < active_nr ? active_cache[i] : NULL;
+		int cmp;
+
+		if (!ce)
+			cmp = 1;
+		else if (j == found_nr)
+			cmp = -1;
+		else
+			cmp = strcmp(ce->name, found[j].path);
+		if (cmp < 0) {
+			/* 只在暂存区中, 范围内的条目需要删除, 没有遍历到的条目除外 */
+			if (under_roots(ce->name, ce->namelen, roots, nr) &&
+			    path_in_sparse(ce->name, ce->namelen) &&
+			    !under_kept(ce->name, ce->namelen, kept, kept_nr))
+				removed[removed_nr++] = ce->name;
+			i++;
+			continue;
+		}
+		if (!cmp) {
+			/* 文件没有变化, 不需要重新计算 blob */
+			if (!match_stat(ce, &found[j].st))
+				found[j].path = NULL;
+			i++;
+		} else if (found[j].ignored) {
+			/* 被忽略的新文件不添加 */
+			found[j].path = NULL;
+		}
+		j++;
+	}
+
+	for (i = 0; i < removed_nr; i++)
+		remove_file_from_cache(removed[i]);
+	for (j = 0; j < found_nr; j++) {
+		char *path = found[j].path;
+		if (!path)
+			continue;
+		if (!verify_path(path)) {
+			fprintf(stderr, "Ignoring path %s\n", path);
+			continue;
+		}
+		if (add_file_to_cache(path)) {
+			fprintf(stderr, "Unable to add %s to database\n", path);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * "update-cache <file>..."
+ * "update-cache -r <dir>..."
  * 示例: $ ./update-cache Makefile
+ *       $ ./update-cache -r .
  *
  * 添加新文件到暂存区(cache)中, 现在叫 staging
  * 1. 文件内容写入到 blob 数据中
@@ -311,6 +666,12 @@ int main(int argc, char **argv)
 		perror("unable to create new cachefile");
 		return -1;
 	}
+	/* 目录模式: 剩下的参数都是需要遍历的目录 */
+	if (argc > 1 && !strcmp(argv[1], "-r")) {
+		if (update_dirs(argv + 2, argc - 2) < 0)
+			goto out;
+		argc = 1;
+	}
 	for (i = 1 ; i < argc; i++) {
 		char *path = argv[i];
 		/* 检查文件参数 path 字符串中是否包含'.'和'\'字符 */
@@ -318,6 +679,11 @@ int main(int argc, char **argv)
 			fprintf(stderr, "Ignoring path %s\n", argv[i]);
 			continue;
 		}
+		/* sparse 范围以外的条目保持不变, 也不去访问工作区中的文件 */
+		if (!path_in_sparse(path, strlen(path))) {
+			fprintf(stderr, "Ignoring path %s outside sparse checkout\n", path);
+			continue;
+		}
 		/*
 		 * 将 path 指定的文件数据写入 blob 中, 文件信息写入到内存的 cache entry 中
 		 */
@@ -327,10 +693,14 @@ int main(int argc, char **argv)
 		}
 	}
 	/* 将内存中更新后的 cache entry 写入到 ".dircache/index.lock" 文件, 并命名回 ".dircache/index" */
-	if (!write_cache(newfd, active_cache, active_nr) && !rename(".dircache/index.lock", ".dircache/index"))
+	if (!write_cache(newfd, active_cache, active_nr) && !rename(".dircache/index.lock", ".dircache/index")) {
+		arena_release();
 		return 0;
+	}
 out:
 	unlink(".dircache/index.lock");
+	arena_release();
+	return 1;
 }
 
 /* #
@@ -402,4 +772,18 @@ out:
  * 00000080: a4 81 00 00 8b 63 00 00 14 00 00 00 c8 20 00 00  .....c....... ..
  * 00000090: 66 50 25 b1 1c e8 fb 16 fa db 7d ae bf 77 cb 54  fP%.......}..w.T
  * 000000a0: a2 ae 39 a1 06 00 52 45 41 44 4d 45 00 00 00 00  ..9...README....
+ *
+ * # 8. 使用目录模式添加整个工作区, 新增和修改的文件会被添加, 已删除的文件会从暂存区移除
+ * git-e83c5163$ rm README
+ * git-e83c5163$ ./update-cache -r .
+ * git-e83c5163$ ./show-diff -z | xargs -0 -n1 echo
+ * git-e83c5163$
+ *
+ * # 9. ".dircache/ignore" 只阻止添加新文件: 已经在暂存区中的 build/o 保留, 新文件 build/new 不添加
+ * git-e83c5163$ mkdir build && echo o > build/o && ./update-cache build/o
+ * git-e83c5163$ echo build > .dircache/ignore
+ * git-e83c5163$ echo n > build/new
+ * git-e83c5163$ ./update-cache -r .
+ * git-e83c5163$ ./read-tree $(./write-tree) | grep build
+ * 100644 build/o (31f80575ec73f0ac0987cb31b94f506a746a08ac)
  */
\ No newline at end of file
@@ -12,6 +12,9 @@ static int check_valid_sha1(unsigned char *sha1)
 	/* If we were anal, we'd check that the sha1 of the contents actually matches */
 	/* 检查对文件 filename 是否有读权限 (R_OK) */
 	ret = access(filename, R_OK);
+	/* 主对象目录中没有时, 再在备用对象目录中查找 */
+	if (ret && errno == ENOENT && has_sha1_file(sha1))
+		ret = 0;
 	if (ret)
 		perror(filename);
 	return ret;
@@ -35,39 +38,83 @@ static int prepend_integer(char *buffer, unsigned val, int i)
 #define ORIG_OFFSET (40)	/* Enough space to add the header of "tree <size>\0" */
 
 /*
- * 命令: "write-tree"
- * 示例: $ ./write-tree
+ * 将 cachep 开始的, 以 base (长度为 baselen, 包括结尾的 '/') 为前缀的所有条目写入一个 tree 对象
+ * 子目录中的条目递归写入子目录自己的 tree 对象, 在当前 tree 中只保存一条 "40000 <目录名>" 记录,
+ * 所以没有变化的子目录会得到相同的 sha1 值, 不会产生新的对象.
+ * 返回处理的条目数, tree 对象的 sha1 值存放在 returnsha1 中
+ *
+ * 索引中缓存了该目录有效的 tree 对象时, 直接使用缓存的 sha1 值, 不需要再生成 tree 数据,
+ * 所以只有 update-cache 修改过的目录才会重新生成.
  */
-int main(int argc, char **argv)
+static int tree_cache_changed;
+
+static int write_tree(struct cache_entry **cachep, int maxentries, const char *base, int baselen, unsigned char *returnsha1)
 {
-	unsigned long size, offset, val;
-	/* 读取索引文件".dircache/index"到内存, 建立缓存, 返回条目数 */
-	int i, entries = read_cache();
+	unsigned long size, offset;
+	int i, nr, dirlen = baselen ? baselen - 1 : 0;
+	struct cache_tree *ct;
 	char *buffer;
 
-	if (entries <= 0) {
-		fprintf(stderr, "No file-cache to create a tree of\n");
-		exit(1);
+	ct = cache_tree_lookup(base, dirlen);
+	if (ct && ct->entries <= maxentries) {
+		memcpy(returnsha1, ct->sha1, 20);
+		return ct->entries;
 	}
 
 	/* Guess at an initial size */
-	size = entries * 40 + 400;
+	size = maxentries * 40 + 400;
 	buffer = malloc(size);
 	offset = ORIG_OFFSET;
 
-	/* 遍历每一个条目 */
-	for (i = 0; i < entries; i++) {
-		struct cache_entry *ce = active_cache[i];
-		/* 根据 cache entry 的 sha1 值检查对应的文件是否存在且可读取 */
-		if (check_valid_sha1(ce->sha1) < 0)
-			exit(1);
-		if (offset + ce->namelen + 60 > size) {
-			size = alloc_nr(offset + ce->namelen + 60);
+	/* 遍历以 base 为前缀的每一个条目 */
+	nr = 0;
+	while (nr < maxentries) {
+		struct cache_entry *ce = cachep[nr];
+		const char *pathname = ce->name, *filename, *dirname;
+		int pathlen = ce->namelen, entrylen;
+		unsigned char *sha1;
+		unsigned int mode;
+
+		/* Did we hit the end of the directory? Return how many we wrote */
+		/* 已经不在 base 目录下了 */
+		if (baselen >= pathlen || memcmp(base, pathname, baselen))
+			break;
+
+		sha1 = ce->sha1;
+		mode = ce->st_mode;
+
+		/* Do we have _further_ subdirectories? */
+		/* 条目位于下一级子目录中, 递归写入子目录的 tree 对象 */
+		filename = pathname + baselen;
+		dirname = strchr(filename, '/');
+		if (dirname) {
+			int subdir_written;
+			unsigned char subdir_sha1[20];
+
+			subdir_written = write_tree(cachep + nr, maxentries - nr, pathname, dirname-pathname+1, subdir_sha1);
+			if (subdir_written < 0)
+				exit(1);
+			nr += subdir_written;
+
+			/* Now we need to write out the directory entry into this tree.. */
+			mode = S_IFDIR;
+			pathlen = dirname - pathname;
+			sha1 = subdir_sha1;
+		} else {
+			/* 根据 cache entry 的 sha1 值检查对应的文件是否存在且可读取 */
+			if (check_valid_sha1(sha1) < 0)
+				exit(1);
+			nr++;
+		}
+
+		entrylen = pathlen - baselen;
+		if (offset + entrylen + 60 > size) {
+			size = alloc_nr(offset + entrylen + 60);
 			buffer = realloc(buffer, size);
 		}
-		offset += sprintf(buffer + offset, "%o %s", ce->st_mode, ce->name);
+		offset += sprintf(buffer + offset, "%o %.*s", mode, entrylen, filename);
 		buffer[offset++] = 0;
-		memcpy(buffer + offset, ce->sha1, 20);
+		memcpy(buffer + offset, sha1, 20);
 		offset += 20;
 	}
 
@@ -77,11 +124,66 @@ int main(int argc, char **argv)
 	/* 填充 "tree " 字符串, 从 "tree " 开始到结束实际上是一个 tree 对象 */
 	memcpy(buffer+i, "tree ", 5);
 
-	buffer += i;
-	offset -= i;
-
 	/* 将 tree 对象数据写入到文件中 */
-	write_sha1_file(buffer, offset);
+	if (write_sha1_file(buffer + i, offset - i, returnsha1) < 0)
+		nr = -1;
+	else {
+		/* 记录到索引的 tree 缓存中 */
+		cache_tree_update(base, dirlen, nr, returnsha1);
+		tree_cache_changed = 1;
+	}
+	free(buffer);
+	return nr;
+}
+
+/*
+ * 命令: "write-tree"
+ * 示例: $ ./write-tree
+ */
+int main(int argc, char **argv)
+{
+	struct stat before, after;
+	unsigned char sha1[20];
+	int entries;
+
+	/* 记录读取时索引文件的状态, 写回 tree 缓存之前用来判断索引有没有被其他命令替换 */
+	if (stat(".dircache/index", &before) < 0)
+		memset(&before, 0, sizeof(before));
+	/* 读取索引文件".dircache/index"到内存, 建立缓存, 返回条目数 */
+	entries = read_cache();
+
+	if (entries <= 0) {
+		fprintf(stderr, "No file-cache to create a tree of\n");
+		exit(1);
+	}
+
+	/* 从顶层目录开始, 递归写入每一级目录的 tree 对象 */
+	if (write_tree(active_cache, entries, "", 0, sha1) != entries) {
+		fprintf(stderr, "unable to write tree\n");
+		exit(1);
+	}
+	printf("%s\n", sha1_to_hex(sha1));
+
+	/*
+	 * 将新的 tree 缓存写回索引文件, 下次没有变化的目录可以直接使用
+	 * 其他命令正在更新索引(拿不到 lock 文件)时, 只是不保存缓存, 不影响结果;
+	 * 读取以后索引已经被替换(写入索引的命令都是把 index.lock 改名为 index)时也不保存,
+	 * 否则会用旧的内容覆盖其他命令刚写入的条目
+	 */
+	if (tree_cache_changed) {
+		int newfd = open(".dircache/index.lock", O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (newfd >= 0) {
+			if (stat(".dircache/index", &after) < 0 ||
+			    after.st_ino != before.st_ino || after.st_dev != before.st_dev ||
+			    after.st_size != before.st_size ||
+			    after.st_mtim.tv_sec != before.st_mtim.tv_sec ||
+			    after.st_mtim.tv_nsec != before.st_mtim.tv_nsec ||
+			    write_cache(newfd, active_cache, entries) < 0 ||
+			    rename(".dircache/index.lock", ".dircache/index") < 0)
+				unlink(".dircache/index.lock");
+			close(newfd);
+		}
+	}
 	return 0;
 }
 
@@ -157,4 +259,13 @@ int main(int argc, char **argv)
  * 00000020: 2b 83 c5 6c 31 30 30 36 34 34 20 52 45 41 44 4d  +..l100644 READM
  * 00000030: 45 00 66 50 25 b1 1c e8 fb 16 fa db 7d ae bf 77  E.fP%.......}..w
  * 00000040: cb 54 a2 ae 39 a1                                .T..9.
+ *
+ * # 7. 暂存区中有子目录时, 每个目录都会写入一个 tree 对象, 上一级 tree 中保存子目录的 tree 对象
+ * git-e83c5163$ ./update-cache Makefile README images/commit-vs-tree-vs-blob.png
+ * git-e83c5163$ ./write-tree
+ * e8b54b68b8afd3aaccc159b0336e0ec2ac2cd8c2
+ * git-e83c5163$ ./read-tree e8b54b68b8afd3aaccc159b0336e0ec2ac2cd8c2
+ * 100644 Makefile (618a7a62e63123c0378f8f042cd4941752d1875a)
+ * 100644 README (665025b11ce8fb16fadb7daebf77cb54a2ae39a1)
+ * 100644 images/commit-vs-tree-vs-blob.png (333e59c57246867375568df42e5732185f66fb26)
  */
\ No newline at end of file